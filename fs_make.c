@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)			\
+do {					\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);			\
+} while (0)
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fs_make.x <diskname> <data block count> "
+		"[wide] [bs=<bytes>] [files=<count>]\n");
+	exit(1);
+}
+
+static size_t get_size(const char *arg)
+{
+	unsigned long long ret;
+	char *end;
+
+	errno = 0;
+	ret = strtoull(arg, &end, 0);
+	if (errno || end == arg || *end != '\0' || arg[0] == '-')
+		die("invalid number '%s'", arg);
+	return (size_t)ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_opts opts = { 0 };
+	char *diskname, *backing;
+	size_t data_blocks, max_blocks;
+	int i;
+
+	if (argc < 3)
+		usage();
+
+	diskname = argv[1];
+	data_blocks = get_size(argv[2]);
+	for (i = 3; i < argc; i++) {
+		if (!strcmp(argv[i], "wide"))
+			opts.flags |= FS_FORMAT_WIDE;
+		else if (!strncmp(argv[i], "bs=", 3))
+			opts.block_size = get_size(argv[i] + 3);
+		else if (!strncmp(argv[i], "files=", 6))
+			opts.dir_entries = get_size(argv[i] + 6);
+		else
+			usage();
+	}
+
+	/*
+	 * An image that is gone when fs_make exits is of no use: look past the
+	 * "sim:" layers at the disk that actually stores it
+	 */
+	backing = diskname;
+	while (!strncmp(backing, "sim:", 4))
+		backing += 4;
+	if (!strncmp(backing, "ram:", 4))
+		die("'%s' is not a persistent disk", diskname);
+
+	max_blocks = fs_format_max_blocks(&opts);
+	if (!max_blocks)
+		die("invalid block size '%zu'", opts.block_size);
+	if (data_blocks > max_blocks)
+		die("data block count too large, max is %zu", max_blocks);
+
+	/*
+	 * Only the superblock and the first FAT block are written, everything
+	 * else is left as a hole of the disk file
+	 */
+	if (fs_format(diskname, data_blocks, &opts))
+		die("cannot create '%s' with %zu data blocks", diskname,
+		    data_blocks);
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+	       data_blocks);
+
+	return 0;
+}
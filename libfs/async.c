@@ -0,0 +1,348 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "probes.h"
+
+/* Operations a request can carry */
+enum {
+	AIO_READ,
+	AIO_WRITE,
+	AIO_FSYNC,
+};
+
+/* FIFO of requests, linked through their next field */
+struct aio_queue {
+	struct fs_aiocb *head;
+	struct fs_aiocb *tail;
+};
+
+/* Worker pool, guarded by submitLock */
+static pthread_t workers[FS_AIO_WORKERS_MAX];
+static unsigned int workerCount;
+static int aioRunning;
+static int aioStopping;
+static struct aio_queue submitted;
+static pthread_mutex_t submitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submitKick = PTHREAD_COND_INITIALIZER;
+
+/* Completions waiting for fs_aio_poll(), guarded by doneLock */
+static struct aio_queue completed;
+static pthread_mutex_t doneLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t doneKick;
+static pthread_once_t doneKickOnce = PTHREAD_ONCE_INIT;
+/* Requests submitted and not completed yet */
+static unsigned int inflight;
+/* Signaled once per queued completion, for event loops */
+static int doneEventFd = -1;
+
+static void queue_push(struct aio_queue *q, struct fs_aiocb *cb)
+{
+	cb->next = NULL;
+	if (q->tail)
+		q->tail->next = cb;
+	else
+		q->head = cb;
+	q->tail = cb;
+}
+
+static struct fs_aiocb *queue_pop(struct aio_queue *q)
+{
+	struct fs_aiocb *cb = q->head;
+
+	if (cb) {
+		q->head = cb->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return cb;
+}
+
+/* Poll timeouts are measured on the monotonic clock */
+static void done_kick_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&doneKick, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void aio_complete(struct fs_aiocb *cb)
+{
+	uint64_t one = 1;
+
+	FS_PROBE2(aio_complete, cb->op, cb->result);
+	if (cb->callback) {
+		cb->callback(cb);
+		pthread_mutex_lock(&doneLock);
+		inflight--;
+		pthread_cond_broadcast(&doneKick);
+		pthread_mutex_unlock(&doneLock);
+		return;
+	}
+
+	pthread_mutex_lock(&doneLock);
+	queue_push(&completed, cb);
+	inflight--;
+	pthread_cond_broadcast(&doneKick);
+	if (doneEventFd != -1 && write(doneEventFd, &one, sizeof(one)) < 0) {
+		/* the counter is saturated, the loop gets woken up anyway */
+	}
+	pthread_mutex_unlock(&doneLock);
+}
+
+static void *aio_worker(void *arg)
+{
+	struct fs_aiocb *cb;
+
+	pthread_mutex_lock(&submitLock);
+	while (1) {
+		while (!submitted.head && !aioStopping)
+			pthread_cond_wait(&submitKick, &submitLock);
+		/* requests still queued are served before stopping */
+		cb = queue_pop(&submitted);
+		if (!cb)
+			break;
+		pthread_mutex_unlock(&submitLock);
+
+		switch (cb->op) {
+		case AIO_READ:
+			cb->result = fs_pread(cb->fd, cb->buf, cb->count,
+					      cb->offset);
+			break;
+		case AIO_WRITE:
+			cb->result = fs_pwrite(cb->fd, cb->buf, cb->count,
+					       cb->offset);
+			break;
+		default:
+			cb->result = fs_fsync(cb->fd);
+			break;
+		}
+		aio_complete(cb);
+
+		pthread_mutex_lock(&submitLock);
+	}
+	pthread_mutex_unlock(&submitLock);
+	return NULL;
+}
+
+static int do_fs_aio_stop(void);
+
+static int do_fs_aio_start(unsigned int nworkers)
+{
+	unsigned int i;
+
+	if (nworkers == 0 || nworkers > FS_AIO_WORKERS_MAX)
+		return -1;
+	pthread_once(&doneKickOnce, done_kick_init);
+
+	pthread_mutex_lock(&submitLock);
+	if (aioRunning) {
+		pthread_mutex_unlock(&submitLock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&doneLock);
+	doneEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_unlock(&doneLock);
+	if (doneEventFd == -1) {
+		pthread_mutex_unlock(&submitLock);
+		return -1;
+	}
+
+	aioStopping = 0;
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&workers[i], NULL, aio_worker, NULL))
+			break;
+	}
+	workerCount = i;
+	aioRunning = 1;
+	pthread_mutex_unlock(&submitLock);
+
+	if (workerCount < nworkers) {
+		do_fs_aio_stop();
+		return -1;
+	}
+	return 0;
+}
+
+static int do_fs_aio_stop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&submitLock);
+	if (!aioRunning || aioStopping) {
+		pthread_mutex_unlock(&submitLock);
+		return -1;
+	}
+	aioStopping = 1;
+	pthread_cond_broadcast(&submitKick);
+	pthread_mutex_unlock(&submitLock);
+
+	for (i = 0; i < workerCount; i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_mutex_lock(&submitLock);
+	workerCount = 0;
+	aioRunning = 0;
+	pthread_mutex_unlock(&submitLock);
+
+	pthread_mutex_lock(&doneLock);
+	close(doneEventFd);
+	doneEventFd = -1;
+	pthread_mutex_unlock(&doneLock);
+	return 0;
+}
+
+static int aio_submit(struct fs_aiocb *cb, int op)
+{
+	if (!cb)
+		return -1;
+
+	pthread_mutex_lock(&submitLock);
+	if (!aioRunning || aioStopping) {
+		pthread_mutex_unlock(&submitLock);
+		return -1;
+	}
+	pthread_mutex_lock(&doneLock);
+	inflight++;
+	pthread_mutex_unlock(&doneLock);
+
+	cb->op = op;
+	cb->result = -1;
+	queue_push(&submitted, cb);
+	pthread_cond_signal(&submitKick);
+	pthread_mutex_unlock(&submitLock);
+
+	FS_PROBE2(aio_submit, op, cb->fd);
+	return 0;
+}
+
+static int do_fs_aio_poll(struct fs_aiocb **done, int max, int timeout_ms)
+{
+	struct timespec deadline;
+	uint64_t count;
+	int n = 0;
+
+	if (!done || max <= 0)
+		return -1;
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&doneLock);
+	pthread_once(&doneKickOnce, done_kick_init);
+	/*
+	 * Reset the event first: a completion queued while draining leaves it
+	 * signaled, so an event loop wakes up spuriously rather than never
+	 */
+	if (doneEventFd != -1 && read(doneEventFd, &count, sizeof(count)) < 0) {
+		/* nothing was signaled */
+	}
+	/* wait for a completion, unless none can come */
+	while (!completed.head && inflight > 0 && timeout_ms != 0) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&doneKick, &doneLock);
+		} else if (pthread_cond_timedwait(&doneKick, &doneLock,
+						  &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	while (n < max && completed.head)
+		done[n++] = queue_pop(&completed);
+	/* completions left behind keep the event signaled */
+	if (completed.head && doneEventFd != -1) {
+		count = 1;
+		if (write(doneEventFd, &count, sizeof(count)) < 0) {
+			/* already signaled */
+		}
+	}
+	pthread_mutex_unlock(&doneLock);
+
+	return n;
+}
+
+static int do_fs_aio_eventfd(void)
+{
+	int fd;
+
+	pthread_mutex_lock(&doneLock);
+	fd = doneEventFd;
+	pthread_mutex_unlock(&doneLock);
+	return fd;
+}
+
+/*
+ * Public entry points, each firing a libfs:<name>_entry/<name>_return probe
+ * pair like the calls of fs.c
+ */
+
+int fs_aio_start(unsigned int nworkers)
+{
+	FS_PROBE1(fs_aio_start_entry, nworkers);
+	int ret = do_fs_aio_start(nworkers);
+	FS_PROBE1(fs_aio_start_return, ret);
+	return ret;
+}
+
+int fs_aio_stop(void)
+{
+	FS_PROBE(fs_aio_stop_entry);
+	int ret = do_fs_aio_stop();
+	FS_PROBE1(fs_aio_stop_return, ret);
+	return ret;
+}
+
+int fs_read_async(struct fs_aiocb *cb)
+{
+	FS_PROBE1(fs_read_async_entry, (uintptr_t)cb);
+	int ret = aio_submit(cb, AIO_READ);
+	FS_PROBE1(fs_read_async_return, ret);
+	return ret;
+}
+
+int fs_write_async(struct fs_aiocb *cb)
+{
+	FS_PROBE1(fs_write_async_entry, (uintptr_t)cb);
+	int ret = aio_submit(cb, AIO_WRITE);
+	FS_PROBE1(fs_write_async_return, ret);
+	return ret;
+}
+
+int fs_fsync_async(struct fs_aiocb *cb)
+{
+	FS_PROBE1(fs_fsync_async_entry, (uintptr_t)cb);
+	int ret = aio_submit(cb, AIO_FSYNC);
+	FS_PROBE1(fs_fsync_async_return, ret);
+	return ret;
+}
+
+int fs_aio_poll(struct fs_aiocb **done, int max, int timeout_ms)
+{
+	FS_PROBE2(fs_aio_poll_entry, max, timeout_ms);
+	int ret = do_fs_aio_poll(done, max, timeout_ms);
+	FS_PROBE1(fs_aio_poll_return, ret);
+	return ret;
+}
+
+int fs_aio_eventfd(void)
+{
+	FS_PROBE(fs_aio_eventfd_entry);
+	int ret = do_fs_aio_eventfd();
+	FS_PROBE1(fs_aio_eventfd_return, ret);
+	return ret;
+}
@@ -1,110 +1,197 @@
-#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "disk_ops.h"
+#include "latency.h"
+#include "probes.h"
+#include "stats.h"
 
-#define block_error(fmt, ...) \
-	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
-
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Bounce buffer of block_send() for what the backend can't send itself */
+#define SEND_BUF_SIZE (64 * 1024)
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Backend and its instance, NULL when no disk is open */
+	const struct disk_ops *ops;
+	void *dev;
 	/* Block count */
 	size_t bcount;
+	/* Block size in bytes */
+	size_t bsize;
+	/* Transfers bypass the host page cache */
+	int direct;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = { .bsize = BLOCK_SIZE };
+
+/* Backends with a name prefix, host files being the rest */
+static const struct disk_ops *const backends[] = {
+	&disk_ram_ops,
+	&disk_mmap_ops,
+	&disk_sim_ops,
+};
+
+const struct disk_ops *disk_ops_find(const char **name)
+{
+	size_t i, len;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		len = strlen(backends[i]->prefix);
+		if (!strncmp(*name, backends[i]->prefix, len)) {
+			*name += len;
+			return backends[i];
+		}
+	}
+
+	return &disk_file_ops;
+}
+
+/* Block sizes are powers of two between BLOCK_SIZE and BLOCK_SIZE_MAX */
+static int valid_block_size(size_t block_size)
+{
+	return block_size >= BLOCK_SIZE && block_size <= BLOCK_SIZE_MAX
+		&& (block_size & (block_size - 1)) == 0;
+}
 
 int block_disk_create(const char *diskname, size_t bcount)
 {
-	int fd;
+	return block_disk_create_sized(diskname, bcount, BLOCK_SIZE);
+}
+
+int block_disk_create_sized(const char *diskname, size_t bcount,
+			    size_t block_size)
+{
+	const struct disk_ops *ops;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
 		return -1;
 	}
 
-	/* Create and open virtual disk file */
-	if ((fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
-		perror("open");
+	if (!valid_block_size(block_size)) {
+		block_error("invalid block size '%zu'", block_size);
 		return -1;
 	}
 
-	/* Fill out the file with (bcount * BLOCK_SIZE) empty bytes */
-	if (ftruncate(fd, bcount * BLOCK_SIZE) < 0) {
-		perror("ftruncate");
-		return -1;
-	}
-
-	close(fd);
-
-	return 0;
+	/* Fill out the disk with (bcount * block_size) empty bytes */
+	ops = disk_ops_find(&diskname);
+	return ops->create(diskname, bcount * block_size);
 }
 
 int block_disk_open(const char *diskname)
 {
-	int fd;
-	struct stat st;
+	return block_disk_open_flags(diskname, 0);
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
+{
+	const struct disk_ops *ops;
+	size_t size;
+	void *dev;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	if (disk.dev) {
 		block_error("disk already open");
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	ops = disk_ops_find(&diskname);
+	if (!(dev = ops->open(diskname, &flags, &size)))
+		return -1;
+
+	/* The disk image's size should be a multiple of the block size */
+	if (size % BLOCK_SIZE != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    size, BLOCK_SIZE);
+		ops->close(dev);
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	disk.ops = ops;
+	disk.dev = dev;
+	disk.bsize = BLOCK_SIZE;
+	disk.bcount = size / BLOCK_SIZE;
+	disk.direct = !!(flags & BLOCK_DISK_DIRECT);
+
+	return 0;
+}
+
+int block_disk_set_size(size_t block_size)
+{
+	if (!disk.dev) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (!valid_block_size(block_size)) {
+		block_error("invalid block size '%zu'", block_size);
+		return -1;
+	}
+
+	/* Every block of the new size is made of whole default-sized blocks */
+	if ((disk.bcount * disk.bsize) % block_size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    disk.bcount * disk.bsize, block_size);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.bcount = disk.bcount * disk.bsize / block_size;
+	disk.bsize = block_size;
+
+	return 0;
+}
+
+size_t block_disk_block_size(void)
+{
+	return disk.bsize;
+}
+
+int block_disk_direct(void)
+{
+	return disk.dev && disk.direct;
+}
 
+/* Whether direct I/O can transfer @len bytes at @buf */
+static int direct_ok(const void *buf, size_t len)
+{
+	if (!disk.direct)
+		return 1;
+	if ((uintptr_t)buf % BLOCK_ALIGN == 0 && len % BLOCK_ALIGN == 0)
+		return 1;
+	block_error("buffer %p+%zu not aligned for direct I/O", buf, len);
 	return 0;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.dev) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	disk.ops->close(disk.dev);
 
-	disk.fd = INVALID_FD;
+	disk.ops = NULL;
+	disk.dev = NULL;
+	disk.bsize = BLOCK_SIZE;
+	disk.direct = 0;
 
 	return 0;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.dev) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -112,9 +199,51 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+int block_disk_sync(void)
+{
+	if (!disk.dev) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk.ops->sync(disk.dev) < 0)
+		return -1;
+	stats_inc(syncs);
+
+	return 0;
+}
+
+int block_discard(size_t block, size_t count)
+{
+	FS_PROBE2(block_discard, block, count);
+
+	if (!disk.dev) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block > disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	if (disk.ops->discard(disk.dev, (off_t)block * disk.bsize,
+			      count * disk.bsize) < 0)
+		return -1;
+	stats_add(blocks_discarded, count);
+
+	return 0;
+}
+
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	uint64_t start = lat_start();
+	struct iovec iov = { (void *)buf, disk.bsize };
+
+	FS_PROBE1(block_write, block);
+
+	if (!disk.dev) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -125,24 +254,25 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (!direct_ok(buf, disk.bsize))
 		return -1;
-	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (disk.ops->writev(disk.dev, &iov, 1, (off_t)block * disk.bsize))
 		return -1;
-	}
+	stats_inc(block_writes);
+	lat_record(FS_OP_BLOCK_WRITE, start);
 
 	return 0;
 }
 
 int block_read(size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	uint64_t start = lat_start();
+	struct iovec iov = { buf, disk.bsize };
+
+	FS_PROBE1(block_read, block);
+
+	if (!disk.dev) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -153,18 +283,172 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (!direct_ok(buf, disk.bsize))
+		return -1;
+
+	if (disk.ops->readv(disk.dev, &iov, 1, (off_t)block * disk.bsize))
+		return -1;
+	stats_inc(block_reads);
+	lat_record(FS_OP_BLOCK_READ, start);
+
+	return 0;
+}
+
+
+/* Check a run of blocks and the buffers meant to transfer it */
+static int check_vector(size_t block, size_t count, const struct iovec *iov,
+			int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	if (!disk.dev) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (count == 0 || block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
+	if (iovcnt <= 0 || iovcnt > UIO_MAXIOV) {
+		block_error("invalid buffer count '%d'", iovcnt);
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if (!direct_ok(iov[i].iov_base, iov[i].iov_len))
+			return -1;
+		len += iov[i].iov_len;
+	}
+	if (len != count * disk.bsize) {
+		block_error("buffers don't add up to %zu blocks", count);
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_writev(size_t block, size_t count, const struct iovec *iov,
+		 int iovcnt)
+{
+	uint64_t start = lat_start();
+
+	FS_PROBE2(block_writev, block, count);
+
+	if (check_vector(block, count, iov, iovcnt))
+		return -1;
+
+	if (disk.ops->writev(disk.dev, iov, iovcnt,
+			     (off_t)block * disk.bsize))
+		return -1;
+	stats_add(block_writes, count);
+	lat_record(FS_OP_BLOCK_WRITE, start);
+
 	return 0;
 }
 
+int block_readv(size_t block, size_t count, const struct iovec *iov,
+		int iovcnt)
+{
+	uint64_t start = lat_start();
+
+	FS_PROBE2(block_readv, block, count);
+
+	if (check_vector(block, count, iov, iovcnt))
+		return -1;
+
+	if (disk.ops->readv(disk.dev, iov, iovcnt,
+			    (off_t)block * disk.bsize))
+		return -1;
+	stats_add(block_reads, count);
+	lat_record(FS_OP_BLOCK_READ, start);
+
+	return 0;
+}
+
+/*
+ * Last resort of block_send(): through a buffer of bounded size, reading
+ * whole aligned blocks as direct I/O wants
+ */
+static int send_buffered(off_t off, size_t len, int fd)
+{
+	off_t end = (off_t)disk.bcount * disk.bsize;
+	struct iovec iov;
+	void *buf;
+	ssize_t ret = 0;
+
+	if (posix_memalign(&buf, BLOCK_ALIGN, SEND_BUF_SIZE)) {
+		block_error("out of memory");
+		return -1;
+	}
+
+	while (len > 0) {
+		off_t at = off & ~(off_t)(BLOCK_ALIGN - 1);
+		size_t skip = off - at;
+		size_t n = (skip + len + BLOCK_ALIGN - 1) & ~(size_t)(BLOCK_ALIGN - 1);
+
+		/* The disk's size is a multiple of BLOCK_ALIGN */
+		if (n > SEND_BUF_SIZE)
+			n = SEND_BUF_SIZE;
+		if (n > (size_t)(end - at))
+			n = end - at;
+		iov.iov_base = buf;
+		iov.iov_len = n;
+		if (disk.ops->readv(disk.dev, &iov, 1, at)) {
+			ret = -1;
+			break;
+		}
+		n -= skip;
+		if (n > len)
+			n = len;
+		for (size_t done = 0; done < n; done += ret) {
+			ret = write(fd, (char *)buf + skip + done, n - done);
+			if (ret < 0) {
+				perror("write");
+				break;
+			}
+		}
+		if (ret < 0)
+			break;
+		off += n;
+		len -= n;
+	}
+	free(buf);
+
+	return ret < 0 ? -1 : 0;
+}
+
+int block_send(size_t block, size_t offset, size_t len, int fd)
+{
+	uint64_t start = lat_start();
+	off_t off;
+	ssize_t ret = 0;
+
+	FS_PROBE3(block_send, block, offset, len);
+
+	if (!disk.dev) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk.bcount || offset > (disk.bcount - block) * disk.bsize
+	    || len > (disk.bcount - block) * disk.bsize - offset) {
+		block_error("byte range out of bounds (%zu:%zu+%zu/%zu)",
+			    block, offset, len, disk.bcount);
+		return -1;
+	}
+
+	/* The backend writes what it can without a buffer of ours */
+	off = (off_t)block * disk.bsize + offset;
+	if (disk.ops->send && (ret = disk.ops->send(disk.dev, off, len, fd)) < 0)
+		return -1;
+	stats_add(bytes_spliced, ret);
+	if ((size_t)ret < len && send_buffered(off + ret, len - ret, fd))
+		return -1;
+	lat_record(FS_OP_BLOCK_READ, start);
+
+	return 0;
+}
@@ -2,23 +2,81 @@
 #define _DISK_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
-/** Size of a disk block in bytes */
+/** Default (and smallest) size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Largest supported size of a disk block in bytes */
+#define BLOCK_SIZE_MAX (1024 * 1024)
+
+/** Alignment of the buffers of a disk opened with %BLOCK_DISK_DIRECT */
+#define BLOCK_ALIGN 4096
+
+/** block_disk_open_flags() flag: bypass the host page cache (O_DIRECT) */
+#define BLOCK_DISK_DIRECT 0x1
+
+/** block_sim_config() flag: add the delays up without sleeping */
+#define BLOCK_SIM_VIRTUAL 0x1
+
+/**
+ * struct block_sim_opts - Timing of the simulated disks
+ * @latency_us: Delay of every request, in microseconds
+ * @jitter_us: Largest random delay added to a request, in microseconds
+ * @bandwidth: Transfer rate in bytes per second, 0 for no limit
+ * @seed: Seed of the jitter, the same seed gives the same delays
+ * @flags: %BLOCK_SIM_VIRTUAL
+ */
+struct block_sim_opts {
+	unsigned int latency_us;
+	unsigned int jitter_us;
+	size_t bandwidth;
+	unsigned int seed;
+	int flags;
+};
+
+/*
+ * Disk names select the backend that stores the disk:
+ *
+ * - "ram:<name>": memory of the process, kept until it exits, so that a disk
+ *   can be created, opened and reopened without touching the host
+ * - "mmap:<path>": host file mapped in memory
+ * - "sim:<diskname>": disk <diskname>, any of these, with every request
+ *   delayed as set with block_sim_config()
+ * - anything else: host file, read and written with system calls
+ */
+
 /**
  * block_disk_create - Create a virtual disk file
  * @diskname: Name of the virtual disk file
  * @bcount: Block count
  *
  * Create a virtual disk of size @bcount x %BLOCK_SIZE bytes, as a single file
- * named @diskname on the host computer.
+ * named @diskname on the host computer, or in the backend that @diskname
+ * names.
  *
  * Return: -1 if @diskname is invalid or if the virtual disk file cannot be
  * created or truncated to the right size. 0 otherwise.
  */
 int block_disk_create(const char *diskname, size_t bcount);
 
+/**
+ * block_disk_create_sized - Create a virtual disk file with a given block size
+ * @diskname: Name of the virtual disk file
+ * @bcount: Block count
+ * @block_size: Size of a block in bytes
+ *
+ * Same as block_disk_create(), for a disk of @bcount blocks of @block_size
+ * bytes. The file is created sparse, so untouched blocks read back as zeroes.
+ *
+ * Return: -1 if @diskname or @block_size is invalid (see block_disk_set_size())
+ * or if the virtual disk file cannot be created or truncated to the right
+ * size. 0 otherwise.
+ */
+int block_disk_create_sized(const char *diskname, size_t bcount,
+			    size_t block_size);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -32,6 +90,54 @@ int block_disk_create(const char *diskname, size_t bcount);
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_flags - Open virtual disk file with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Open flags (%BLOCK_DISK_DIRECT)
+ *
+ * Like block_disk_open(). With %BLOCK_DISK_DIRECT, block transfers of host
+ * file disks bypass the host page cache, so that the disk isn't cached twice
+ * when the caller keeps a cache of its own. Every buffer handed to
+ * block_read(), block_write(), block_readv() and block_writev() must then
+ * start on a %BLOCK_ALIGN boundary and, for vectors, be a multiple of
+ * %BLOCK_ALIGN bytes long.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be
+ * opened, in particular without the page cache on a host file system that
+ * doesn't support it, or is already open. 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
+/**
+ * block_disk_direct - Tell whether the open disk bypasses the page cache
+ *
+ * Return: 1 if the open disk was opened with %BLOCK_DISK_DIRECT. 0 otherwise.
+ */
+int block_disk_direct(void);
+
+/**
+ * block_disk_set_size - Set the block size of the open disk
+ * @block_size: Size of a block in bytes
+ *
+ * A disk is opened with blocks of %BLOCK_SIZE bytes, which is enough to read
+ * the superblock. The file system then switches to the block size recorded in
+ * there, which changes the size of the transfers done by block_read() and
+ * block_write() and the block count reported by block_disk_count().
+ *
+ * Return: -1 if there was no virtual disk file opened, if @block_size is not a
+ * power of two between %BLOCK_SIZE and %BLOCK_SIZE_MAX, or if the size of the
+ * virtual disk file is not a multiple of @block_size. 0 otherwise.
+ */
+int block_disk_set_size(size_t block_size);
+
+/**
+ * block_disk_block_size - Get disk's block size
+ *
+ * Return: the size in bytes of the blocks of the currently open disk, or
+ * %BLOCK_SIZE if there is none.
+ */
+size_t block_disk_block_size(void);
+
 /**
  * block_disk_close - Close virtual disk file
  * @name: Name of the virtual disk file
@@ -48,13 +154,58 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_sync - Flush virtual disk file to stable storage
+ *
+ * Make every block previously written with block_write() durable on the host,
+ * by means of a single fdatasync() on the virtual disk file (msync() for
+ * mapped disks, nothing for RAM disks).
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush fails. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
+/**
+ * block_discard - Release blocks on the host
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Punch a hole in the virtual disk file over blocks @block to
+ * @block + @count - 1, so that they no longer take space on the host (RAM
+ * disks give the memory back). The blocks read back as zeroes until they are
+ * written again.
+ *
+ * Return: -1 if there was no virtual disk file opened, if the range is out of
+ * bounds, or if the host file system can't punch holes. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_send - Copy bytes of consecutive blocks to a host file
+ * @block: Index of the first block to copy from
+ * @offset: Offset of the first byte to copy in block @block
+ * @len: Number of bytes to copy
+ * @fd: Host file descriptor to copy to
+ *
+ * Write @len bytes of the virtual disk, starting at byte @offset of block
+ * @block, to file descriptor @fd at its current file offset. The host kernel
+ * moves the data of host file disks with copy_file_range() or sendfile() when
+ * it can, without it going through user space, mapped disks write it straight
+ * from the mapping, and a buffer of bounded size is used otherwise.
+ *
+ * Return: -1 if the range is out of bounds, or if reading the disk or writing
+ * to @fd fails. 0 otherwise.
+ */
+int block_send(size_t block, size_t offset, size_t len, int fd);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * Write the content of buffer @buf (one block, see block_disk_block_size()) in
+ * the virtual disk's block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
  * operation fails. 0 otherwise.
@@ -66,13 +217,69 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf.
+ * Read the content of virtual disk's block @block (one block, see
+ * block_disk_block_size()) into buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks to disk from several buffers
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @iov: Buffers to write, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the buffers described by @iov, which must add up to @count blocks,
+ * in the virtual disk's blocks @block to @block + @count - 1 with a single
+ * vectored write.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, if the buffers
+ * don't add up to @count blocks, or if the writing operation fails. 0
+ * otherwise.
+ */
+int block_writev(size_t block, size_t count, const struct iovec *iov,
+		 int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk into several buffers
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @iov: Buffers to fill, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Counterpart of block_writev() for reading.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, if the buffers
+ * don't add up to @count blocks, or if the reading operation fails. 0
+ * otherwise.
+ */
+int block_readv(size_t block, size_t count, const struct iovec *iov,
+		int iovcnt);
+
+/**
+ * block_sim_config - Set the timing of the simulated disks
+ * @opts: Timing, or NULL for no delays
+ *
+ * Every request to a "sim:" disk takes @opts->latency_us, plus a random part
+ * of @opts->jitter_us drawn from a sequence that @opts->seed starts, plus the
+ * time its bytes take at @opts->bandwidth. The calling thread sleeps that long,
+ * or with %BLOCK_SIM_VIRTUAL the delay is only added to block_sim_time(), so
+ * that runs are fast and repeatable. The time is reset to 0.
+ *
+ * Return: 0.
+ */
+int block_sim_config(const struct block_sim_opts *opts);
+
+/**
+ * block_sim_time - Get the time spent by the simulated disks
+ *
+ * Return: the delay, in nanoseconds, of the requests to "sim:" disks since
+ * the last block_sim_config().
+ */
+uint64_t block_sim_time(void);
+
 #endif /* _DISK_H */
 
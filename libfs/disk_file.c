@@ -0,0 +1,208 @@
+/* fallocate() and its hole punching mode, copy_file_range(), O_DIRECT */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "disk_ops.h"
+
+/* Open host file */
+struct file_dev {
+	int fd;
+	/* Opened with O_DIRECT */
+	int direct;
+};
+
+static int file_create(const char *name, size_t size)
+{
+	int fd;
+
+	/* Create and open virtual disk file */
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Fill out the file with @size empty bytes */
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static void *file_open(const char *name, int *flags, size_t *size)
+{
+	struct file_dev *dev;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(name, O_RDWR
+		       | ((*flags & BLOCK_DISK_DIRECT) ? O_DIRECT : 0), 0644)) < 0) {
+		perror("open");
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return NULL;
+	}
+
+	if (!(dev = malloc(sizeof(*dev)))) {
+		perror("malloc");
+		close(fd);
+		return NULL;
+	}
+
+	dev->fd = fd;
+	dev->direct = !!(*flags & BLOCK_DISK_DIRECT);
+	*size = st.st_size;
+
+	return dev;
+}
+
+static void file_close(void *dev)
+{
+	struct file_dev *f = dev;
+
+	close(f->fd);
+	free(f);
+}
+
+static size_t iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	while (iovcnt-- > 0)
+		len += iov[iovcnt].iov_len;
+
+	return len;
+}
+
+/*
+ * Positional I/O leaves the file offset alone, so concurrent accesses to the
+ * disk image don't race on it
+ */
+static int file_readv(void *dev, const struct iovec *iov, int iovcnt,
+		      off_t off)
+{
+	struct file_dev *f = dev;
+	ssize_t ret;
+
+	ret = preadv(f->fd, iov, iovcnt, off);
+	if (ret != (ssize_t)iov_len(iov, iovcnt)) {
+		if (ret < 0)
+			perror("preadv");
+		else
+			block_error("short read at offset %jd", (intmax_t)off);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_writev(void *dev, const struct iovec *iov, int iovcnt,
+		       off_t off)
+{
+	struct file_dev *f = dev;
+	ssize_t ret;
+
+	ret = pwritev(f->fd, iov, iovcnt, off);
+	if (ret != (ssize_t)iov_len(iov, iovcnt)) {
+		if (ret < 0)
+			perror("pwritev");
+		else
+			block_error("short write at offset %jd", (intmax_t)off);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_sync(void *dev)
+{
+	struct file_dev *f = dev;
+
+	if (fdatasync(f->fd) < 0) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_discard(void *dev, off_t off, size_t len)
+{
+	struct file_dev *f = dev;
+
+	/* Keep the size: the disk still has as many blocks */
+	if (fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      off, len) < 0) {
+		perror("fallocate");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Whether a host transfer method doesn't apply to a pair of files */
+static int send_unsupported(int err)
+{
+	return err == EINVAL || err == EXDEV || err == ENOSYS
+		|| err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+ * The kernel moves the data without it going through user space:
+ * copy_file_range() to a regular file, which may even share the extents, and
+ * sendfile() to anything else, pipes and sockets included
+ */
+static ssize_t file_send(void *dev, off_t off, size_t len, int fd)
+{
+	struct file_dev *f = dev;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	/* The kernel would copy through the page cache direct I/O bypasses */
+	if (f->direct)
+		return 0;
+
+	while (done < len) {
+		ret = copy_file_range(f->fd, &off, fd, NULL, len - done, 0);
+		if (ret < 0 && send_unsupported(errno))
+			ret = sendfile(fd, f->fd, &off, len - done);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	if (ret < 0 && !send_unsupported(errno)) {
+		perror("block_send");
+		return -1;
+	}
+
+	return done;
+}
+
+const struct disk_ops disk_file_ops = {
+	.prefix = "",
+	.create = file_create,
+	.open = file_open,
+	.close = file_close,
+	.readv = file_readv,
+	.writev = file_writev,
+	.sync = file_sync,
+	.discard = file_discard,
+	.send = file_send,
+};
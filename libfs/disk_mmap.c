@@ -0,0 +1,149 @@
+/* fallocate() and its hole punching mode */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "disk_ops.h"
+
+/* Host file mapped in memory, so transfers are plain memory copies */
+struct mmap_dev {
+	int fd;
+	char *mem;
+	size_t size;
+};
+
+/* Created like any disk file, only opened differently */
+static int mmap_create(const char *name, size_t size)
+{
+	return disk_file_ops.create(name, size);
+}
+
+static void *mmap_open(const char *name, int *flags, size_t *size)
+{
+	struct mmap_dev *dev;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(name, O_RDWR)) < 0) {
+		perror("open");
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return NULL;
+	}
+
+	if (!(dev = calloc(1, sizeof(*dev)))) {
+		perror("malloc");
+		close(fd);
+		return NULL;
+	}
+
+	dev->fd = fd;
+	dev->size = st.st_size;
+	if (dev->size) {
+		dev->mem = mmap(NULL, dev->size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+		if (dev->mem == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			free(dev);
+			return NULL;
+		}
+	}
+
+	/* The mapping is the page cache */
+	*flags &= ~BLOCK_DISK_DIRECT;
+	*size = dev->size;
+
+	return dev;
+}
+
+static void mmap_close(void *dev)
+{
+	struct mmap_dev *m = dev;
+
+	if (m->mem)
+		munmap(m->mem, m->size);
+	close(m->fd);
+	free(m);
+}
+
+static int mmap_readv(void *dev, const struct iovec *iov, int iovcnt,
+		      off_t off)
+{
+	struct mmap_dev *m = dev;
+
+	return disk_mem_readv(m->mem + off, iov, iovcnt);
+}
+
+static int mmap_writev(void *dev, const struct iovec *iov, int iovcnt,
+		       off_t off)
+{
+	struct mmap_dev *m = dev;
+
+	return disk_mem_writev(m->mem + off, iov, iovcnt);
+}
+
+static int mmap_sync(void *dev)
+{
+	struct mmap_dev *m = dev;
+
+	if (m->mem && msync(m->mem, m->size, MS_SYNC) < 0) {
+		perror("msync");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mmap_discard(void *dev, off_t off, size_t len)
+{
+	struct mmap_dev *m = dev;
+
+	/* The shared mapping sees the hole as zeroes */
+	if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      off, len) < 0) {
+		perror("fallocate");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Straight from the mapping, without a buffer in between */
+static ssize_t mmap_send(void *dev, off_t off, size_t len, int fd)
+{
+	struct mmap_dev *m = dev;
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = write(fd, m->mem + off + done, len - done);
+		if (ret < 0) {
+			perror("write");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return done;
+}
+
+const struct disk_ops disk_mmap_ops = {
+	.prefix = "mmap:",
+	.create = mmap_create,
+	.open = mmap_open,
+	.close = mmap_close,
+	.readv = mmap_readv,
+	.writev = mmap_writev,
+	.sync = mmap_sync,
+	.discard = mmap_discard,
+	.send = mmap_send,
+};
@@ -0,0 +1,69 @@
+#ifndef _DISK_OPS_H
+#define _DISK_OPS_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Error report of the block layer */
+#define block_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/*
+ * Operations of a block device backend
+ *
+ * disk.c checks the block ranges and the buffers, counts and times the
+ * transfers, and hands byte ranges of the device to these. Every operation
+ * returns -1 on failure, after printing why.
+ */
+struct disk_ops {
+	/* Prefix of the disk names the backend serves, "" for host files */
+	const char *prefix;
+	/* Create device @name of @size zero bytes, replacing any older one */
+	int (*create)(const char *name, size_t size);
+	/*
+	 * Open device @name and store its size in bytes in @size. Flags the
+	 * backend doesn't honour (%BLOCK_DISK_DIRECT) are cleared in @flags.
+	 */
+	void *(*open)(const char *name, int *flags, size_t *size);
+	void (*close)(void *dev);
+	/* Transfer exactly the bytes of @iov at byte @off of the device */
+	int (*readv)(void *dev, const struct iovec *iov, int iovcnt, off_t off);
+	int (*writev)(void *dev, const struct iovec *iov, int iovcnt,
+		      off_t off);
+	/* Make the writes done so far durable */
+	int (*sync)(void *dev);
+	/* Drop @len bytes at @off, which read back as zeroes afterwards */
+	int (*discard)(void *dev, off_t off, size_t len);
+	/*
+	 * Optional: write @len bytes at @off to host file @fd without a copy
+	 * of ours. Return how many bytes were, which can be fewer (even 0): the
+	 * rest is read with readv() and written by disk.c.
+	 */
+	ssize_t (*send)(void *dev, off_t off, size_t len, int fd);
+};
+
+/* Host file, the default */
+extern const struct disk_ops disk_file_ops;
+/* "ram:<name>", memory of the process */
+extern const struct disk_ops disk_ram_ops;
+/* "mmap:<path>", host file mapped in memory */
+extern const struct disk_ops disk_mmap_ops;
+/* "sim:<disk name>", timing simulator over another backend */
+extern const struct disk_ops disk_sim_ops;
+
+/* Gather or scatter the bytes of @iov from or to memory at @mem */
+int disk_mem_readv(const char *mem, const struct iovec *iov, int iovcnt);
+int disk_mem_writev(char *mem, const struct iovec *iov, int iovcnt);
+
+/*
+ * disk_ops_find - Find the backend serving a disk name
+ *
+ * Advance @name past the prefix of the backend.
+ *
+ * Return: the backend, the host file one when no prefix matches.
+ */
+const struct disk_ops *disk_ops_find(const char **name);
+
+#endif /* _DISK_OPS_H */
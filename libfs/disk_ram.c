@@ -0,0 +1,177 @@
+/* MAP_ANONYMOUS, MAP_NORESERVE */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "disk_ops.h"
+
+/*
+ * RAM disks live in anonymous memory until the process exits, so that a disk
+ * can be formatted, unmounted and mounted again. The memory is only committed
+ * as it is written, like the holes of a sparse disk file.
+ */
+struct ram_dev {
+	char *name;
+	char *mem;
+	size_t size;
+	/* Open instances, which keep the disk from being replaced */
+	int users;
+	struct ram_dev *next;
+};
+
+/* RAM disks by name */
+static struct ram_dev *ramDisks;
+
+static struct ram_dev *ram_find(const char *name)
+{
+	struct ram_dev *r;
+
+	for (r = ramDisks; r; r = r->next)
+		if (!strcmp(r->name, name))
+			return r;
+
+	return NULL;
+}
+
+static int ram_create(const char *name, size_t size)
+{
+	struct ram_dev *r = ram_find(name);
+	char *mem = NULL;
+
+	if (r && r->users) {
+		block_error("RAM disk '%s' is open", name);
+		return -1;
+	}
+
+	if (size) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE
+			   | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+	}
+
+	if (!r) {
+		if (!(r = calloc(1, sizeof(*r))) || !(r->name = strdup(name))) {
+			perror("malloc");
+			free(r);
+			if (mem)
+				munmap(mem, size);
+			return -1;
+		}
+		r->next = ramDisks;
+		ramDisks = r;
+	} else if (r->mem) {
+		munmap(r->mem, r->size);
+	}
+	r->mem = mem;
+	r->size = size;
+
+	return 0;
+}
+
+static void *ram_open(const char *name, int *flags, size_t *size)
+{
+	struct ram_dev *r = ram_find(name);
+
+	if (!r) {
+		block_error("no RAM disk '%s'", name);
+		return NULL;
+	}
+
+	/* There is no page cache to bypass */
+	*flags &= ~BLOCK_DISK_DIRECT;
+	*size = r->size;
+	r->users++;
+
+	return r;
+}
+
+static void ram_close(void *dev)
+{
+	struct ram_dev *r = dev;
+
+	r->users--;
+}
+
+int disk_mem_readv(const char *mem, const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(iov[i].iov_base, mem, iov[i].iov_len);
+		mem += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+int disk_mem_writev(char *mem, const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(mem, iov[i].iov_base, iov[i].iov_len);
+		mem += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static int ram_readv(void *dev, const struct iovec *iov, int iovcnt,
+		     off_t off)
+{
+	struct ram_dev *r = dev;
+
+	return disk_mem_readv(r->mem + off, iov, iovcnt);
+}
+
+static int ram_writev(void *dev, const struct iovec *iov, int iovcnt,
+		      off_t off)
+{
+	struct ram_dev *r = dev;
+
+	return disk_mem_writev(r->mem + off, iov, iovcnt);
+}
+
+static int ram_sync(void *dev)
+{
+	return 0;
+}
+
+static int ram_discard(void *dev, off_t off, size_t len)
+{
+	struct ram_dev *r = dev;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t head = (page - off % page) % page;
+
+	/* Give whole pages back to the host, they come back zeroed */
+	if (head > len)
+		head = len;
+	memset(r->mem + off, 0, head);
+	off += head;
+	len -= head;
+	if (len >= page && madvise(r->mem + off, len & ~(page - 1),
+				   MADV_DONTNEED) < 0) {
+		perror("madvise");
+		return -1;
+	}
+	memset(r->mem + off + (len & ~(page - 1)), 0, len & (page - 1));
+
+	return 0;
+}
+
+const struct disk_ops disk_ram_ops = {
+	.prefix = "ram:",
+	.create = ram_create,
+	.open = ram_open,
+	.close = ram_close,
+	.readv = ram_readv,
+	.writev = ram_writev,
+	.sync = ram_sync,
+	.discard = ram_discard,
+};
@@ -0,0 +1,165 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "disk.h"
+#include "disk_ops.h"
+
+/* Disk whose requests a "sim:" disk delays */
+struct sim_dev {
+	const struct disk_ops *ops;
+	void *dev;
+};
+
+static struct block_sim_opts simOpts;
+/* State of the jitter's xorshift generator, never 0 */
+static uint64_t simRand = 1;
+/* Delay injected since the last block_sim_config(), in nanoseconds */
+static uint64_t simTime;
+
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+
+int block_sim_config(const struct block_sim_opts *opts)
+{
+	static const struct block_sim_opts none;
+
+	pthread_mutex_lock(&simLock);
+	simOpts = opts ? *opts : none;
+	simRand = simOpts.seed ? simOpts.seed : 1;
+	simTime = 0;
+	pthread_mutex_unlock(&simLock);
+
+	return 0;
+}
+
+uint64_t block_sim_time(void)
+{
+	uint64_t ns;
+
+	pthread_mutex_lock(&simLock);
+	ns = simTime;
+	pthread_mutex_unlock(&simLock);
+
+	return ns;
+}
+
+/* Stand for the time a request of @len bytes takes on the simulated disk */
+static void sim_delay(size_t len)
+{
+	uint64_t ns;
+	struct timespec ts;
+	int sleep;
+
+	pthread_mutex_lock(&simLock);
+	ns = (uint64_t)simOpts.latency_us * 1000;
+	if (simOpts.jitter_us) {
+		simRand ^= simRand << 13;
+		simRand ^= simRand >> 7;
+		simRand ^= simRand << 17;
+		ns += simRand % ((uint64_t)simOpts.jitter_us * 1000 + 1);
+	}
+	if (simOpts.bandwidth)
+		ns += (uint64_t)len * 1000000000 / simOpts.bandwidth;
+	simTime += ns;
+	sleep = !(simOpts.flags & BLOCK_SIM_VIRTUAL);
+	pthread_mutex_unlock(&simLock);
+
+	/* Outside of the lock: concurrent requests overlap as on a real disk */
+	if (!sleep || !ns)
+		return;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (nanosleep(&ts, &ts) < 0)
+		;
+}
+
+static int sim_create(const char *name, size_t size)
+{
+	const struct disk_ops *ops = disk_ops_find(&name);
+
+	return ops->create(name, size);
+}
+
+static void *sim_open(const char *name, int *flags, size_t *size)
+{
+	struct sim_dev *s;
+
+	if (!(s = malloc(sizeof(*s)))) {
+		perror("malloc");
+		return NULL;
+	}
+
+	s->ops = disk_ops_find(&name);
+	if (!(s->dev = s->ops->open(name, flags, size))) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+static void sim_close(void *dev)
+{
+	struct sim_dev *s = dev;
+
+	s->ops->close(s->dev);
+	free(s);
+}
+
+static int sim_readv(void *dev, const struct iovec *iov, int iovcnt,
+		     off_t off)
+{
+	struct sim_dev *s = dev;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	sim_delay(len);
+
+	return s->ops->readv(s->dev, iov, iovcnt, off);
+}
+
+static int sim_writev(void *dev, const struct iovec *iov, int iovcnt,
+		      off_t off)
+{
+	struct sim_dev *s = dev;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	sim_delay(len);
+
+	return s->ops->writev(s->dev, iov, iovcnt, off);
+}
+
+static int sim_sync(void *dev)
+{
+	struct sim_dev *s = dev;
+
+	sim_delay(0);
+	return s->ops->sync(s->dev);
+}
+
+static int sim_discard(void *dev, off_t off, size_t len)
+{
+	struct sim_dev *s = dev;
+
+	/* Nothing moves, only the request goes through */
+	sim_delay(0);
+	return s->ops->discard(s->dev, off, len);
+}
+
+/* No send(): block_send() reads through sim_readv(), which is timed */
+const struct disk_ops disk_sim_ops = {
+	.prefix = "sim:",
+	.create = sim_create,
+	.open = sim_open,
+	.close = sim_close,
+	.readv = sim_readv,
+	.writev = sim_writev,
+	.sync = sim_sync,
+	.discard = sim_discard,
+};
@@ -4,152 +4,70 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>
 #include <limits.h>
-#include <sys/mman.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
 #include "disk.h"
 #include "fs.h"
+#include "latency.h"
+#include "pool.h"
+#include "probes.h"
+#include "stats.h"
 
-#define FAT_EOC 0xFFFF
-#define BLOCK_SIZE 4096
-#define FAT_ARRAY_SIZE 2048
-#define MAX_FILE_COUNT 128
+//in-memory end-of-chain marker, whatever the width of the FAT on disk
+#define FAT_EOC 0xFFFFFFFF
+#define FAT_EOC_V1 0xFFFF
+#define FAT_EOC_V2 0xFFFFFFFF
 
-#define BLOCK_SUPER 11
-#define BLOCK_FAT 12
-#define BLOCK_ROOT 13
-#define BLOCK_DATA 14
+//superblock signatures of the two on-disk format variants
+#define SIGNATURE_V1 "ECS150FS"
+#define SIGNATURE_V2 "ECS150F2"
 
-//===========================================================================//
-//                        LINKED LIST IMPLEMENTATION                         //
-//===========================================================================//
-
-struct node{
-	void* data;
-	struct node* next;
-	int index;
-	int struct_type;
-};
-
-struct linkedlist {
-	struct node* head;
-	struct node* tail;
-	int size;
-};
-
-typedef struct node* nodePtr;
-typedef struct linkedlist* list_t;
-
-int getIndex(nodePtr nd){
-	return nd->index;
-}
-
-int getType(nodePtr nd){
-	return nd->struct_type;
-}
-
-void* getData(nodePtr nd){
-	return nd->data;
-}
-
-list_t list_create(void)
-{
-	list_t listPtr = (list_t) malloc(sizeof(struct linkedlist));
-	listPtr->head = NULL;
-	listPtr->tail = NULL;
-	listPtr->size = 0;
-	return listPtr;
-}
-
-int list_length(list_t list)
-{
-	return (list == NULL ? -1 : list->size);
-}
-
-
-nodePtr list_get(list_t list, int index)
-{
-    if (list == NULL || index < 0) {
-        return NULL;
-    }
-    nodePtr current = list->head;
-	if(current == NULL){
-		return NULL;
-	}
-    while (current != NULL) {
-        if(current->index == index){
-            return current;
-		}
-        current = current->next;
-     }
-     return NULL;
-}
-
-int list_destroy(list_t list)
-{
-    int listLen = list_length(list);
-    if(listLen == -1){
-        free(list);
-        return 0;
-    }
+//superblock feature flags: data blocks shared between files (see
+//fs_copy_range()), which tools unaware of it would take for cross-links
+#define FEATURE_SHARED 0x1
 
-    for(int i = 0; i<listLen; i++){
-        nodePtr nd = list_get(list, i);
-        free(nd);
-    }
-    free(list);
-	return 0;
-}
-
-int list_add(list_t list, void *data, int struct_type)
-{
-	if (list == NULL || data == NULL) {
-		return -1;
-	}
-	nodePtr newTail = (nodePtr)(malloc(sizeof(struct node)));
-
-	newTail->struct_type = struct_type;
-	newTail->data = data;
-	if (list->size == 0) {
-		list->head = newTail;
-		list->tail = newTail;
-		newTail->index = 0;
-		list->size++;
-		return 0;
-	}
-
-	newTail->index = list->tail->index + 1;
-	list->tail->next = newTail;
-	list->tail = newTail;
-	list->size++;
-	return 0;
-}
+//FAT entries held by one FAT block, 16-bit (legacy) or 32-bit (wide) entries
+#define FAT_PER_BLOCK_V1(bs) ((bs) / 2)
+#define FAT_PER_BLOCK_V2(bs) ((bs) / 4)
 
-//===========================================================================//
-//                   END OF LINKED LIST IMPLEMENTATION                       //
-//===========================================================================//
+//location of a directory entry
+typedef struct {
+    //start block of the directory holding it, DIR_ROOT for the root directory
+    uint32_t dir;
+    //data block holding it (subdirectories only)
+    uint32_t block;
+    //slot in that block, or index in the root directory
+    uint32_t slot;
+} entryLoc;
 
 typedef struct {
+    //last component of the path the file was opened with, empty when free
     char fileName[16];
     size_t offset;
+    entryLoc loc;
+    //bumped whenever the slot is released, so that stale descriptors fail
+    uint32_t gen;
+    //next slot of the free list, -1 terminated
+    int nextFree;
 } fdOp;
 
-//===========================================================================//
-//                            GLOBAL VARIABLES                               //
-//===========================================================================//
-
-//global linked list of blocks
-list_t blockList;
-//global file descriptor count to make sure that each file descriptor is unique
-int fdCount = 0;
-//global array of ints to keep track of dirty bits for changed blocks (for more efficient unmounting)
-int *changedBlocks;
-//global array of file descriptor structs where index is the file descriptor integer
-fdOp *fileDes[32];
+//a file descriptor packs its slot in the low bits and the slot generation in
+//the bits above, keeping it a non-negative int
+#define FD_INDEX_BITS 20
+#define FD_INDEX_MASK ((1u << FD_INDEX_BITS) - 1)
+#define FD_GEN_MASK ((1u << (31 - FD_INDEX_BITS)) - 1)
+//slots of a newly mounted file system, the table doubling from there
+#define FD_TABLE_INITIAL 32
 
 //===========================================================================//
 //                        DEFINED BLOCK STRUCTS                              //
 //===========================================================================//
 
+//on-disk superblock of the legacy format (16-bit block numbers)
 typedef struct {
     char signature[8];
     uint16_t numBlocks;
@@ -157,730 +75,6341 @@ typedef struct {
     uint16_t dataStartIndex;
     uint16_t dataBlockCount;
     uint8_t fatBlockCount;
-    char padding[4079];
-} __attribute__((packed)) superblock;
+    uint16_t journalStart;
+    uint16_t journalBlockCount;
+    uint8_t features;
+    char padding[4074];
+} __attribute__((packed)) superblockV1;
 
+//on-disk superblock of the wide format (32-bit block numbers)
 typedef struct {
-    uint16_t entries[FAT_ARRAY_SIZE];
-} fat;
-
+    char signature[8];
+    uint32_t numBlocks;
+    uint32_t rootIndex;
+    uint32_t dataStartIndex;
+    uint32_t dataBlockCount;
+    uint32_t fatBlockCount;
+    uint32_t journalStart;
+    uint32_t journalBlockCount;
+    //block size in bytes, 0 standing for BLOCK_SIZE
+    uint32_t blockSize;
+    //root directory blocks, starting at rootIndex, 0 standing for 1
+    uint32_t rootBlockCount;
+    uint32_t features;
+    char padding[4048];
+} __attribute__((packed)) superblockV2;
+
+//on-disk root directory entries of both formats
 typedef struct {
     char fileName[16];
     uint32_t fileSize;
     uint16_t dataStartIndex;
     char padding[10];
-} __attribute__((packed)) rootEntry;
+} __attribute__((packed)) rootEntryV1;
+
+typedef struct {
+    char fileName[16];
+    uint32_t fileSize;
+    uint32_t dataStartIndex;
+    char padding[8];
+} __attribute__((packed)) rootEntryV2;
+
+//in-memory superblock, decoded from either format
+typedef struct {
+    int version;
+    uint32_t numBlocks;
+    uint32_t rootIndex;
+    uint32_t dataStartIndex;
+    uint32_t dataBlockCount;
+    uint32_t fatBlockCount;
+    uint32_t journalStart;
+    uint32_t journalBlockCount;
+    uint32_t blockSize;
+    uint32_t rootBlockCount;
+    uint32_t features;
+    //raw superblock as read from disk, so unknown bytes survive a rewrite
+    char raw[BLOCK_SIZE];
+} superblock;
+
+typedef struct {
+    char fileName[16];
+    uint32_t fileSize;
+    uint32_t dataStartIndex;
+    //raw padding bytes of the on-disk entry
+    char padding[10];
+} rootEntry;
 
+//in-memory root directory: its blocks are loaded in order, on demand, and the
+//entries loaded so far are indexed by name in a chained hash table
 typedef struct {
-    rootEntry entries[MAX_FILE_COUNT];
-} __attribute__((packed)) rootDirectory;
+    //room for every entry of the directory, filled as blocks get loaded
+    rootEntry *entries;
+    uint32_t perBlock;
+    uint32_t blockCount;
+    uint32_t loadedBlocks;
+    //number of used entries among the loaded ones
+    uint32_t used;
+    //lowest entry index that may be free
+    uint32_t freeHint;
+    //hash chains of entry indexes, -1 terminated
+    int32_t *hashHead;
+    int32_t *hashNext;
+    uint32_t hashMask;
+} rootDirectory;
+
+//===========================================================================//
+//                            GLOBAL VARIABLES                               //
+//===========================================================================//
 
+//global superblock of the mounted file system (NULL when nothing is mounted)
+superblock *sBlock = NULL;
+//global FAT, one 32-bit entry per data block whatever the on-disk width
+uint32_t *fatTable = NULL;
+//number of FAT entries held by a FAT block of the mounted format
+uint32_t fatPerBlock = FAT_PER_BLOCK_V1(BLOCK_SIZE);
+//number of free FAT entries, and lowest index that may be free
+uint32_t fatFree = 0;
+uint32_t fatFreeHint = 1;
+//links to each data block beyond the first, from chains sharing it (NULL
+//unless the file system has FEATURE_SHARED)
+uint32_t *fatRefs = NULL;
+//block size of the mounted file system, in bytes
+size_t blockSize = BLOCK_SIZE;
+//bounce buffer of one block for the write path (fsLock must be held)
+char *ioBlock = NULL;
+//global root directory
+rootDirectory *rootDir = NULL;
+//global array of ints to keep track of dirty bits for changed blocks (for more efficient unmounting)
+int *changedBlocks;
+//global count of blocks currently flagged in changedBlocks
+int dirtyCount = 0;
+//global file descriptor table, indexed by the slot bits of a descriptor
+fdOp *fileDes = NULL;
+int fdCapacity = 0;
+//head of the list of free slots, -1 when the table must grow
+int fdFreeHead = -1;
+//number of slots in use
+size_t fdOpenCount = 0;
+//most slots the table may grow to, see fs_set_open_max()
+size_t fdLimit = FS_OPEN_MAX_COUNT;
+//how the next mount does its block I/O, see fs_set_io_mode(), and whether
+//the mounted disk bypasses the host page cache
+int ioMode = 0;
+int ioDirect = 0;
+//global lock serializing every fs_* call and the background flusher, reads
+//only holding it to look their blocks up
+pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+//reads transferring data blocks after dropping fsLock: only bumped with
+//fsLock held, waited for (under readLock) before a block is freed or the disk
+//goes away
+int readsInFlight = 0;
+pthread_mutex_t readLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t readsDone = PTHREAD_COND_INITIALIZER;
+//journal geometry and state (journaling is off while journalBlocks is 0)
+int journalStartBlock = 0;
+int journalBlocks = 0;
+//next free log block, relative to the journal header
+int journalHead = 1;
+uint64_t journalSeq = 0;
+//set once a transaction is committed, until the next checkpoint syncs the log
+int journalLogDirty = 0;
+//last committed image of each metadata block not yet checkpointed in place
+void **ckptImages = NULL;
+//same for subdirectory blocks, which are data blocks: disk index and image
+typedef struct {
+    uint32_t index;
+    void* image;
+} ckptDirImage;
+ckptDirImage* ckptDirImages = NULL;
+uint32_t ckptDirCount = 0;
+uint32_t ckptDirCapacity = 0;
 
 //===========================================================================//
 //                        GETTER HELPER METHODS                              //
 //===========================================================================//
 
-//get a fdOp struct from the openFilesList by the file name (if its exists)
-fdOp* getFdOp(const char* filename){
-    if(fileDes == NULL){
+//get the fdOp struct of an open file descriptor, NULL if it is out of bounds,
+//closed, or left over from an earlier use of its slot
+fdOp* getFdOpByDescriptor(int fd){
+    if(fd < 0 || fileDes == NULL){
         return NULL;
     }
-
-    for(int i = 0; i < 32; i++){
-    	if(strcmp(fileDes[i]->fileName, filename) == 0){
-            return fileDes[i];
-        }
-    }
-    return NULL;
-}
-
-//get a fdOp struct from the openFilesList by the unique file descriptor integer (if its exists)
-fdOp* getFdOpByDescriptor(int fd){
-    if(fileDes == NULL || fd < 0 || fd > 31){
+    uint32_t i = (uint32_t)fd & FD_INDEX_MASK;
+    if(i >= (uint32_t)fdCapacity || fileDes[i].fileName[0] == '\0'
+            || (fileDes[i].gen & FD_GEN_MASK) != (uint32_t)fd >> FD_INDEX_BITS){
         return NULL;
     }
-	return fileDes[fd];
+	return &fileDes[i];
 }
 
 rootDirectory * getRootDirectory(){
-    nodePtr nd = list_get(blockList, 0);
-
-    if(nd == NULL){
-        return NULL;
-    }
-
-    superblock* sBlock = (superblock*)getData(nd);
-
-    nodePtr rootNd = list_get(blockList, sBlock->rootIndex);
-    rootDirectory* rBlock = (rootDirectory*)getData(rootNd);
-    return rBlock;
+    return rootDir;
 }
 
 //===========================================================================//
-//                       BLOCK INITIALIZE METHODS                            //
+//                        FILE DESCRIPTOR TABLE                              //
 //===========================================================================//
 
-superblock* init_superblock(){
+//add free slots to the descriptor table: FD_TABLE_INITIAL of them at first,
+//doubling it afterwards, without going past fdLimit
+int fdGrow(){
+    size_t capacity = (fdCapacity == 0) ? FD_TABLE_INITIAL : (size_t)fdCapacity * 2;
+    if(capacity > fdLimit){
+        capacity = fdLimit;
+    }
+    if(capacity <= (size_t)fdCapacity){
+        return -1;
+    }
 
-    void* block = malloc(BLOCK_SIZE);
-    int readSuccess = block_read(0, block); //take block at index 0 and copy into malloc'd block
+    fdOp* table = realloc(fileDes, capacity * sizeof(fdOp));
+    if(table == NULL){
+        return -1;
+    }
+    fileDes = table;
+    //new slots join the free list in order, so low descriptors go out first
+    for(int i = capacity - 1; i >= fdCapacity; i--){
+        memset(&fileDes[i], 0, sizeof(fdOp));
+        fileDes[i].nextFree = fdFreeHead;
+        fdFreeHead = i;
+    }
+    fdCapacity = capacity;
+    return 0;
+}
 
-    if(readSuccess == -1){
-        return NULL;
+//take a free slot of the descriptor table
+int fdAlloc(){
+    if(fdOpenCount >= fdLimit || (fdFreeHead == -1 && fdGrow() == -1)){
+        return -1;
     }
+    int i = fdFreeHead;
+    fdFreeHead = fileDes[i].nextFree;
+    fdOpenCount++;
+    return i;
+}
 
-    superblock* sBlock = (superblock*)malloc(sizeof(superblock));
+//give a slot back, invalidating every descriptor that referred to it
+void fdRelease(int i){
+    fileDes[i].fileName[0] = '\0';
+    fileDes[i].offset = 0;
+    fileDes[i].gen++;
+    fileDes[i].nextFree = fdFreeHead;
+    fdFreeHead = i;
+    fdOpenCount--;
+}
 
-    //use this variable to skip over previously read bytes
-    char* blockOffset = (char*)block;
+//get the FAT block holding the entry of data block index
+uint32_t fatBlockOf(uint32_t index){
+    return (index / fatPerBlock) + 1;
+}
 
-    //void * signature = malloc(8);
-    memcpy(sBlock->signature, (void *)blockOffset, 8);
+//get a zeroed buffer the size of a block of the mounted file system, from the
+//buffer pool when there is one left
+void* allocBlockBuf(){
+    return pool_get(blockSize);
+}
 
-    //======================================================//
+void freeBlockBuf(void* buf){
+    pool_put(buf);
+}
 
-    void * numBlocks = malloc(2);
-    blockOffset += 8;
-    memcpy(numBlocks, (void *)blockOffset , 2);
+//flag the FAT block holding the entry of data block index as changed
+void markDirty(int index);
+void markFatDirty(uint32_t index){
+    markDirty(fatBlockOf(index));
+}
 
-    sBlock->numBlocks = *((uint16_t*)numBlocks);
+//===========================================================================//
+//                     BLOCK DECODE / ENCODE METHODS                         //
+//===========================================================================//
 
-    //======================================================//
+superblock* init_superblock(){
 
-    void * rootIndex = malloc(2);
-    blockOffset += 2;
-    memcpy(rootIndex, (void *)blockOffset , 2);
+    stats_inc(cache_misses);
 
-    sBlock->rootIndex = *((uint16_t*)rootIndex);
+    superblock* sb = (superblock*)calloc(1, sizeof(superblock));
 
-    //======================================================//
+    //take block at index 0 and keep a raw copy of it, the disk is still
+    //opened with BLOCK_SIZE blocks so this is the superblock alone
+    char* block = pool_get(BLOCK_SIZE);
+    if(block == NULL || block_read(0, block) == -1){
+        pool_put(block);
+        free(sb);
+        return NULL;
+    }
+    memcpy(sb->raw, block, BLOCK_SIZE);
+    pool_put(block);
+
+    if(memcmp(sb->raw, SIGNATURE_V1, 8) == 0){
+        superblockV1* disk = (superblockV1*)sb->raw;
+        sb->version = 1;
+        sb->numBlocks = disk->numBlocks;
+        sb->rootIndex = disk->rootIndex;
+        sb->dataStartIndex = disk->dataStartIndex;
+        sb->dataBlockCount = disk->dataBlockCount;
+        sb->fatBlockCount = disk->fatBlockCount;
+        //journal location, left zeroed by formatters that don't know about it
+        sb->journalStart = disk->journalStart;
+        sb->journalBlockCount = disk->journalBlockCount;
+        sb->features = disk->features;
+        sb->blockSize = BLOCK_SIZE;
+        sb->rootBlockCount = 1;
+    }
+    else if(memcmp(sb->raw, SIGNATURE_V2, 8) == 0){
+        superblockV2* disk = (superblockV2*)sb->raw;
+        sb->version = 2;
+        sb->numBlocks = disk->numBlocks;
+        sb->rootIndex = disk->rootIndex;
+        sb->dataStartIndex = disk->dataStartIndex;
+        sb->dataBlockCount = disk->dataBlockCount;
+        sb->fatBlockCount = disk->fatBlockCount;
+        sb->journalStart = disk->journalStart;
+        sb->journalBlockCount = disk->journalBlockCount;
+        sb->blockSize = disk->blockSize ? disk->blockSize : BLOCK_SIZE;
+        sb->rootBlockCount = disk->rootBlockCount ? disk->rootBlockCount : 1;
+        sb->features = disk->features;
+    }
+    else{
+        free(sb);
+        return NULL;
+    }
+    return sb;
+}
 
-    void * dataStartIndex = malloc(2);
-    blockOffset += 2;
-    memcpy(dataStartIndex, (void *)blockOffset , 2);
+void encode_superblock(void* block){
+    memset(block, 0, blockSize);
+    memcpy(block, sBlock->raw, BLOCK_SIZE);
+
+    if(sBlock->version == 1){
+        superblockV1* disk = (superblockV1*)block;
+        disk->numBlocks = sBlock->numBlocks;
+        disk->rootIndex = sBlock->rootIndex;
+        disk->dataStartIndex = sBlock->dataStartIndex;
+        disk->dataBlockCount = sBlock->dataBlockCount;
+        disk->fatBlockCount = sBlock->fatBlockCount;
+        disk->journalStart = sBlock->journalStart;
+        disk->journalBlockCount = sBlock->journalBlockCount;
+        disk->features = sBlock->features;
+    }
+    else{
+        superblockV2* disk = (superblockV2*)block;
+        disk->numBlocks = sBlock->numBlocks;
+        disk->rootIndex = sBlock->rootIndex;
+        disk->dataStartIndex = sBlock->dataStartIndex;
+        disk->dataBlockCount = sBlock->dataBlockCount;
+        disk->fatBlockCount = sBlock->fatBlockCount;
+        disk->journalStart = sBlock->journalStart;
+        disk->journalBlockCount = sBlock->journalBlockCount;
+        disk->blockSize = sBlock->blockSize;
+        disk->rootBlockCount = sBlock->rootBlockCount;
+        disk->features = sBlock->features;
+    }
+}
 
-    sBlock->dataStartIndex = *((uint16_t*)dataStartIndex);
+//load every FAT block into the flat in-memory FAT
+uint32_t* init_fat(){
+    size_t entries = (size_t)sBlock->fatBlockCount * fatPerBlock;
+    uint32_t* table = (uint32_t*)malloc(entries * sizeof(uint32_t));
+    char* block = allocBlockBuf();
 
-    //======================================================//
+    if(table == NULL || block == NULL){
+        free(table);
+        freeBlockBuf(block);
+        return NULL;
+    }
 
-    void * dataBlockCount = malloc(2);
-    blockOffset += 2;
-    memcpy(dataBlockCount, (void *)blockOffset , 2);
+    for(uint32_t b = 0; b < sBlock->fatBlockCount; b++){
+        stats_inc(cache_misses);
+        if(block_read(b + 1, block) == -1){
+            free(table);
+            freeBlockBuf(block);
+            return NULL;
+        }
 
-    sBlock->dataBlockCount = *((uint16_t*)dataBlockCount);
+        uint32_t* dst = table + (size_t)b * fatPerBlock;
+        if(sBlock->version == 1){
+            uint16_t* src = (uint16_t*)block;
+            for(uint32_t i = 0; i < fatPerBlock; i++){
+                dst[i] = (src[i] == FAT_EOC_V1) ? FAT_EOC : src[i];
+            }
+        }
+        else{
+            memcpy(dst, block, blockSize);
+        }
+    }
+    freeBlockBuf(block);
 
-    //======================================================//
+    fatFree = 0;
+    for(uint32_t i = 0; i < sBlock->dataBlockCount; i++){
+        if(table[i] == 0){
+            fatFree++;
+        }
+    }
+    fatFreeHint = 1;
+    return table;
+}
 
-    void * fatBlockCount = malloc(1);
-    blockOffset += 2;
-    memcpy(fatBlockCount, (void *)blockOffset , 1);
+//count the links to each data block beyond the first one, blocks being
+//shared only as the common tail of several chains
+uint32_t* init_fatRefs(){
+    uint32_t* refs = (uint32_t*)calloc(sBlock->dataBlockCount, sizeof(uint32_t));
 
-    sBlock->fatBlockCount = *((uint16_t*)fatBlockCount);
+    if(refs == NULL){
+        return NULL;
+    }
+    for(uint32_t i = 1; i < sBlock->dataBlockCount; i++){
+        uint32_t next = fatTable[i];
+        if(next != 0 && next != FAT_EOC && next < sBlock->dataBlockCount){
+            refs[next]++;
+        }
+    }
+    for(uint32_t i = 1; i < sBlock->dataBlockCount; i++){
+        if(refs[i] > 0){
+            refs[i]--;
+        }
+    }
+    return refs;
+}
 
-	changedBlocks = (int *)calloc(sBlock->numBlocks, sizeof(int));
+void encode_fat(uint32_t fatBlock, void* block){
+    uint32_t* src = fatTable + (size_t)(fatBlock - 1) * fatPerBlock;
 
-    return sBlock;
+    if(sBlock->version == 1){
+        uint16_t* dst = (uint16_t*)block;
+        for(uint32_t i = 0; i < fatPerBlock; i++){
+            dst[i] = (src[i] == FAT_EOC) ? FAT_EOC_V1 : src[i];
+        }
+    }
+    else{
+        memcpy(block, src, blockSize);
+    }
 }
 
-fat* init_fat(int index){
-
-    fat* fBlock = (fat*)malloc(sizeof(fat));
+//FNV-1a of a file name
+uint32_t hashName(const char* name){
+    uint32_t hash = 2166136261u;
+    for(int i = 0; i < 16 && name[i] != '\0'; i++){
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
 
-    void* block = malloc(BLOCK_SIZE);
-    int readSuccess = block_read(index, block); //take block at index 0 and copy into malloc'd block
+void decode_rootEntry(const void* block, uint32_t i, rootEntry* entry){
+    if(sBlock->version == 1){
+        const rootEntryV1* disk = (const rootEntryV1*)block + i;
+        memcpy(entry->fileName, disk->fileName, 16);
+        entry->fileSize = disk->fileSize;
+        //the reference tools store empty files with the 16-bit end of chain
+        entry->dataStartIndex = (disk->dataStartIndex == FAT_EOC_V1) ? FAT_EOC
+                : disk->dataStartIndex;
+        memcpy(entry->padding, disk->padding, 10);
+    }
+    else{
+        const rootEntryV2* disk = (const rootEntryV2*)block + i;
+        memcpy(entry->fileName, disk->fileName, 16);
+        entry->fileSize = disk->fileSize;
+        entry->dataStartIndex = disk->dataStartIndex;
+        memcpy(entry->padding, disk->padding, 8);
+    }
+}
 
-    if(readSuccess == -1){
+//set up an empty root directory, none of its blocks loaded yet
+rootDirectory* init_rootDir(){
+    rootDirectory* rDir = (rootDirectory*)calloc(1, sizeof(rootDirectory));
+    if(rDir == NULL){
         return NULL;
     }
+    rDir->perBlock = blockSize / sizeof(rootEntryV1);
+    rDir->blockCount = sBlock->rootBlockCount;
 
-    char* blockOffset = (char*)block;
-
-    for(int i=0; i<FAT_ARRAY_SIZE; i++){
-        uint16_t* entry = (uint16_t*)malloc(2);
-        memcpy(entry, (void *)blockOffset, 2);
-        fBlock->entries[i] = *entry;
-        blockOffset += 2;
+    size_t capacity = (size_t)rDir->perBlock * rDir->blockCount;
+    size_t buckets = 64;
+    while(buckets < capacity){
+        buckets <<= 1;
     }
-    return fBlock;
+    rDir->hashMask = buckets - 1;
+
+    //entries only get touched as their blocks are loaded
+    rDir->entries = (rootEntry*)malloc(capacity * sizeof(rootEntry));
+    rDir->hashNext = (int32_t*)malloc(capacity * sizeof(int32_t));
+    rDir->hashHead = (int32_t*)malloc(buckets * sizeof(int32_t));
+    if(rDir->entries == NULL || rDir->hashNext == NULL || rDir->hashHead == NULL){
+        free(rDir->entries);
+        free(rDir->hashNext);
+        free(rDir->hashHead);
+        free(rDir);
+        return NULL;
+    }
+    memset(rDir->hashHead, 0xFF, buckets * sizeof(int32_t));
+	return rDir;
 }
 
-rootDirectory* init_rootDir(uint16_t rootIndex){
+void free_rootDir(rootDirectory* rDir){
+    if(rDir != NULL){
+        free(rDir->entries);
+        free(rDir->hashNext);
+        free(rDir->hashHead);
+        free(rDir);
+    }
+}
 
-    void* block = malloc(BLOCK_SIZE);
-    int readSuccess = block_read(rootIndex, block); //take block at index 0 and copy into malloc'd block
+void indexEntry(uint32_t i){
+    uint32_t h = hashName(rootDir->entries[i].fileName) & rootDir->hashMask;
+    rootDir->hashNext[i] = rootDir->hashHead[h];
+    rootDir->hashHead[h] = i;
+}
 
-    if(readSuccess == -1){
-        return NULL;
+void unindexEntry(uint32_t i){
+    uint32_t h = hashName(rootDir->entries[i].fileName) & rootDir->hashMask;
+    int32_t* link = &rootDir->hashHead[h];
+    while(*link != (int32_t)i){
+        link = &rootDir->hashNext[*link];
     }
+    *link = rootDir->hashNext[i];
+}
 
-    rootDirectory* rootDir = (rootDirectory*)malloc(sizeof(rootDirectory));
+//load the next root directory block and index its entries
+int load_rootBlock(){
+    uint32_t b = rootDir->loadedBlocks;
 
-    //use this variable to skip over previously read bytes
-    char* blockOffset = (char*)block;
+    stats_inc(cache_misses);
 
-    for(int i=0; i<MAX_FILE_COUNT; i++){
-        rootEntry* entry = (rootEntry*)malloc(sizeof(rootEntry));
+    char* block = allocBlockBuf();
+    if(block == NULL || block_read(sBlock->rootIndex + b, block) == -1){
+        freeBlockBuf(block);
+        return -1;
+    }
+    for(uint32_t i = 0; i < rootDir->perBlock; i++){
+        uint32_t index = b * rootDir->perBlock + i;
+        decode_rootEntry(block, i, &rootDir->entries[index]);
+        if(rootDir->entries[index].fileName[0] != '\0'){
+            indexEntry(index);
+            rootDir->used++;
+        }
+    }
+    freeBlockBuf(block);
+    rootDir->loadedBlocks++;
+    return 0;
+}
 
-        memcpy(entry->fileName, (void *)blockOffset, 16);
+//load whatever part of the root directory is still on disk only
+int load_rootDir(){
+    while(rootDir->loadedBlocks < rootDir->blockCount){
+        if(load_rootBlock() == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
 
-        //======================================================//
+//get the entry of a file, loading directory blocks until it shows up
+rootEntry* findEntry(const char* filename){
+    uint32_t h = hashName(filename) & rootDir->hashMask;
 
-        blockOffset += 16;
-        void * fileSize = malloc(4);
-        memcpy(fileSize, (void *)blockOffset , 4);
+    for(;;){
+        for(int32_t i = rootDir->hashHead[h]; i != -1; i = rootDir->hashNext[i]){
+            if(strncmp(rootDir->entries[i].fileName, filename, 16) == 0){
+                stats_inc(cache_hits);
+                return &rootDir->entries[i];
+            }
+        }
+        if(rootDir->loadedBlocks == rootDir->blockCount || load_rootBlock() == -1){
+            return NULL;
+        }
+    }
+}
 
-        entry->fileSize = *((uint32_t*)fileSize);
+//get a free entry, loading directory blocks until one shows up
+rootEntry* findFreeEntry(){
+    for(;;){
+        uint32_t loaded = rootDir->loadedBlocks * rootDir->perBlock;
+        for(; rootDir->freeHint < loaded; rootDir->freeHint++){
+            if(rootDir->entries[rootDir->freeHint].fileName[0] == '\0'){
+                return &rootDir->entries[rootDir->freeHint];
+            }
+        }
+        if(rootDir->loadedBlocks == rootDir->blockCount || load_rootBlock() == -1){
+            return NULL;
+        }
+    }
+}
 
-        //======================================================//
+//flag the directory block holding entry as changed
+void markEntryDirty(rootEntry* entry){
+    uint32_t i = entry - rootDir->entries;
+    markDirty(sBlock->rootIndex + i / rootDir->perBlock);
+}
 
-        blockOffset += 4;
-        void * dataStartIndex = malloc(2);
-        memcpy(dataStartIndex, (void *)blockOffset , 2);
+//encode one block worth of directory entries
+void encode_entries(const rootEntry* entries, void* block){
+    //the entries fill the start of the block, the rest stays zeroed
+    memset(block, 0, blockSize);
+    for(uint32_t i = 0; i < blockSize / sizeof(rootEntryV1); i++){
+        const rootEntry* entry = &entries[i];
+
+        if(sBlock->version == 1){
+            rootEntryV1* disk = (rootEntryV1*)block + i;
+            memcpy(disk->fileName, entry->fileName, 16);
+            disk->fileSize = entry->fileSize;
+            disk->dataStartIndex = (entry->dataStartIndex == FAT_EOC) ? FAT_EOC_V1
+                    : entry->dataStartIndex;
+            memcpy(disk->padding, entry->padding, 10);
+        }
+        else{
+            rootEntryV2* disk = (rootEntryV2*)block + i;
+            memcpy(disk->fileName, entry->fileName, 16);
+            disk->fileSize = entry->fileSize;
+            disk->dataStartIndex = entry->dataStartIndex;
+            memcpy(disk->padding, entry->padding, 8);
+        }
+    }
+}
 
-        entry->dataStartIndex = *((uint16_t*)dataStartIndex);
+//encode root directory block b, which is loaded since it is dirty
+void encode_rootBlock(uint32_t b, void* block){
+    encode_entries(&rootDir->entries[b * rootDir->perBlock], block);
+}
 
-        //move data offset by 10 to account for the unused/padding area of the entry
-        blockOffset += 12;
+void encodeDirBlock(uint32_t block, void* buf);
 
-        rootDir->entries[i] = *entry;
+//build the on-disk image of metadata block index, or of a cached subdirectory
+//block given by its disk index
+void encodeBlock(uint32_t index, void* block){
+    if(index >= sBlock->dataStartIndex){
+        encodeDirBlock(index - sBlock->dataStartIndex, block);
+    }
+    else if(index == 0){
+        encode_superblock(block);
+    }
+    else if(index >= sBlock->rootIndex){
+        encode_rootBlock(index - sBlock->rootIndex, block);
+    }
+    else{
+        encode_fat(index, block);
     }
-	return rootDir;
 }
 
 //===========================================================================//
-//                          IMPLEMENTED FS METHODS                           //
+//                         DIRTY BLOCK TRACKING                              //
 //===========================================================================//
 
-int fs_mount(const char *diskname)
-{
-    int success = block_disk_open(diskname);
+void flusher_kick(void);
 
-    if(success == -1){
-        return -1;
+//flag a metadata block as changed so that it gets written back to disk
+void markDirty(int index){
+    if(changedBlocks[index] == 0){
+        changedBlocks[index] = 1;
+        dirtyCount++;
+        flusher_kick();
     }
+}
 
-    blockList = list_create();
-	for(int i = 0; i < 32; i++){
-		fileDes[i] = (fdOp*)malloc(sizeof(fdOp));
-		fileDes[i]->fileName[0] = '\0';
-		fileDes[i]->offset = 0;
-	}
+int journal_commit(void);
+int journal_checkpoint(void);
+int dirCacheFlush();
+uint32_t dirCacheDirty(uint32_t* blocks);
+void dirCacheClean(uint32_t block);
+
+//write every dirty metadata block back to disk (fsLock must be held)
+//returns the number of blocks written, or -1 if a write failed
+int flushDirtyBlocks(){
+    int flushed = 0;
+    char* block;
+
+    //with a journal, dirty blocks go to the log as one transaction instead,
+    //subdirectory blocks included
+    if(journalBlocks > 0){
+        flushed = journal_commit();
+        if(flushed != -2){
+            return flushed;
+        }
+        //transaction too large for the log, fall back to in-place writes, but
+        //apply the older committed images first so they can't land on top of
+        //the newer in-place blocks at the next checkpoint or replay
+        if(journal_checkpoint() == -1){
+            return -1;
+        }
+        flushed = 0;
+    }
 
-	superblock* sBlock = init_superblock();
-    if(sBlock == NULL){
+    block = allocBlockBuf();
+    if(block == NULL){
         return -1;
     }
 
-    char check[9];
-    strcpy(check, sBlock->signature);
-    check[8] = '\0';
-    if(strcmp(check, "ECS150FS") != 0){
-        return -1;
+    //metadata blocks are the superblock, the FAT blocks and the root directory
+    for(uint32_t i = 0; i < sBlock->dataStartIndex && dirtyCount > 0; i++){
+        if(changedBlocks[i] == 0){
+            continue;
+        }
+        encodeBlock(i, block);
+        if(block_write(i, block) == -1){
+            freeBlockBuf(block);
+            return -1;
+        }
+        changedBlocks[i] = 0;
+        dirtyCount--;
+        flushed++;
+        stats_inc(umount_flushed);
+        FS_PROBE1(flush_block, i);
     }
+    freeBlockBuf(block);
 
-    if(sBlock->numBlocks != block_disk_count()){
-        return -1;
+    //subdirectory blocks go last, once the FAT and the root entries they name
+    //are durable
+    if(dirCacheDirty(NULL) > 0){
+        if(flushed > 0 && block_disk_sync() == -1){
+            return -1;
+        }
+        int dirFlushed = dirCacheFlush();
+        if(dirFlushed == -1){
+            return -1;
+        }
+        flushed += dirFlushed;
     }
+    return flushed;
+}
 
-    list_add(blockList, (void*)sBlock, BLOCK_SUPER);
+//===========================================================================//
+//                           METADATA JOURNAL                                //
+//===========================================================================//
 
-    int currentIndex = 1;
+// The journal is a run of data blocks reserved in the FAT and recorded in the
+// superblock. Its first block is a header, the rest is a log of transactions:
+// a descriptor listing the metadata blocks, their images, then a commit block
+// whose checksum covers all of it. Dirty blocks, subdirectory ones included,
+// are committed to the log as a group (fs_sync(), flusher, umount, eviction
+// from the directory cache); in-place writes only happen when the log is
+// checkpointed, so a crash at any point can be repaired at mount time by
+// replaying the committed transactions in order. A subdirectory block is
+// checkpointed before it is freed, so a replay never writes over a block that
+// was handed out again.
+
+#define JOURNAL_MAGIC "ECSJRNL1"
+#define JOURNAL_DESC_MAGIC "ECSJDESC"
+#define JOURNAL_COMMIT_MAGIC "ECSJCMIT"
+#define JOURNAL_DESC_MAX ((BLOCK_SIZE - 24) / 4)
 
-	fat* fBlock = malloc(sBlock->fatBlockCount * sizeof(fat));
-    while(sBlock->rootIndex - currentIndex >= 1){
-        fBlock = init_fat(currentIndex++);
+typedef struct {
+    char magic[8];
+    uint64_t sequence;
+    uint32_t blockCount;
+    char padding[4076];
+} __attribute__((packed)) journalHeader;
 
-        if(fBlock == NULL){
-            return -1;
-        }
+typedef struct {
+    char magic[8];
+    uint64_t sequence;
+    uint32_t count;
+    uint32_t reserved;
+    uint32_t blocks[JOURNAL_DESC_MAX];
+} __attribute__((packed)) journalDescriptor;
 
-	    list_add(blockList, (void*)fBlock, BLOCK_FAT);
+typedef struct {
+    char magic[8];
+    uint64_t sequence;
+    uint32_t checksum;
+    char padding[4076];
+} __attribute__((packed)) journalCommit;
+
+//FNV-1a over a buffer, chained through hash
+uint32_t journal_checksum(uint32_t hash, const void *buf, size_t len){
+    const unsigned char *p = buf;
+    for(size_t i = 0; i < len; i++){
+        hash = (hash ^ p[i]) * 16777619u;
     }
+    return hash;
+}
 
-    rootDirectory* rBlock = init_rootDir(sBlock->rootIndex);
-    list_add(blockList, (void*)rBlock, BLOCK_ROOT);
-
-    while(list_length(blockList) < sBlock->numBlocks){
-        void * page = mmap(NULL, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-        list_add(blockList, (void*)page, BLOCK_DATA);
+int journal_write_header(){
+    journalHeader* header = allocBlockBuf();
+    if(header == NULL){
+        return -1;
     }
+    memcpy(header->magic, JOURNAL_MAGIC, 8);
+    header->sequence = journalSeq;
+    header->blockCount = journalBlocks;
+    int ret = block_write(journalStartBlock, header);
+    freeBlockBuf(header);
+    return ret;
+}
 
-    return 0;
+//checkpoint image of block index, allocated on first use
+void* journalImage(uint32_t index){
+    if(index < sBlock->dataStartIndex){
+        if(ckptImages[index] == NULL){
+            ckptImages[index] = allocBlockBuf();
+        }
+        return ckptImages[index];
+    }
+    for(uint32_t i = 0; i < ckptDirCount; i++){
+        if(ckptDirImages[i].index == index){
+            return ckptDirImages[i].image;
+        }
+    }
+    if(ckptDirCount == ckptDirCapacity){
+        uint32_t capacity = ckptDirCapacity ? ckptDirCapacity * 2 : 16;
+        ckptDirImage* images = realloc(ckptDirImages, capacity * sizeof(ckptDirImage));
+        if(images == NULL){
+            return NULL;
+        }
+        ckptDirImages = images;
+        ckptDirCapacity = capacity;
+    }
+    void* image = allocBlockBuf();
+    if(image == NULL){
+        return NULL;
+    }
+    ckptDirImages[ckptDirCount].index = index;
+    ckptDirImages[ckptDirCount].image = image;
+    ckptDirCount++;
+    return image;
 }
 
-int fs_umount(void)
-{
-    int listLen = list_length(blockList);
+//position of the last committed image of subdirectory block block in
+//ckptDirImages, -1 if the log has none
+int journalDirImage(uint32_t block){
+    for(uint32_t i = 0; i < ckptDirCount; i++){
+        if(ckptDirImages[i].index == sBlock->dataStartIndex + block){
+            return i;
+        }
+    }
+    return -1;
+}
 
-    if(listLen == -1){
-        return -1;
+//subdirectory block block is about to be freed: checkpoint the log if it
+//holds an image of it, or a replay could overwrite whatever reuses the block
+int journalForget(uint32_t block){
+    int i = journalDirImage(block);
+    if(i == -1){
+        return 0;
     }
+    freeBlockBuf(ckptDirImages[i].image);
+    ckptDirImages[i] = ckptDirImages[--ckptDirCount];
+    return journal_checkpoint();
+}
 
-    for(int i = 0; i<listLen; i++){
-     	nodePtr nd = list_get(blockList, i);
-            if(changedBlocks[i] == 1){
-    	        int writeSuccess = block_write(i, getData(nd));
+//write every committed image in place and start the log over
+int journal_checkpoint(){
+    int written = 0;
 
-           		 if(writeSuccess == -1){
-            	 	return -1;
-            	}
-    	    }
-            void* data = getData(nd);
-            if(getType(nd) == BLOCK_DATA){
-                munmap(data, BLOCK_SIZE);
-            }
-            else{
-                free(data);
-            }
+    //the log must be durable before the blocks it covers are overwritten, or
+    //a crash could leave torn blocks and no commit record to replay
+    if(journalLogDirty){
+        if(block_disk_sync() == -1){
+            return -1;
+        }
+        journalLogDirty = 0;
     }
-    int closeSuccess = block_disk_close();
 
-    if(closeSuccess == -1){
+    for(uint32_t i = 0; i < sBlock->dataStartIndex; i++){
+        if(ckptImages[i] == NULL){
+            continue;
+        }
+        if(block_write(i, ckptImages[i]) == -1){
+            return -1;
+        }
+        freeBlockBuf(ckptImages[i]);
+        ckptImages[i] = NULL;
+        written++;
+    }
+    for(uint32_t i = 0; i < ckptDirCount; i++){
+        if(block_write(ckptDirImages[i].index, ckptDirImages[i].image) == -1){
+            return -1;
+        }
+        freeBlockBuf(ckptDirImages[i].image);
+        ckptDirImages[i].image = NULL;
+        written++;
+    }
+    ckptDirCount = 0;
+    //the log can only be reused once the in-place copies are durable
+    if(written > 0 && block_disk_sync() == -1){
         return -1;
     }
 
-	for(int i = 0; i < 32; i++){
-		free(fileDes[i]);
-	}
-
-	free(changedBlocks);
-
-    int destroySuccess = list_destroy(blockList);
-
-    if(destroySuccess == -1){
+    char* zero = allocBlockBuf();
+    if(zero == NULL || block_write(journalStartBlock + 1, zero) == -1){
+        freeBlockBuf(zero);
         return -1;
     }
-	return 0;
+    freeBlockBuf(zero);
+    journalHead = 1;
+    stats_inc(journal_checkpoints);
+    return journal_write_header();
 }
 
-int fat_count(void)
-{
-	int count = 0;
-
-    //account for multiple FAT blocks
-    for(int i = 0; i<list_length(blockList); i++){
-
-        nodePtr nd = list_get(blockList, i);
-        //if the block is FAT, count the number of entries within it
-        if(getType(nd) == BLOCK_FAT){
-            fat* fBlock = (fat*) getData(nd);
-
-        	for(int j = 0; j < FAT_ARRAY_SIZE; j++){
-        		if (fBlock->entries[j] != 0){
-        			count++;
-        		}
-        	}
+//append the dirty metadata blocks to the log as one transaction
+//returns the number of blocks committed, -1 on error, or -2 if they can't fit
+int journal_commit(){
+    journalDescriptor* desc;
+    journalCommit* commit;
+    uint32_t count = 0;
+
+    //the superblock is never journaled, see fs_journal_create()
+    for(uint32_t i = 1; i < sBlock->dataStartIndex; i++){
+        if(changedBlocks[i] == 1){
+            count++;
         }
     }
-	return count;
+    count += dirCacheDirty(NULL);
+    if(count == 0){
+        return 0;
+    }
+    if(count + 2 > journalBlocks - 1 || count > JOURNAL_DESC_MAX){
+        return -2;
+    }
+    if(journalHead + count + 2 > journalBlocks){
+        if(journal_checkpoint() == -1){
+            return -1;
+        }
+    }
+
+    //records sit at the start of a zeroed block, whatever the block size
+    desc = allocBlockBuf();
+    commit = allocBlockBuf();
+    if(desc == NULL || commit == NULL){
+        freeBlockBuf(desc);
+        freeBlockBuf(commit);
+        return -1;
+    }
+    memcpy(desc->magic, JOURNAL_DESC_MAGIC, 8);
+    desc->sequence = journalSeq;
+    for(uint32_t i = 1; i < sBlock->dataStartIndex; i++){
+        if(changedBlocks[i] == 1){
+            desc->blocks[desc->count++] = i;
+        }
+    }
+    //subdirectory blocks follow, by disk index
+    uint32_t dirBlocks[JOURNAL_DESC_MAX];
+    uint32_t dirCount = dirCacheDirty(dirBlocks);
+    for(uint32_t i = 0; i < dirCount; i++){
+        desc->blocks[desc->count++] = dirBlocks[i];
+    }
+
+    int ret = 0;
+    uint32_t sum = journal_checksum(2166136261u, desc, sizeof(*desc));
+    int at = journalStartBlock + journalHead;
+    if(block_write(at++, desc) == -1){
+        ret = -1;
+    }
+    //snapshot the images now: they, not the live blocks, get checkpointed
+    for(int i = 0; ret == 0 && i < desc->count; i++){
+        uint32_t index = desc->blocks[i];
+        void* image = journalImage(index);
+        if(image == NULL){
+            ret = -1;
+            break;
+        }
+        encodeBlock(index, image);
+        sum = journal_checksum(sum, image, blockSize);
+        if(block_write(at++, image) == -1){
+            ret = -1;
+        }
+    }
+
+    memcpy(commit->magic, JOURNAL_COMMIT_MAGIC, 8);
+    commit->sequence = journalSeq;
+    commit->checksum = sum;
+    if(ret == 0 && block_write(at, commit) == -1){
+        ret = -1;
+    }
+    if(ret == -1){
+        freeBlockBuf(desc);
+        freeBlockBuf(commit);
+        return -1;
+    }
+
+    for(int i = 0; i < desc->count; i++){
+        if(desc->blocks[i] >= sBlock->dataStartIndex){
+            dirCacheClean(desc->blocks[i] - sBlock->dataStartIndex);
+        }
+        else{
+            changedBlocks[desc->blocks[i]] = 0;
+            dirtyCount--;
+        }
+        FS_PROBE1(flush_block, desc->blocks[i]);
+    }
+    journalHead += desc->count + 2;
+    journalSeq++;
+    journalLogDirty = 1;
+    stats_inc(journal_commits);
+    stats_add(umount_flushed, desc->count);
+    freeBlockBuf(desc);
+    freeBlockBuf(commit);
+    return count;
+}
+
+//replay the committed transactions left in the log by a crash
+int journal_recover(){
+    journalHeader* header;
+    journalDescriptor* desc;
+    journalCommit* commit;
+    char* images;
+    int replayed = 0;
+    int ret = 0;
+
+    journalStartBlock = sBlock->dataStartIndex + sBlock->journalStart;
+    journalBlocks = sBlock->journalBlockCount;
+
+    header = allocBlockBuf();
+    if(header == NULL || block_read(journalStartBlock, header) == -1
+            || memcmp(header->magic, JOURNAL_MAGIC, 8) != 0){
+        freeBlockBuf(header);
+        return -1;
+    }
+    journalSeq = header->sequence;
+    freeBlockBuf(header);
+
+    desc = allocBlockBuf();
+    commit = allocBlockBuf();
+    images = pool_get(blockSize * journalBlocks);
+    if(desc == NULL || commit == NULL || images == NULL){
+        freeBlockBuf(desc);
+        freeBlockBuf(commit);
+        freeBlockBuf(images);
+        return -1;
+    }
+
+    int at = 1;
+    while(at + 2 <= journalBlocks){
+        if(block_read(journalStartBlock + at, desc) == -1){
+            break;
+        }
+        if(memcmp(desc->magic, JOURNAL_DESC_MAGIC, 8) != 0
+                || desc->sequence < journalSeq
+                || (replayed > 0 && desc->sequence != journalSeq)
+                || desc->count == 0 || desc->count > JOURNAL_DESC_MAX
+                || at + desc->count + 2 > journalBlocks){
+            break;
+        }
+        uint32_t sum = journal_checksum(2166136261u, desc, sizeof(*desc));
+        int valid = 1;
+        for(int i = 0; i < desc->count; i++){
+            char* image = images + (size_t)i * blockSize;
+            uint32_t index = desc->blocks[i];
+            //metadata or subdirectory blocks, never the journal itself
+            if(index == 0 || index >= sBlock->dataStartIndex + sBlock->dataBlockCount
+                    || (index >= (uint32_t)journalStartBlock
+                        && index < (uint32_t)(journalStartBlock + journalBlocks))
+                    || block_read(journalStartBlock + at + 1 + i, image) == -1){
+                valid = 0;
+                break;
+            }
+            sum = journal_checksum(sum, image, blockSize);
+        }
+        if(!valid || block_read(journalStartBlock + at + 1 + desc->count, commit) == -1
+                || memcmp(commit->magic, JOURNAL_COMMIT_MAGIC, 8) != 0
+                || commit->sequence != desc->sequence || commit->checksum != sum){
+            break;
+        }
+
+        //transaction is complete: apply it in place
+        for(int i = 0; ret == 0 && i < desc->count; i++){
+            if(block_write(desc->blocks[i], images + (size_t)i * blockSize) == -1){
+                ret = -1;
+            }
+        }
+        if(ret == -1){
+            break;
+        }
+        journalSeq = desc->sequence + 1;
+        at += desc->count + 2;
+        replayed++;
+    }
+    freeBlockBuf(desc);
+    freeBlockBuf(commit);
+    freeBlockBuf(images);
+    if(ret == -1){
+        return -1;
+    }
+
+    stats_add(journal_replayed, replayed);
+    if(replayed > 0){
+        if(block_disk_sync() == -1){
+            return -1;
+        }
+        char* zero = allocBlockBuf();
+        if(zero == NULL || block_write(journalStartBlock + 1, zero) == -1
+                || journal_write_header() == -1 || block_disk_sync() == -1){
+            freeBlockBuf(zero);
+            return -1;
+        }
+        freeBlockBuf(zero);
+    }
+    journalHead = 1;
+    return replayed;
+}
+
+//smallest log holding a transaction of every FAT and root directory block
+//(header, descriptor and commit included), so commits never fall back to
+//in-place writes unless the descriptor itself is full
+uint32_t journalMinBlocks(){
+    uint32_t count = sBlock->dataStartIndex - 1;
+    if(count > JOURNAL_DESC_MAX){
+        count = JOURNAL_DESC_MAX;
+    }
+    return count + 3;
+}
+
+static int do_fs_journal_create(unsigned int nblocks)
+{
+    pthread_mutex_lock(&fsLock);
+    if(sBlock == NULL || journalBlocks > 0 || nblocks < journalMinBlocks()){
+        pthread_mutex_unlock(&fsLock);
+        return -1;
+    }
+
+    //find a contiguous run of free data blocks for the journal
+    int start = -1;
+    int run = 0;
+    for(uint32_t i = 1; i < sBlock->dataBlockCount; i++){
+        if(fatTable[i] != 0){
+            run = 0;
+            continue;
+        }
+        if(run++ == 0){
+            start = i;
+        }
+        if(run == nblocks){
+            break;
+        }
+    }
+    if(run < nblocks){
+        pthread_mutex_unlock(&fsLock);
+        return -1;
+    }
+
+    //reserve it as a chain so the allocator (and other tools) leave it alone
+    for(uint32_t i = start; i < start + nblocks; i++){
+        fatTable[i] = (i == start + nblocks - 1) ? FAT_EOC : i + 1;
+        markFatDirty(i);
+    }
+    fatFree -= nblocks;
+
+    journalStartBlock = sBlock->dataStartIndex + start;
+    journalBlocks = nblocks;
+    journalHead = 1;
+    journalSeq = 1;
+
+    char* zero = allocBlockBuf();
+    int ret = (zero == NULL) ? -1 : journal_write_header();
+    if(ret == 0){
+        ret = block_write(journalStartBlock + 1, zero);
+    }
+    //the FAT reservation must be on disk before the superblock points to it
+    if(ret == 0){
+        journalBlocks = 0;
+        ret = flushDirtyBlocks() == -1 ? -1 : block_disk_sync();
+        journalBlocks = nblocks;
+    }
+    if(ret == 0){
+        sBlock->journalStart = start;
+        sBlock->journalBlockCount = nblocks;
+        encode_superblock(zero);
+        ret = block_write(0, zero);
+    }
+    if(ret == 0){
+        ret = block_disk_sync();
+    }
+    if(ret == -1){
+        journalBlocks = 0;
+    }
+    freeBlockBuf(zero);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+//===========================================================================//
+//                             DIRECTORIES                                   //
+//===========================================================================//
+
+// Subdirectories are files whose blocks hold directory entries in the image's
+// format, laid out as an on-disk hash table: a name hashes to a home block and
+// probes the following blocks (wrapping around) until it finds a free slot.
+// Deleted entries are left as tombstones, so a lookup can stop at the first
+// block that still has a never-used slot. Slot 0 of block 0 is a header entry
+// whose size field counts the live entries, and whose padding counts the
+// tombstones; once both fill 3/4 of the slots the directory is rehashed, into
+// twice as many blocks unless tombstones are the majority. The entry type is
+// kept in the first padding byte, which the reference tools ignore. Decoded
+// directory blocks and directory block maps are cached, and so are recent
+// lookups (dentries).
+
+#define ENTRY_FILE 0
+#define ENTRY_DIR 1
+#define ENTRY_TOMBSTONE 2
+#define DIR_ROOT 0
+#define entryType(e) ((e)->padding[0])
+//padding bytes of a subdirectory header holding its tombstone count
+#define TOMBSTONE_COUNT_OFFSET 1
+
+//deepest path that can be resolved
+#define PATH_DEPTH_MAX 64
+//memory given to decoded directory blocks, and bounds on their number
+#define DIR_CACHE_BYTES (256 * 1024)
+#define DIR_CACHE_MIN 4
+#define DIR_CACHE_MAX 64
+#define DIR_MAP_CACHE_SIZE 16
+#define DENTRY_CACHE_SIZE 4096
+
+//a directory being operated on
+typedef struct {
+    //start block, DIR_ROOT for the root directory
+    uint32_t start;
+    uint32_t blocks;
+    //entry of the directory in its parent (subdirectories only)
+    entryLoc self;
+} dirRef;
+
+typedef struct {
+    //data block cached in this slot, 0 when unused
+    uint32_t block;
+    int dirty;
+    uint64_t lastUse;
+    rootEntry* entries;
+} dirCacheSlot;
+
+//data blocks of a directory, in order
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+    uint64_t lastUse;
+    uint32_t* blocks;
+} dirMap;
+
+typedef struct {
+    uint32_t parent;
+    char name[16];
+    entryLoc loc;
+} dentry;
+
+dirCacheSlot* dirCache = NULL;
+int dirCacheSize = 0;
+uint64_t dirCacheClock = 0;
+dirMap dirMaps[DIR_MAP_CACHE_SIZE];
+dentry dentryCache[DENTRY_CACHE_SIZE];
+
+int findEmptyBlock();
+int findFreeRun(int count, int hint);
+void freeBlock(uint32_t block);
+void waitReads();
+
+//entries held by a directory block of the mounted file system
+uint32_t entriesPerBlock(){
+    return blockSize / sizeof(rootEntryV1);
+}
+
+int sameLoc(const entryLoc* a, const entryLoc* b){
+    return a->dir == b->dir && a->block == b->block && a->slot == b->slot;
+}
+
+//allocate a chain of count data blocks, contiguous when possible
+int allocChain(uint32_t count){
+    if(count == 0 || fatFree < count){
+        return -1;
+    }
+
+    int run = findFreeRun(count, fatFreeHint);
+    int first = -1;
+    int last = -1;
+    for(uint32_t i = 0; i < count; i++){
+        int block = (run != -1) ? run + (int)i : findEmptyBlock();
+        fatTable[block] = FAT_EOC;
+        fatFree--;
+        markFatDirty(block);
+        if(last == -1){
+            first = block;
+        }
+        else{
+            fatTable[last] = block;
+            markFatDirty(last);
+        }
+        last = block;
+    }
+    return first;
+}
+
+//whether b can be linked in a chain: FAT entry 0 is reserved, and a damaged
+//image can link anything
+static inline int chainBlock(uint32_t b){
+    return b != 0 && b < sBlock->dataBlockCount;
+}
+
+//release a chain, up to where it joins one sharing its tail
+void freeChain(uint32_t start){
+    while(chainBlock(start)){
+        if(fatRefs != NULL && fatRefs[start] > 0){
+            fatRefs[start]--;
+            return;
+        }
+        uint32_t next = fatTable[start];
+        freeBlock(start);
+        start = next;
+    }
+}
+
+//set up the caches for a newly mounted file system
+int init_dirCache(){
+    dirCacheSize = DIR_CACHE_BYTES / blockSize;
+    if(dirCacheSize < DIR_CACHE_MIN){
+        dirCacheSize = DIR_CACHE_MIN;
+    }
+    if(dirCacheSize > DIR_CACHE_MAX){
+        dirCacheSize = DIR_CACHE_MAX;
+    }
+    dirCache = calloc(dirCacheSize, sizeof(dirCacheSlot));
+    if(dirCache == NULL){
+        return -1;
+    }
+    for(int i = 0; i < dirCacheSize; i++){
+        dirCache[i].entries = malloc(entriesPerBlock() * sizeof(rootEntry));
+        if(dirCache[i].entries == NULL){
+            return -1;
+        }
+    }
+    memset(dirMaps, 0, sizeof(dirMaps));
+    memset(dentryCache, 0, sizeof(dentryCache));
+    return 0;
+}
+
+void free_dirCache(){
+    for(int i = 0; dirCache != NULL && i < dirCacheSize; i++){
+        free(dirCache[i].entries);
+    }
+    free(dirCache);
+    dirCache = NULL;
+    for(int i = 0; i < DIR_MAP_CACHE_SIZE; i++){
+        free(dirMaps[i].blocks);
+        dirMaps[i].blocks = NULL;
+    }
+}
+
+int dirCacheWriteBack(dirCacheSlot* slot){
+    char* block = allocBlockBuf();
+    if(block == NULL){
+        return -1;
+    }
+    encode_entries(slot->entries, block);
+    int ret = block_write(sBlock->dataStartIndex + slot->block, block);
+    freeBlockBuf(block);
+    if(ret == 0){
+        slot->dirty = 0;
+    }
+    return ret;
+}
+
+//list the dirty directory blocks by disk index in blocks, unless it is NULL
+//returns how many there are
+uint32_t dirCacheDirty(uint32_t* blocks){
+    uint32_t count = 0;
+    for(int i = 0; dirCache != NULL && i < dirCacheSize; i++){
+        if(dirCache[i].block != 0 && dirCache[i].dirty){
+            if(blocks != NULL){
+                blocks[count] = sBlock->dataStartIndex + dirCache[i].block;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+dirCacheSlot* dirCacheFind(uint32_t block);
+
+//encode cached directory block block, for the journal
+void encodeDirBlock(uint32_t block, void* buf){
+    encode_entries(dirCacheFind(block)->entries, buf);
+}
+
+//directory block block was committed to the journal
+void dirCacheClean(uint32_t block){
+    dirCacheSlot* slot = dirCacheFind(block);
+    if(slot != NULL){
+        slot->dirty = 0;
+    }
+}
+
+//write every dirty directory block back in place
+//returns the number of blocks written, or -1 if a write failed
+int dirCacheFlush(){
+    int flushed = 0;
+    for(int i = 0; dirCache != NULL && i < dirCacheSize; i++){
+        if(dirCache[i].block != 0 && dirCache[i].dirty){
+            if(dirCacheWriteBack(&dirCache[i]) == -1){
+                return -1;
+            }
+            flushed++;
+        }
+    }
+    return flushed;
+}
+
+//read directory block block as last committed, which may still be in the
+//journal only
+int dirBlockRead(uint32_t block, void* buf){
+    int image = journalDirImage(block);
+    if(image != -1){
+        memcpy(buf, ckptDirImages[image].image, blockSize);
+        return 0;
+    }
+    return block_read(sBlock->dataStartIndex + block, buf);
+}
+
+dirCacheSlot* dirCacheFind(uint32_t block){
+    for(int i = 0; i < dirCacheSize; i++){
+        if(dirCache[i].block == block){
+            return &dirCache[i];
+        }
+    }
+    return NULL;
+}
+
+//get the decoded entries of directory block block, a fresh one starting out
+//empty instead of being read from disk
+dirCacheSlot* dirBlockGet(uint32_t block, int fresh){
+    dirCacheSlot* slot = dirCacheFind(block);
+
+    if(slot != NULL && !fresh){
+        stats_inc(cache_hits);
+        slot->lastUse = ++dirCacheClock;
+        return slot;
+    }
+
+    //take an unused slot, or evict the least recently used one, clean ones
+    //first
+    if(slot == NULL){
+        slot = &dirCache[0];
+        for(int i = 0; i < dirCacheSize && slot->block != 0; i++){
+            dirCacheSlot* s = &dirCache[i];
+            if(s->block == 0 || s->dirty < slot->dirty
+                    || (s->dirty == slot->dirty && s->lastUse < slot->lastUse)){
+                slot = s;
+            }
+        }
+        //a dirty block can't go in place ahead of the metadata it goes with:
+        //flush it all, through the journal if there is one
+        if(slot->block != 0 && slot->dirty && flushDirtyBlocks() == -1){
+            return NULL;
+        }
+    }
+    slot->block = 0;
+
+    if(fresh){
+        memset(slot->entries, 0, entriesPerBlock() * sizeof(rootEntry));
+        slot->dirty = 1;
+    }
+    else{
+        stats_inc(cache_misses);
+        char* buf = allocBlockBuf();
+        if(buf == NULL || dirBlockRead(block, buf) == -1){
+            freeBlockBuf(buf);
+            return NULL;
+        }
+        for(uint32_t i = 0; i < entriesPerBlock(); i++){
+            decode_rootEntry(buf, i, &slot->entries[i]);
+        }
+        freeBlockBuf(buf);
+        slot->dirty = 0;
+    }
+    slot->block = block;
+    slot->lastUse = ++dirCacheClock;
+    return slot;
+}
+
+//forget a directory block whose directory is going away
+int dirCacheDrop(uint32_t block){
+    dirCacheSlot* slot = dirCacheFind(block);
+    if(slot != NULL){
+        slot->block = 0;
+        slot->dirty = 0;
+    }
+    return journalForget(block);
+}
+
+//get data block i of a directory, FAT_EOC if its chain is too short
+uint32_t dirBlockAt(const dirRef* dir, uint32_t i){
+    dirMap* map = &dirMaps[0];
+
+    for(int m = 0; m < DIR_MAP_CACHE_SIZE; m++){
+        if(dirMaps[m].blocks != NULL && dirMaps[m].start == dir->start
+                && dirMaps[m].count == dir->blocks){
+            dirMaps[m].lastUse = ++dirCacheClock;
+            return dirMaps[m].blocks[i];
+        }
+        if(dirMaps[m].lastUse < map->lastUse){
+            map = &dirMaps[m];
+        }
+    }
+
+    //build the map once, instead of walking the chain on every access
+    uint32_t* blocks = realloc(map->blocks, dir->blocks * sizeof(uint32_t));
+    if(blocks == NULL){
+        return FAT_EOC;
+    }
+    map->blocks = blocks;
+    map->start = dir->start;
+    map->count = dir->blocks;
+    map->lastUse = ++dirCacheClock;
+    uint32_t block = dir->start;
+    for(uint32_t b = 0; b < dir->blocks; b++){
+        if(block == FAT_EOC || block == 0 || block >= sBlock->dataBlockCount){
+            map->count = 0;
+            return FAT_EOC;
+        }
+        blocks[b] = block;
+        block = fatTable[block];
+        stats_inc(fat_hops);
+    }
+    return blocks[i];
+}
+
+void dirMapDrop(uint32_t start){
+    for(int m = 0; m < DIR_MAP_CACHE_SIZE; m++){
+        if(dirMaps[m].start == start){
+            dirMaps[m].count = 0;
+        }
+    }
+}
+
+uint32_t dentrySlot(uint32_t parent, const char* name){
+    return (hashName(name) ^ (parent * 2654435761u)) & (DENTRY_CACHE_SIZE - 1);
+}
+
+//drop every cached lookup, after entries moved around
+void dentryFlush(){
+    memset(dentryCache, 0, sizeof(dentryCache));
+}
+
+//get a directory entry, NULL if its block can't be read
+rootEntry* entryAt(const entryLoc* loc){
+    if(loc->dir == DIR_ROOT){
+        return &rootDir->entries[loc->slot];
+    }
+    dirCacheSlot* slot = dirBlockGet(loc->block, 0);
+    return (slot == NULL) ? NULL : &slot->entries[loc->slot];
+}
+
+//flag the block holding a directory entry as changed
+void entryDirty(const entryLoc* loc){
+    if(loc->dir == DIR_ROOT){
+        markEntryDirty(&rootDir->entries[loc->slot]);
+        return;
+    }
+    dirCacheSlot* slot = dirBlockGet(loc->block, 0);
+    if(slot != NULL){
+        slot->dirty = 1;
+    }
+}
+
+//get the header entry of a subdirectory, which counts its entries
+rootEntry* dirHeader(const dirRef* dir, dirCacheSlot** slot){
+    uint32_t block = dirBlockAt(dir, 0);
+    *slot = (block == FAT_EOC) ? NULL : dirBlockGet(block, 0);
+    return (*slot == NULL) ? NULL : &(*slot)->entries[0];
+}
+
+//tombstones of a subdirectory, as counted by its header
+uint32_t dirTombstones(const rootEntry* header){
+    uint32_t count;
+    memcpy(&count, &header->padding[TOMBSTONE_COUNT_OFFSET], sizeof(count));
+    return count;
+}
+
+void dirSetTombstones(rootEntry* header, uint32_t count){
+    memcpy(&header->padding[TOMBSTONE_COUNT_OFFSET], &count, sizeof(count));
+}
+
+//find name in a directory, 0 and its location if it is there
+int dirLookup(const dirRef* dir, const char* name, entryLoc* loc){
+    if(dir->start == DIR_ROOT){
+        rootEntry* entry = findEntry(name);
+        if(entry == NULL){
+            return -1;
+        }
+        loc->dir = DIR_ROOT;
+        loc->block = 0;
+        loc->slot = entry - rootDir->entries;
+        return 0;
+    }
+
+    dentry* d = &dentryCache[dentrySlot(dir->start, name)];
+    if(d->parent == dir->start && strncmp(d->name, name, 16) == 0){
+        rootEntry* entry = entryAt(&d->loc);
+        if(entry != NULL && strncmp(entry->fileName, name, 16) == 0){
+            stats_inc(dentry_hits);
+            *loc = d->loc;
+            return 0;
+        }
+    }
+    stats_inc(dentry_misses);
+
+    uint32_t b = hashName(name) & (dir->blocks - 1);
+    for(uint32_t probe = 0; probe < dir->blocks; probe++){
+        uint32_t block = dirBlockAt(dir, b);
+        dirCacheSlot* slot = (block == FAT_EOC) ? NULL : dirBlockGet(block, 0);
+        if(slot == NULL){
+            return -1;
+        }
+        int neverUsed = 0;
+        for(uint32_t i = (b == 0) ? 1 : 0; i < entriesPerBlock(); i++){
+            rootEntry* entry = &slot->entries[i];
+            if(entry->fileName[0] == '\0'){
+                neverUsed |= entryType(entry) != ENTRY_TOMBSTONE;
+                continue;
+            }
+            if(strncmp(entry->fileName, name, 16) == 0){
+                loc->dir = dir->start;
+                loc->block = block;
+                loc->slot = i;
+                d->parent = dir->start;
+                strncpy(d->name, name, 16);
+                d->loc = *loc;
+                return 0;
+            }
+        }
+        //no insertion ever probed past a block with a never-used slot
+        if(neverUsed){
+            return -1;
+        }
+        b = (b + 1) & (dir->blocks - 1);
+    }
+    return -1;
+}
+
+//put an entry in the first free slot of its probe sequence
+int dirInsert(const dirRef* dir, const rootEntry* entry, entryLoc* loc){
+    uint32_t b = hashName(entry->fileName) & (dir->blocks - 1);
+
+    for(uint32_t probe = 0; probe < dir->blocks; probe++){
+        uint32_t block = dirBlockAt(dir, b);
+        dirCacheSlot* slot = (block == FAT_EOC) ? NULL : dirBlockGet(block, 0);
+        if(slot == NULL){
+            return -1;
+        }
+        for(uint32_t i = (b == 0) ? 1 : 0; i < entriesPerBlock(); i++){
+            if(slot->entries[i].fileName[0] == '\0'){
+                int reused = entryType(&slot->entries[i]) == ENTRY_TOMBSTONE;
+                slot->entries[i] = *entry;
+                slot->dirty = 1;
+                loc->dir = dir->start;
+                loc->block = block;
+                loc->slot = i;
+                dentry* d = &dentryCache[dentrySlot(dir->start, entry->fileName)];
+                d->parent = dir->start;
+                strncpy(d->name, entry->fileName, 16);
+                d->loc = *loc;
+
+                dirCacheSlot* hslot;
+                rootEntry* header = dirHeader(dir, &hslot);
+                if(header == NULL){
+                    return -1;
+                }
+                header->fileSize++;
+                //directories made before tombstones were counted may have more
+                if(reused && dirTombstones(header) > 0){
+                    dirSetTombstones(header, dirTombstones(header) - 1);
+                }
+                hslot->dirty = 1;
+                return 0;
+            }
+        }
+        b = (b + 1) & (dir->blocks - 1);
+    }
+    return -1;
+}
+
+//rehash a subdirectory into a number of blocks, dropping its tombstones
+int dirRehash(dirRef* dir, uint32_t blocks){
+    dirRef grown = { 0, blocks, dir->self };
+    uint32_t perBlock = entriesPerBlock();
+    dirCacheSlot* slot;
+
+    int start = allocChain(grown.blocks);
+    if(start == -1){
+        return -1;
+    }
+    grown.start = start;
+
+    rootEntry* moved = malloc(perBlock * sizeof(rootEntry));
+    if(moved == NULL){
+        freeChain(start);
+        return -1;
+    }
+    int ret = 0;
+    for(uint32_t b = 0; ret == 0 && b < grown.blocks; b++){
+        uint32_t block = dirBlockAt(&grown, b);
+        slot = (block == FAT_EOC) ? NULL : dirBlockGet(block, 1);
+        if(slot == NULL){
+            ret = -1;
+        }
+        else if(b == 0){
+            //header first, counting up again as entries get reinserted
+            memcpy(slot->entries[0].fileName, ".", 2);
+            entryType(&slot->entries[0]) = ENTRY_DIR;
+        }
+    }
+    for(uint32_t b = 0; ret == 0 && b < dir->blocks; b++){
+        uint32_t block = dirBlockAt(dir, b);
+        slot = (block == FAT_EOC) ? NULL : dirBlockGet(block, 0);
+        if(slot == NULL){
+            ret = -1;
+            break;
+        }
+        memcpy(moved, slot->entries, perBlock * sizeof(rootEntry));
+        for(uint32_t i = (b == 0) ? 1 : 0; ret == 0 && i < perBlock; i++){
+            entryLoc loc;
+            if(moved[i].fileName[0] != '\0'){
+                ret = dirInsert(&grown, &moved[i], &loc);
+            }
+        }
+    }
+    free(moved);
+    if(ret == -1){
+        for(uint32_t b = 0; b < grown.blocks; b++){
+            dirCacheDrop(dirBlockAt(&grown, b));
+        }
+        dirMapDrop(grown.start);
+        freeChain(grown.start);
+        return -1;
+    }
+
+    //release the old blocks
+    for(uint32_t b = 0; b < dir->blocks; b++){
+        if(dirCacheDrop(dirBlockAt(dir, b)) == -1){
+            return -1;
+        }
+    }
+    dirMapDrop(dir->start);
+    freeChain(dir->start);
+
+    rootEntry* self = entryAt(&dir->self);
+    if(self == NULL){
+        return -1;
+    }
+    self->dataStartIndex = grown.start;
+    self->fileSize = grown.blocks * blockSize;
+    entryDirty(&dir->self);
+
+    //entries moved: cached lookups and open files must follow them
+    uint32_t oldStart = dir->start;
+    *dir = grown;
+    dentryFlush();
+    for(int i = 0; i < fdCapacity; i++){
+        if(fileDes[i].fileName[0] != '\0' && fileDes[i].loc.dir == oldStart){
+            dirLookup(dir, fileDes[i].fileName, &fileDes[i].loc);
+        }
+    }
+    FS_PROBE2(dir_rehash, grown.start, grown.blocks);
+    return 0;
+}
+
+//add an entry to a directory, which must not hold its name yet
+int dirAdd(dirRef* dir, const rootEntry* entry, entryLoc* loc){
+    if(dir->start == DIR_ROOT){
+        rootEntry* slot = findFreeEntry();
+        if(slot == NULL){
+            return -1;
+        }
+        *slot = *entry;
+        indexEntry(slot - rootDir->entries);
+        rootDir->used++;
+        markEntryDirty(slot);
+        loc->dir = DIR_ROOT;
+        loc->block = 0;
+        loc->slot = slot - rootDir->entries;
+        return 0;
+    }
+
+    dirCacheSlot* hslot;
+    rootEntry* header = dirHeader(dir, &hslot);
+    if(header == NULL){
+        return -1;
+    }
+    //live entries, tombstones and the header must stay within 3/4 of the
+    //slots, or misses probe every block
+    uint64_t live = header->fileSize;
+    uint64_t dead = dirTombstones(header);
+    if((live + dead + 2) * 4 > (uint64_t)dir->blocks * entriesPerBlock() * 3){
+        //mostly tombstones: rehashing frees enough slots without growing
+        uint32_t blocks = (dead > live) ? dir->blocks : dir->blocks * 2;
+        if(dirRehash(dir, blocks) == -1){
+            return -1;
+        }
+    }
+    return dirInsert(dir, entry, loc);
+}
+
+//remove the entry at loc from its directory
+int dirRemove(const dirRef* dir, const entryLoc* loc){
+    if(dir->start == DIR_ROOT){
+        rootEntry* entry = &rootDir->entries[loc->slot];
+        unindexEntry(loc->slot);
+        rootDir->used--;
+        if(loc->slot < rootDir->freeHint){
+            rootDir->freeHint = loc->slot;
+        }
+        memset(entry, 0, sizeof(rootEntry));
+        markEntryDirty(entry);
+        return 0;
+    }
+
+    dirCacheSlot* slot = dirBlockGet(loc->block, 0);
+    if(slot == NULL){
+        return -1;
+    }
+    rootEntry* entry = &slot->entries[loc->slot];
+    dentry* d = &dentryCache[dentrySlot(dir->start, entry->fileName)];
+    if(sameLoc(&d->loc, loc)){
+        memset(d, 0, sizeof(dentry));
+    }
+    memset(entry, 0, sizeof(rootEntry));
+    entryType(entry) = ENTRY_TOMBSTONE;
+    slot->dirty = 1;
+
+    dirCacheSlot* hslot;
+    rootEntry* header = dirHeader(dir, &hslot);
+    if(header == NULL){
+        return -1;
+    }
+    header->fileSize--;
+    dirSetTombstones(header, dirTombstones(header) + 1);
+    hslot->dirty = 1;
+    return 0;
+}
+
+//describe the directory whose entry is at loc, -1 if it isn't a directory
+int dirOpen(const entryLoc* loc, dirRef* dir){
+    rootEntry* entry = entryAt(loc);
+    if(entry == NULL || entryType(entry) != ENTRY_DIR){
+        return -1;
+    }
+    dir->start = entry->dataStartIndex;
+    dir->blocks = entry->fileSize / blockSize;
+    dir->self = *loc;
+    //the hashing relies on a power of two number of blocks
+    if(dir->blocks == 0 || (dir->blocks & (dir->blocks - 1)) != 0){
+        return -1;
+    }
+    return 0;
+}
+
+//resolve a path down to its last component: the directory holding it, and
+//its name. It fails if a directory starting at block avoid is on the way
+int resolveParent(const char* path, dirRef* parent, char* name, uint32_t avoid){
+    dirRef stack[PATH_DEPTH_MAX];
+    int depth = 0;
+    char comp[FS_FILENAME_LEN];
+
+    if(path == NULL){
+        return -1;
+    }
+    stack[0].start = DIR_ROOT;
+    stack[0].blocks = 0;
+    name[0] = '\0';
+
+    const char* p = path;
+    for(;;){
+        while(*p == '/'){
+            p++;
+        }
+        if(*p == '\0'){
+            break;
+        }
+        size_t len = strcspn(p, "/");
+        if(len >= FS_FILENAME_LEN){
+            return -1;
+        }
+        //the previous component was a directory to step into
+        if(name[0] != '\0'){
+            if(strcmp(name, "..") == 0){
+                if(depth > 0){
+                    depth--;
+                }
+            }
+            else if(strcmp(name, ".") != 0){
+                entryLoc loc;
+                if(depth + 1 == PATH_DEPTH_MAX
+                        || dirLookup(&stack[depth], name, &loc) == -1
+                        || dirOpen(&loc, &stack[depth + 1]) == -1){
+                    return -1;
+                }
+                depth++;
+            }
+        }
+        memcpy(comp, p, len);
+        comp[len] = '\0';
+        strcpy(name, comp);
+        p += len;
+    }
+
+    if(name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+        return -1;
+    }
+    for(int i = 0; i <= depth; i++){
+        if(stack[i].start == avoid){
+            return -1;
+        }
+    }
+    *parent = stack[depth];
+    return 0;
+}
+
+//resolve a path to an existing entry
+int lookupPath(const char* path, dirRef* parent, char* name, entryLoc* loc){
+    if(resolveParent(path, parent, name, FAT_EOC) == -1){
+        return -1;
+    }
+    return dirLookup(parent, name, loc);
+}
+
+//===========================================================================//
+//                          IMPLEMENTED FS METHODS                           //
+//===========================================================================//
+
+void select_block_io();
+
+//block buffers set aside at mount time, whatever the block size
+#define POOL_BYTES (1024 * 1024)
+#define POOL_BLOCKS_MIN 16
+
+//release everything fs_mount() set up (fsLock must be held)
+void release_mount(){
+	free(fileDes);
+	fileDes = NULL;
+	fdCapacity = 0;
+	fdFreeHead = -1;
+	fdOpenCount = 0;
+	free(changedBlocks);
+	changedBlocks = NULL;
+	free(ckptImages);
+	ckptImages = NULL;
+	free(ckptDirImages);
+	ckptDirImages = NULL;
+	ckptDirCount = 0;
+	ckptDirCapacity = 0;
+	free(fatTable);
+	fatTable = NULL;
+	free(fatRefs);
+	fatRefs = NULL;
+	free_rootDir(rootDir);
+	rootDir = NULL;
+	free_dirCache();
+	freeBlockBuf(ioBlock);
+	ioBlock = NULL;
+	pool_destroy();
+	ioDirect = 0;
+	free(sBlock);
+	sBlock = NULL;
+	blockSize = BLOCK_SIZE;
+	journalBlocks = 0;
+}
+
+//check that the superblock describes a layout that fits the disk
+int check_superblock(){
+	uint32_t perBlock = (sBlock->version == 1) ? FAT_PER_BLOCK_V1(blockSize)
+			: FAT_PER_BLOCK_V2(blockSize);
+
+	if(sBlock->numBlocks != block_disk_count()){
+		return -1;
+	}
+	if(sBlock->fatBlockCount == 0 || sBlock->rootIndex != sBlock->fatBlockCount + 1
+			|| sBlock->rootBlockCount == 0
+			|| sBlock->dataStartIndex != (uint64_t)sBlock->rootIndex + sBlock->rootBlockCount){
+		return -1;
+	}
+	if((uint64_t)sBlock->dataStartIndex + sBlock->dataBlockCount > sBlock->numBlocks
+			|| sBlock->dataBlockCount > (uint64_t)sBlock->fatBlockCount * perBlock){
+		return -1;
+	}
+	return 0;
+}
+
+static int do_fs_mount(const char *diskname)
+{
+    if(sBlock != NULL){
+        return -1;
+    }
+
+    int success = block_disk_open_flags(diskname,
+            (ioMode & FS_IO_DIRECT) ? BLOCK_DISK_DIRECT : 0);
+
+    if(success == -1){
+        return -1;
+    }
+
+	sBlock = init_superblock();
+    //switch the disk over to the block size recorded in the superblock
+    if(sBlock != NULL){
+        blockSize = sBlock->blockSize;
+    }
+    if(sBlock == NULL || block_disk_set_size(blockSize) == -1
+            || check_superblock() == -1){
+        release_mount();
+        block_disk_close();
+        return -1;
+    }
+    fatPerBlock = (sBlock->version == 1) ? FAT_PER_BLOCK_V1(blockSize)
+            : FAT_PER_BLOCK_V2(blockSize);
+    size_t poolBlocks = POOL_BYTES / blockSize;
+    if(poolBlocks < POOL_BLOCKS_MIN){
+        poolBlocks = POOL_BLOCKS_MIN;
+    }
+    if(pool_init(blockSize, poolBlocks, (ioMode & FS_IO_HUGEPAGE) ? POOL_HUGEPAGE : 0) == -1){
+        release_mount();
+        block_disk_close();
+        return -1;
+    }
+    ioBlock = allocBlockBuf();
+    ioDirect = block_disk_direct();
+    select_block_io();
+
+	changedBlocks = (int *)calloc(sBlock->dataStartIndex, sizeof(int));
+	dirtyCount = 0;
+
+    journalBlocks = 0;
+    ckptImages = calloc(sBlock->dataStartIndex, sizeof(void*));
+    if(sBlock->journalBlockCount > 0 && journal_recover() == -1){
+        release_mount();
+        block_disk_close();
+        return -1;
+    }
+
+    fatTable = init_fat();
+    if(fatTable != NULL && (sBlock->features & FEATURE_SHARED)){
+        fatRefs = init_fatRefs();
+        if(fatRefs == NULL){
+            release_mount();
+            block_disk_close();
+            return -1;
+        }
+    }
+    if(fatTable != NULL){
+        rootDir = init_rootDir();
+    }
+    if(fatTable == NULL || rootDir == NULL || init_dirCache() == -1
+            || fdGrow() == -1){
+        release_mount();
+        block_disk_close();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int do_fs_umount(void)
+{
+    if(sBlock == NULL){
+        return -1;
+    }
+    waitReads();
+
+    int flushed = flushDirtyBlocks();
+    if(flushed == -1){
+        return -1;
+    }
+    //leave the image checkpointed, so tools unaware of the journal can read it
+    if(journalBlocks > 0){
+        if(journal_checkpoint() == -1){
+            return -1;
+        }
+        flushed++;
+    }
+    //make a clean unmount durable
+    if(flushed > 0 && block_disk_sync() == -1){
+        return -1;
+    }
+    journalBlocks = 0;
+
+    int closeSuccess = block_disk_close();
+
+    if(closeSuccess == -1){
+        return -1;
+    }
+
+	release_mount();
+	return 0;
+}
+
+int fat_count(void)
+{
+	return sBlock->dataBlockCount - fatFree;
+}
+
+int rdir_capacity(void)
+{
+	return rootDir->perBlock * rootDir->blockCount;
+}
+
+int rdir_count(void)
+{
+    rootDirectory* rBlock = getRootDirectory();
+
+    if(rBlock == NULL || load_rootDir() == -1){
+        return -1;
+    }
+	return rdir_capacity() - rBlock->used;
+}
+
+static int do_fs_info(void)
+{
+    if(sBlock == NULL){
+        return -1;
+    }
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", sBlock->numBlocks);
+	printf("fat_blk_count=%u\n", sBlock->fatBlockCount);
+	printf("rdir_blk=%u\n", sBlock->rootIndex);
+	printf("data_blk=%u\n", sBlock->dataStartIndex);
+	printf("data_blk_count=%u\n", sBlock->dataBlockCount);
+	printf("fat_free_ratio=%u/%u\n", (sBlock->dataBlockCount - fat_count())
+					, sBlock->dataBlockCount);
+	printf("rdir_free_ratio=%d/%d\n", rdir_count(), rdir_capacity());
+	if(sBlock->version != 1){
+		printf("fat_entry_bits=32\n");
+	}
+	if(blockSize != BLOCK_SIZE){
+		printf("block_size=%zu\n", blockSize);
+	}
+	if(sBlock->rootBlockCount > 1){
+		printf("rdir_blk_count=%u\n", sBlock->rootBlockCount);
+	}
+	if(journalBlocks > 0){
+		printf("journal_blk=%d\n", journalStartBlock);
+		printf("journal_blk_count=%d\n", journalBlocks);
+	}
+	return 0;
+}
+
+int findEmptyBlock();
+
+//take a free data block and make it the end of a chain
+int allocBlock(){
+	int block = findEmptyBlock();
+	if(block == -1){
+		return -1;
+	}
+	fatTable[block] = FAT_EOC;
+	fatFree--;
+	markFatDirty(block);
+	return block;
+}
+
+//wait until no read is still transferring blocks planned before now (fsLock
+//held, so that no new one starts)
+void waitReads(){
+	if(__atomic_load_n(&readsInFlight, __ATOMIC_ACQUIRE) == 0){
+		return;
+	}
+	pthread_mutex_lock(&readLock);
+	while(__atomic_load_n(&readsInFlight, __ATOMIC_ACQUIRE) > 0){
+		pthread_cond_wait(&readsDone, &readLock);
+	}
+	pthread_mutex_unlock(&readLock);
+}
+
+//give a data block back to the free pool
+void freeBlock(uint32_t block){
+	//a read outside of fsLock may still be transferring it
+	waitReads();
+	fatTable[block] = 0;
+	fatFree++;
+	if(block < fatFreeHint){
+		fatFreeHint = block;
+	}
+	markFatDirty(block);
+}
+
+static int do_fs_create(const char *filename)
+{
+    dirRef parent;
+    char name[FS_FILENAME_LEN];
+    entryLoc loc;
+
+    if(sBlock == NULL || resolveParent(filename, &parent, name, FAT_EOC) == -1){
+        return -1;
+    }
+    if(dirLookup(&parent, name, &loc) == 0){
+        return -1;
+    }
+
+    int block = allocBlock();
+    if(block == -1){
+        return -1;
+    }
+
+    rootEntry entry;
+    memset(&entry, 0, sizeof(rootEntry));
+    strcpy(entry.fileName, name);
+    entry.fileSize = 0;
+    entry.dataStartIndex = block;
+    entryType(&entry) = ENTRY_FILE;
+    if(dirAdd(&parent, &entry, &loc) == -1){
+        freeBlock(block);
+        return -1;
+    }
+	return 0;
+}
+
+static int do_fs_delete(const char *filename)
+{
+    dirRef parent;
+    char name[FS_FILENAME_LEN];
+    entryLoc loc;
+
+    if(sBlock == NULL || lookupPath(filename, &parent, name, &loc) == -1){
+        return -1;
+    }
+    rootEntry* entry = entryAt(&loc);
+    if(entry == NULL || entryType(entry) == ENTRY_DIR){
+        return -1;
+    }
+
+	freeChain(entry->dataStartIndex);
+
+	for(int i = 0; i < fdCapacity; i++){
+		if(fileDes[i].fileName[0] != '\0' && sameLoc(&fileDes[i].loc, &loc)){
+			fdRelease(i);
+		}
+	}
+	return dirRemove(&parent, &loc);
+}
+
+//print one entry of a listing
+static void ls_entry(const rootEntry* entry)
+{
+	//legacy listings show the end of chain of empty files as it is on disk
+	uint32_t start = (sBlock->version == 1 && entry->dataStartIndex == FAT_EOC)
+			? FAT_EOC_V1 : entry->dataStartIndex;
+
+	if (entry->fileName[0] != '\0'){
+		printf("%s: %.16s, size: %u, data_blk: %u\n",
+				entryType(entry) == ENTRY_DIR ? "dir" : "file",
+				entry->fileName, entry->fileSize, start);
+	}
+}
+
+static int do_fs_ls(void)
+{
+    rootDirectory* rBlock = getRootDirectory();
+    if(rBlock == NULL){
+        return -1;
+    }
+
+    //blocks not loaded yet are streamed through one buffer, not loaded
+    char* block = NULL;
+	printf("FS Ls:\n");
+	for(uint32_t b = 0; b < rBlock->blockCount; b++){
+		if(b < rBlock->loadedBlocks){
+			for(uint32_t i = 0; i < rBlock->perBlock; i++){
+				ls_entry(&rBlock->entries[b * rBlock->perBlock + i]);
+			}
+			continue;
+		}
+		if(block == NULL && (block = allocBlockBuf()) == NULL){
+			return -1;
+		}
+		if(block_read(sBlock->rootIndex + b, block) == -1){
+			freeBlockBuf(block);
+			return -1;
+		}
+		for(uint32_t i = 0; i < rBlock->perBlock; i++){
+			rootEntry entry;
+			decode_rootEntry(block, i, &entry);
+			ls_entry(&entry);
+		}
+	}
+	freeBlockBuf(block);
+	return 0;
+}
+
+static int do_fs_mkdir(const char *path)
+{
+    dirRef parent;
+    char name[FS_FILENAME_LEN];
+    entryLoc loc;
+
+    if(sBlock == NULL || resolveParent(path, &parent, name, FAT_EOC) == -1
+            || dirLookup(&parent, name, &loc) == 0){
+        return -1;
+    }
+
+    int start = allocChain(1);
+    if(start == -1){
+        return -1;
+    }
+    dirCacheSlot* slot = dirBlockGet(start, 1);
+    if(slot == NULL){
+        freeChain(start);
+        return -1;
+    }
+    memcpy(slot->entries[0].fileName, ".", 2);
+    entryType(&slot->entries[0]) = ENTRY_DIR;
+
+    rootEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    strcpy(entry.fileName, name);
+    entry.fileSize = blockSize;
+    entry.dataStartIndex = start;
+    entryType(&entry) = ENTRY_DIR;
+    if(dirAdd(&parent, &entry, &loc) == -1){
+        dirCacheDrop(start);
+        freeChain(start);
+        return -1;
+    }
+    return 0;
+}
+
+static int do_fs_rmdir(const char *path)
+{
+    dirRef parent, dir;
+    char name[FS_FILENAME_LEN];
+    entryLoc loc;
+    dirCacheSlot* hslot;
+
+    if(sBlock == NULL || lookupPath(path, &parent, name, &loc) == -1
+            || dirOpen(&loc, &dir) == -1){
+        return -1;
+    }
+    rootEntry* header = dirHeader(&dir, &hslot);
+    if(header == NULL || header->fileSize != 0){
+        return -1;
+    }
+
+    for(uint32_t b = 0; b < dir.blocks; b++){
+        if(dirCacheDrop(dirBlockAt(&dir, b)) == -1){
+            return -1;
+        }
+    }
+    dirMapDrop(dir.start);
+    freeChain(dir.start);
+    dentryFlush();
+    return dirRemove(&parent, &loc);
+}
+
+static int do_fs_rename(const char *oldpath, const char *newpath)
+{
+    dirRef from, to;
+    char oldName[FS_FILENAME_LEN], newName[FS_FILENAME_LEN];
+    entryLoc oldLoc, newLoc;
+
+    if(sBlock == NULL || lookupPath(oldpath, &from, oldName, &oldLoc) == -1){
+        return -1;
+    }
+    rootEntry* old = entryAt(&oldLoc);
+    if(old == NULL){
+        return -1;
+    }
+    rootEntry entry = *old;
+
+    //a directory can't move below itself
+    uint32_t avoid = (entryType(&entry) == ENTRY_DIR) ? entry.dataStartIndex : FAT_EOC;
+    if(resolveParent(newpath, &to, newName, avoid) == -1){
+        return -1;
+    }
+    if(dirLookup(&to, newName, &newLoc) == 0){
+        return sameLoc(&oldLoc, &newLoc) ? 0 : -1;
+    }
+
+    if(dirRemove(&from, &oldLoc) == -1){
+        return -1;
+    }
+    if(to.start == from.start){
+        //the removal may have freed the one slot left in a full root directory
+        to = from;
+    }
+    int ret = 0;
+    memset(entry.fileName, 0, 16);
+    strcpy(entry.fileName, newName);
+    if(dirAdd(&to, &entry, &newLoc) == -1){
+        //put the entry back where it was
+        ret = -1;
+        memset(entry.fileName, 0, 16);
+        strcpy(entry.fileName, oldName);
+        strcpy(newName, oldName);
+        if(dirAdd(&from, &entry, &newLoc) == -1){
+            return -1;
+        }
+    }
+
+    //open files follow the entry
+    for(int i = 0; i < fdCapacity; i++){
+        if(fileDes[i].fileName[0] != '\0' && sameLoc(&fileDes[i].loc, &oldLoc)){
+            fileDes[i].loc = newLoc;
+            strcpy(fileDes[i].fileName, newName);
+        }
+    }
+    dentryFlush();
+    return ret;
+}
+
+static int do_fs_lsdir(const char *path)
+{
+    dirRef parent, dir;
+    char name[FS_FILENAME_LEN];
+    entryLoc loc;
+
+    if(sBlock == NULL || path == NULL){
+        return -1;
+    }
+    if(path[strspn(path, "/")] == '\0'){
+        return do_fs_ls();
+    }
+    if(lookupPath(path, &parent, name, &loc) == -1 || dirOpen(&loc, &dir) == -1){
+        return -1;
+    }
+
+    //blocks not cached are streamed through one buffer, not cached
+    char* block = allocBlockBuf();
+    rootEntry entry;
+    if(block == NULL){
+        return -1;
+    }
+	printf("FS Ls:\n");
+    for(uint32_t b = 0; b < dir.blocks; b++){
+        uint32_t index = dirBlockAt(&dir, b);
+        dirCacheSlot* slot = (index == FAT_EOC) ? NULL : dirCacheFind(index);
+        if(slot == NULL && (index == FAT_EOC || dirBlockRead(index, block) == -1)){
+            freeBlockBuf(block);
+            return -1;
+        }
+        for(uint32_t i = (b == 0) ? 1 : 0; i < entriesPerBlock(); i++){
+            if(slot != NULL){
+                ls_entry(&slot->entries[i]);
+            }
+            else{
+                decode_rootEntry(block, i, &entry);
+                ls_entry(&entry);
+            }
+        }
+    }
+    freeBlockBuf(block);
+    return 0;
+}
+
+//resolve a path naming a directory, "/" or "" being the root directory
+int openDirPath(const char *path, dirRef* dir){
+    dirRef parent;
+    char name[FS_FILENAME_LEN];
+    entryLoc loc;
+
+    if(path == NULL){
+        return -1;
+    }
+    if(path[strspn(path, "/")] == '\0'){
+        dir->start = DIR_ROOT;
+        dir->blocks = 0;
+        return 0;
+    }
+    if(lookupPath(path, &parent, name, &loc) == -1){
+        return -1;
+    }
+    return dirOpen(&loc, dir);
+}
+
+void fillDirent(const rootEntry* entry, struct fs_dirent* ent){
+    memcpy(ent->name, entry->fileName, FS_FILENAME_LEN);
+    //names filling the whole field are not NULL-terminated on disk
+    ent->name[FS_FILENAME_LEN - 1] = '\0';
+    ent->size = entry->fileSize;
+    ent->first_block = entry->dataStartIndex;
+    ent->is_dir = entryType(entry) == ENTRY_DIR;
+}
+
+static int do_fs_readdir(const char *path, uint64_t *pos,
+        struct fs_dirent *ents, int max)
+{
+    dirRef dir;
+    int n = 0;
+
+    if(sBlock == NULL || pos == NULL || ents == NULL || max < 0
+            || openDirPath(path, &dir) == -1){
+        return -1;
+    }
+
+    //positions are slots of the directory, picked up where the last call left
+    if(dir.start == DIR_ROOT){
+        uint64_t capacity = (uint64_t)rootDir->perBlock * rootDir->blockCount;
+        for(; *pos < capacity && n < max; (*pos)++){
+            while(*pos >= (uint64_t)rootDir->loadedBlocks * rootDir->perBlock){
+                if(load_rootBlock() == -1){
+                    return -1;
+                }
+            }
+            if(rootDir->entries[*pos].fileName[0] != '\0'){
+                fillDirent(&rootDir->entries[*pos], &ents[n++]);
+            }
+        }
+        return n;
+    }
+
+    uint32_t perBlock = entriesPerBlock();
+    uint64_t capacity = (uint64_t)perBlock * dir.blocks;
+    dirCacheSlot* slot = NULL;
+    uint32_t slotIndex = UINT32_MAX;
+    for(; *pos < capacity && n < max; (*pos)++){
+        uint32_t b = *pos / perBlock;
+        uint32_t i = *pos % perBlock;
+        if(b != slotIndex){
+            uint32_t block = dirBlockAt(&dir, b);
+            slot = (block == FAT_EOC) ? NULL : dirBlockGet(block, 0);
+            if(slot == NULL){
+                return -1;
+            }
+            slotIndex = b;
+        }
+        //the header of the directory is not one of its files
+        if((b != 0 || i != 0) && slot->entries[i].fileName[0] != '\0'){
+            fillDirent(&slot->entries[i], &ents[n++]);
+        }
+    }
+    return n;
+}
+
+static int do_fs_stat_many(const char **paths, int count,
+        struct fs_dirent *ents)
+{
+    dirRef parent;
+    char name[FS_FILENAME_LEN];
+    entryLoc loc;
+    int found = 0;
+
+    if(sBlock == NULL || count < 0 || (count > 0 && (paths == NULL || ents == NULL))){
+        return -1;
+    }
+    for(int i = 0; i < count; i++){
+        rootEntry* entry = NULL;
+        if(lookupPath(paths[i], &parent, name, &loc) == 0){
+            entry = entryAt(&loc);
+        }
+        if(entry == NULL){
+            memset(&ents[i], 0, sizeof(struct fs_dirent));
+            continue;
+        }
+        fillDirent(entry, &ents[i]);
+        found++;
+    }
+    return found;
+}
+
+static int do_fs_open(const char *filename)
+{
+    dirRef parent;
+    char name[FS_FILENAME_LEN];
+    entryLoc loc;
+
+    if(sBlock == NULL || lookupPath(filename, &parent, name, &loc) == -1){
+        return -1;
+    }
+    rootEntry* entry = entryAt(&loc);
+	if(entry == NULL || entryType(entry) == ENTRY_DIR){
+		return -1;
+	}
+	int j = fdAlloc();
+	if(j == -1){
+		return -1;
+	}
+	strcpy(fileDes[j].fileName, name);
+	fileDes[j].offset = 0;
+	fileDes[j].loc = loc;
+	return ((fileDes[j].gen & FD_GEN_MASK) << FD_INDEX_BITS) | j;
+}
+
+static int do_fs_close(int fd)
+{
+	fdOp *f = getFdOpByDescriptor(fd);
+	if(f == NULL){
+		return -1;
+	}
+	fdRelease(f - fileDes);
+	return 0;
+}
+
+static int do_fs_stat(int fd)
+{
+    fdOp *f = getFdOpByDescriptor(fd);
+    if(f == NULL){
+		return -1;
+	}
+
+    rootEntry* entry = entryAt(&f->loc);
+    if(entry == NULL){
+        return -1;
+    }
+    return entry->fileSize;
+}
+
+static int do_fs_lseek(int fd, size_t offset)
+{
+	fdOp *f = getFdOpByDescriptor(fd);
+	if(f == NULL){
+		return -1;
+	}
+
+	int size = do_fs_stat(fd);
+	if(offset > size){
+		return -1;
+	}
+
+	f->offset = offset;
+	return 0;
+}
+
+//next-fit scan of the FAT starting at the lowest index that may be free
+int findEmptyBlock(){
+	stats_inc(alloc_scans);
+	if(fatFree == 0){
+		FS_PROBE(alloc_fail);
+		return -1;
+	}
+	for(uint32_t i = fatFreeHint; i < sBlock->dataBlockCount; i++){
+		if(fatTable[i] == 0){
+			stats_add(alloc_entries_scanned, i - fatFreeHint + 1);
+			fatFreeHint = i + 1;
+			FS_PROBE1(alloc_block, i);
+			return i;
+		}
+	}
+	stats_add(alloc_entries_scanned, sBlock->dataBlockCount - fatFreeHint);
+	FS_PROBE(alloc_fail);
+	return -1;
+}
+
+//===========================================================================//
+//                    BLOCK-SIZE SPECIALIZED DATA PATH                       //
+//===========================================================================//
+
+// The data path is written once against a block size bs and instantiated for
+// the common block sizes. There bs is a compile-time constant, so block
+// offsets reduce to shifts and masks and block copies to fixed-size moves.
+// Other sizes go through the generic instance. fs_mount() selects the copy
+// that matches the mounted file system.
+
+int cowPrefix(const entryLoc* loc, uint32_t upto);
+
+//get data block blockNum of a file, its chain growing by a block when it
+//ends right before blockNum and extend is set
+static inline __attribute__((always_inline))
+int calcStartBlock(const rootEntry *entry, size_t blockNum, int extend){
+	uint32_t currBlock = entry->dataStartIndex;
+
+	if(!chainBlock(currBlock)){
+		return -1;
+	}
+	for(size_t j = 0; j < blockNum; j++){
+		uint32_t next = fatTable[currBlock];
+		if(next == FAT_EOC){
+			if(!extend || j + 1 != blockNum){
+				return -1;
+			}
+			int newBlock = allocBlock();
+			if(newBlock == -1){
+				return -1;
+			}
+			fatTable[currBlock] = newBlock;
+			markFatDirty(currBlock);
+			next = newBlock;
+		}
+		else if(!chainBlock(next)){
+			return -1;
+		}
+		currBlock = next;
+		stats_inc(fat_hops);
+	}
+	return currBlock;
+}
+
+//give the file at loc a first block, which the empty files of the reference
+//tools don't have
+static int ownFirstBlock(const entryLoc *loc){
+	rootEntry *entry = entryAt(loc);
+
+	if(entry == NULL){
+		return -1;
+	}
+	if(entry->dataStartIndex != FAT_EOC){
+		return 0;
+	}
+	int block = allocBlock();
+	if(block == -1){
+		return -1;
+	}
+	entry->dataStartIndex = block;
+	entryDirty(loc);
+	return 0;
+}
+
+//cursor over the bytes described by an iovec array
+typedef struct {
+	const struct iovec *iov;
+	int i;
+	size_t off;
+} iovCursor;
+
+//batch of physically consecutive data blocks, transferred with a single
+//vectored block I/O straight from or to the caller's buffers
+#define RUN_SEGS_MAX 64
+typedef struct {
+	uint32_t start;
+	uint32_t count;
+	//bytes of the request before the batch
+	size_t first;
+	int segs;
+	struct iovec seg[RUN_SEGS_MAX];
+} blockRun;
+
+//total length of an iovec array, -1 if the array is invalid
+static ssize_t iovLength(const struct iovec *iov, int iovcnt){
+	size_t total = 0;
+
+	if(iovcnt < 0 || iovcnt > FS_IOV_MAX || (iovcnt > 0 && iov == NULL)){
+		return -1;
+	}
+	for(int i = 0; i < iovcnt; i++){
+		if(iov[i].iov_len > SSIZE_MAX - total){
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+//get the next piece of at most n bytes at the cursor, and move past it
+static size_t iovNext(iovCursor *c, size_t n, char **p){
+	while(c->off == c->iov[c->i].iov_len){
+		c->i++;
+		c->off = 0;
+	}
+	size_t len = c->iov[c->i].iov_len - c->off;
+	if(len > n){
+		len = n;
+	}
+	*p = (char *)c->iov[c->i].iov_base + c->off;
+	c->off += len;
+	return len;
+}
+
+//copy the next n bytes at the cursor out to buf
+static void iovGather(iovCursor *c, char *buf, size_t n){
+	char *p;
+	while(n > 0){
+		size_t len = iovNext(c, n, &p);
+		memcpy(buf, p, len);
+		buf += len;
+		n -= len;
+	}
+}
+
+//copy n bytes of buf in at the cursor
+static void iovScatter(iovCursor *c, const char *buf, size_t n){
+	char *p;
+	while(n > 0){
+		size_t len = iovNext(c, n, &p);
+		memcpy(p, buf, len);
+		buf += len;
+		n -= len;
+	}
+}
+
+//number of pieces the next n bytes at the cursor are made of, stopping
+//counting past RUN_SEGS_MAX, where it also stops if direct I/O can't take
+//one of them
+static int iovPieces(iovCursor c, size_t n){
+	int pieces = 0;
+	char *p;
+	while(n > 0 && pieces <= RUN_SEGS_MAX){
+		size_t len = iovNext(&c, n, &p);
+		if(ioDirect && ((uintptr_t)p % BLOCK_ALIGN != 0 || len % BLOCK_ALIGN != 0)){
+			return RUN_SEGS_MAX + 1;
+		}
+		n -= len;
+		pieces++;
+	}
+	return pieces;
+}
+
+//check whether block, made of pieces buffer pieces, can join the batch
+static int runFits(const blockRun *r, uint32_t block, int pieces){
+	return r->count == 0
+		|| (block == r->start + r->count && r->segs + pieces <= RUN_SEGS_MAX);
+}
+
+//add block to the batch, its buffers being the next bs bytes at the cursor
+static void runAdd(blockRun *r, iovCursor *c, uint32_t block, size_t bs,
+		size_t done){
+	char *p;
+
+	if(r->count == 0){
+		r->start = block;
+		r->first = done;
+		r->segs = 0;
+	}
+	r->count++;
+	while(bs > 0){
+		size_t len = iovNext(c, bs, &p);
+		struct iovec *last = (r->segs > 0) ? &r->seg[r->segs - 1] : NULL;
+		//pieces adjacent in memory make one segment
+		if(last != NULL && (char *)last->iov_base + last->iov_len == p){
+			last->iov_len += len;
+		}
+		else{
+			r->seg[r->segs].iov_base = p;
+			r->seg[r->segs].iov_len = len;
+			r->segs++;
+		}
+		bs -= len;
+	}
+}
+
+//transfer the batch, if any
+static int runFlush(blockRun *r, size_t base, int write){
+	if(r->count == 0){
+		return 0;
+	}
+	size_t block = base + r->start;
+	int ret = write ? block_writev(block, r->count, r->seg, r->segs)
+			: block_readv(block, r->count, r->seg, r->segs);
+	r->count = 0;
+	return ret;
+}
+
+static inline __attribute__((always_inline))
+int do_fs_pwritev_bs(fdOp *f, const struct iovec *iov, int iovcnt,
+		size_t offset, const size_t bs)
+{
+	size_t currAmtCopied = 0;
+	char *hold = ioBlock;
+	iovCursor cur = { iov, 0, 0 };
+	blockRun run;
+
+	ssize_t total = iovLength(iov, iovcnt);
+	rootEntry *entry = (f == NULL) ? NULL : entryAt(&f->loc);
+	if(entry == NULL || total == -1 || offset > entry->fileSize){
+		return -1;
+	}
+	//the size has to fit in the entry, and the result in an int
+	size_t count = total;
+	if(count > UINT32_MAX - offset){
+		count = UINT32_MAX - offset;
+	}
+	if(count > INT_MAX){
+		count = INT_MAX;
+	}
+	if(count == 0){
+		return 0;
+	}
+	if(ownFirstBlock(&f->loc) == -1){
+		return 0;
+	}
+	//blocks shared with another file are copied before they change
+	if(fatRefs != NULL){
+		if(cowPrefix(&f->loc, (offset + count - 1) / bs) == -1){
+			return -1;
+		}
+		entry = entryAt(&f->loc);
+		if(entry == NULL){
+			return -1;
+		}
+	}
+	size_t fileSize = entry->fileSize;
+
+	int currBlock = calcStartBlock(entry, offset / bs, 1);
+	if(currBlock == -1){
+		return 0;
+	}
+	run.count = 0;
+	size_t pos = offset % bs;
+	while(currAmtCopied < count){
+		size_t n = bs - pos;
+		if(n > count - currAmtCopied){
+			n = count - currAmtCopied;
+		}
+
+		int pieces = (n == bs) ? iovPieces(cur, bs) : RUN_SEGS_MAX + 1;
+		if(pieces <= RUN_SEGS_MAX){
+			//whole blocks are written straight from the caller's buffers
+			if(!runFits(&run, currBlock, pieces)){
+				size_t first = run.first;
+				if(runFlush(&run, sBlock->dataStartIndex, 1) == -1){
+					currAmtCopied = first;
+					break;
+				}
+			}
+			runAdd(&run, &cur, currBlock, bs, currAmtCopied);
+		}
+		else{
+			//partial block: keep the bytes of the file around the new ones
+			size_t blockStart = offset + currAmtCopied - pos;
+			if(blockStart < fileSize){
+				if(block_read(sBlock->dataStartIndex + currBlock, hold) == -1){
+					break;
+				}
+			}
+			else{
+				memset(hold, 0, bs);
+			}
+			iovGather(&cur, hold + pos, n);
+			if(block_write(sBlock->dataStartIndex + currBlock, hold) == -1){
+				break;
+			}
+		}
+		currAmtCopied += n;
+		pos = 0;
+
+		if(currAmtCopied < count){
+			if(fatTable[currBlock] != FAT_EOC){
+				currBlock = fatTable[currBlock];
+				stats_inc(fat_hops);
+			}
+			else{
+				int newBlock = allocBlock();
+				// disk is full: stop after what was written so far
+				if(newBlock == -1){
+					break;
+				}
+				fatTable[currBlock] = newBlock;
+				markFatDirty(currBlock);
+				currBlock = newBlock;
+			}
+		}
+	}
+	//only what made it to disk counts
+	size_t first = run.first;
+	if(runFlush(&run, sBlock->dataStartIndex, 1) == -1 && first < currAmtCopied){
+		currAmtCopied = first;
+	}
+
+	if(offset + currAmtCopied > fileSize){
+		//allocating blocks may have moved the entry around in the cache
+		entry = entryAt(&f->loc);
+		if(entry == NULL){
+			return -1;
+		}
+		entry->fileSize = offset + currAmtCopied;
+		entryDirty(&f->loc);
+	}
+	stats_add(bytes_written, currAmtCopied);
+	return currAmtCopied;
+}
+
+//consecutive data blocks of a read
+typedef struct {
+	uint32_t start;
+	uint32_t count;
+} blockSpan;
+
+//what a read transfers, taken from the entry and the FAT under fsLock so that
+//the data blocks can be read without it
+#define READ_SPANS_LOCAL 8
+typedef struct {
+	//disk index of data block 0
+	size_t base;
+	//of the first byte in the file, and bytes to read from there
+	size_t offset;
+	size_t count;
+	uint32_t spans;
+	uint32_t capacity;
+	blockSpan *span;
+	blockSpan local[READ_SPANS_LOCAL];
+} readPlan;
+
+static void readPlanFree(readPlan *p){
+	if(p->span != p->local){
+		free(p->span);
+	}
+	p->span = p->local;
+}
+
+//add data block to the plan, -1 if the plan can't grow
+static int readPlanAdd(readPlan *p, uint32_t block){
+	if(p->spans > 0){
+		blockSpan *last = &p->span[p->spans - 1];
+		if(block == last->start + last->count){
+			last->count++;
+			return 0;
+		}
+	}
+	if(p->spans == p->capacity){
+		uint32_t capacity = p->capacity * 2;
+		blockSpan *span = malloc(capacity * sizeof(blockSpan));
+		if(span == NULL){
+			return -1;
+		}
+		memcpy(span, p->span, p->spans * sizeof(blockSpan));
+		readPlanFree(p);
+		p->span = span;
+		p->capacity = capacity;
+	}
+	p->span[p->spans].start = block;
+	p->span[p->spans].count = 1;
+	p->spans++;
+	return 0;
+}
+
+//plan the read of total bytes at offset of the file open as f (fsLock must
+//be held); a plan with bytes to read counts as a read in flight until
+//readPlanDone()
+static int readPlanMake(readPlan *p, fdOp *f, ssize_t total, size_t offset){
+	p->offset = offset;
+	p->count = 0;
+	p->spans = 0;
+	p->capacity = READ_SPANS_LOCAL;
+	p->span = p->local;
+
+	rootEntry *entry = (f == NULL) ? NULL : entryAt(&f->loc);
+	if(entry == NULL || total == -1){
+		return -1;
+	}
+	//reads stop at the end of the file
+	if(offset >= entry->fileSize || total == 0){
+		return 0;
+	}
+	size_t count = total;
+	if(count > entry->fileSize - offset){
+		count = entry->fileSize - offset;
+	}
+	//the result has to fit in an int
+	if(count > INT_MAX){
+		count = INT_MAX;
+	}
+
+	int currBlock = calcStartBlock(entry, offset / blockSize, 0);
+	if(currBlock == -1){
+		return -1;
+	}
+	size_t pos = offset % blockSize;
+	size_t blocks = (pos + count + blockSize - 1) / blockSize;
+	for(size_t i = 0; i < blocks; i++){
+		if(readPlanAdd(p, currBlock) == -1){
+			readPlanFree(p);
+			return -1;
+		}
+		if(i + 1 < blocks){
+			currBlock = fatTable[currBlock];
+			stats_inc(fat_hops);
+			//the chain is shorter than the file size says
+			if(currBlock == FAT_EOC){
+				count = (i + 1) * blockSize - pos;
+				break;
+			}
+		}
+	}
+	p->base = sBlock->dataStartIndex;
+	p->count = count;
+	__atomic_add_fetch(&readsInFlight, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+//end of the transfer of a plan, which can then no longer see its blocks freed
+static void readPlanDone(readPlan *p){
+	if(p->count > 0){
+		pthread_mutex_lock(&readLock);
+		if(__atomic_sub_fetch(&readsInFlight, 1, __ATOMIC_RELEASE) == 0){
+			pthread_cond_broadcast(&readsDone);
+		}
+		pthread_mutex_unlock(&readLock);
+	}
+	readPlanFree(p);
+}
+
+//read the planned blocks into the caller's buffers; fsLock need not be held,
+//the bounce buffer for partial blocks is the caller's own
+static inline __attribute__((always_inline))
+int do_fs_preadv_bs(const readPlan *p, const struct iovec *iov, const size_t bs)
+{
+	size_t currAmtCopied = 0;
+	char *hold = NULL;
+	iovCursor cur = { iov, 0, 0 };
+	blockRun run;
+	int ret = 0;
+
+	if(p->count == 0){
+		return 0;
+	}
+	const blockSpan *span = p->span;
+	uint32_t currBlock = span->start;
+	run.count = 0;
+	size_t pos = p->offset % bs;
+	while(currAmtCopied < p->count){
+		size_t n = bs - pos;
+		if(n > p->count - currAmtCopied){
+			n = p->count - currAmtCopied;
+		}
+
+		int pieces = (n == bs) ? iovPieces(cur, bs) : RUN_SEGS_MAX + 1;
+		if(pieces <= RUN_SEGS_MAX){
+			//whole blocks are read straight into the caller's buffers
+			if(!runFits(&run, currBlock, pieces)
+					&& runFlush(&run, p->base, 0) == -1){
+				ret = -1;
+				break;
+			}
+			runAdd(&run, &cur, currBlock, bs, currAmtCopied);
+		}
+		else{
+			if(hold == NULL && (hold = allocBlockBuf()) == NULL){
+				ret = -1;
+				break;
+			}
+			if(block_read(p->base + currBlock, hold) == -1){
+				ret = -1;
+				break;
+			}
+			iovScatter(&cur, hold + pos, n);
+		}
+		currAmtCopied += n;
+		pos = 0;
+
+		if(currAmtCopied < p->count){
+			if(currBlock + 1 == span->start + span->count){
+				span++;
+				currBlock = span->start;
+			}
+			else{
+				currBlock++;
+			}
+		}
+	}
+	if(ret == 0 && runFlush(&run, p->base, 0) == -1){
+		ret = -1;
+	}
+	if(hold != NULL){
+		freeBlockBuf(hold);
+	}
+	if(ret == -1){
+		return -1;
+	}
+	stats_add(bytes_read, currAmtCopied);
+	return currAmtCopied;
+}
+
+#define BLOCK_IO_VARIANT(suffix, bs) \
+static int do_fs_pwritev_##suffix(fdOp *f, const struct iovec *iov, \
+		int iovcnt, size_t offset){ \
+	return do_fs_pwritev_bs(f, iov, iovcnt, offset, bs); \
+} \
+static int do_fs_preadv_##suffix(const readPlan *p, \
+		const struct iovec *iov){ \
+	return do_fs_preadv_bs(p, iov, bs); \
+}
+
+BLOCK_IO_VARIANT(4k, 4096)
+BLOCK_IO_VARIANT(16k, 16384)
+BLOCK_IO_VARIANT(64k, 65536)
+BLOCK_IO_VARIANT(256k, 262144)
+BLOCK_IO_VARIANT(1m, 1048576)
+BLOCK_IO_VARIANT(any, blockSize)
+
+typedef struct {
+	size_t blockSize;
+	int (*pwritev)(fdOp *f, const struct iovec *iov, int iovcnt, size_t offset);
+	int (*preadv)(const readPlan *p, const struct iovec *iov);
+} blockIoOps;
+
+//specialized instances, then the generic one (block size 0 matches any)
+static const blockIoOps blockIoTable[] = {
+	{ 4096, do_fs_pwritev_4k, do_fs_preadv_4k },
+	{ 16384, do_fs_pwritev_16k, do_fs_preadv_16k },
+	{ 65536, do_fs_pwritev_64k, do_fs_preadv_64k },
+	{ 262144, do_fs_pwritev_256k, do_fs_preadv_256k },
+	{ 1048576, do_fs_pwritev_1m, do_fs_preadv_1m },
+	{ 0, do_fs_pwritev_any, do_fs_preadv_any },
+};
+
+//data path of the mounted file system
+const blockIoOps *blockIo = &blockIoTable[0];
+
+void select_block_io(){
+	blockIo = blockIoTable;
+	while(blockIo->blockSize != 0 && blockIo->blockSize != blockSize){
+		blockIo++;
+	}
+}
+
+//every transfer goes through the vectored positional versions; the others
+//use the descriptor offset and/or a single buffer, then move the offset past
+//what was transferred
+static int do_fs_pwritev(int fd, const struct iovec *iov, int iovcnt,
+		size_t offset)
+{
+	return blockIo->pwritev(getFdOpByDescriptor(fd), iov, iovcnt, offset);
+}
+
+//reads plan the transfer under fsLock, then read the data blocks without it,
+//so that they overlap each other and the rest of the file system: unlike the
+//other do_fs_* calls they take fsLock themselves
+static int do_fs_preadv(int fd, const struct iovec *iov, int iovcnt,
+		size_t offset)
+{
+	readPlan plan;
+
+	pthread_mutex_lock(&fsLock);
+	int ret = readPlanMake(&plan, getFdOpByDescriptor(fd),
+			iovLength(iov, iovcnt), offset);
+	pthread_mutex_unlock(&fsLock);
+	if(ret == -1){
+		return -1;
+	}
+	ret = blockIo->preadv(&plan, iov);
+	readPlanDone(&plan);
+	return ret;
+}
+
+static int do_fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	fdOp *f = getFdOpByDescriptor(fd);
+	if(f == NULL){
+		return -1;
+	}
+	int ret = blockIo->pwritev(f, iov, iovcnt, f->offset);
+	if(ret > 0){
+		f->offset += ret;
+	}
+	return ret;
+}
+
+//the descriptor offset moves past the planned bytes up front, so concurrent
+//reads of one descriptor get consecutive ranges
+static int do_fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	readPlan plan;
+
+	pthread_mutex_lock(&fsLock);
+	fdOp *f = getFdOpByDescriptor(fd);
+	int ret = readPlanMake(&plan, f, iovLength(iov, iovcnt),
+			(f == NULL) ? 0 : f->offset);
+	if(ret == 0){
+		f->offset += plan.count;
+	}
+	pthread_mutex_unlock(&fsLock);
+	if(ret == -1){
+		return -1;
+	}
+	ret = blockIo->preadv(&plan, iov);
+	readPlanDone(&plan);
+	//a failed transfer gives the range back, unless the offset moved on since
+	if(ret == -1){
+		pthread_mutex_lock(&fsLock);
+		f = getFdOpByDescriptor(fd);
+		if(f != NULL && f->offset == plan.offset + plan.count){
+			f->offset = plan.offset;
+		}
+		pthread_mutex_unlock(&fsLock);
+	}
+	return ret;
+}
+
+static int do_fs_write(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { buf, count };
+	return do_fs_writev(fd, &iov, 1);
+}
+
+static int do_fs_read(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { buf, count };
+	return do_fs_readv(fd, &iov, 1);
+}
+
+static int do_fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { (void *)buf, count };
+	return do_fs_pwritev(fd, &iov, 1, offset);
+}
+
+static int do_fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { buf, count };
+	return do_fs_preadv(fd, &iov, 1, offset);
+}
+
+//hand each run of consecutive blocks of the range to the block layer, which
+//has the host copy it straight from the disk file
+static int do_fs_sendfile(int out_fd, int fd, size_t *offset, size_t count)
+{
+	fdOp *f = getFdOpByDescriptor(fd);
+	rootEntry *entry = (f == NULL) ? NULL : entryAt(&f->loc);
+	size_t done = 0;
+
+	if(entry == NULL){
+		return -1;
+	}
+	size_t pos = (offset != NULL) ? *offset : f->offset;
+	if(pos >= entry->fileSize){
+		return 0;
+	}
+	if(count > entry->fileSize - pos){
+		count = entry->fileSize - pos;
+	}
+	if(count > INT_MAX){
+		count = INT_MAX;
+	}
+
+	int block = calcStartBlock(entry, pos / blockSize, 0);
+	size_t skip = pos % blockSize;
+	while(block != -1 && done < count){
+		uint32_t start = block;
+		size_t len = blockSize - skip;
+		while(len < count - done && fatTable[block] == (uint32_t)block + 1){
+			block++;
+			len += blockSize;
+			stats_inc(fat_hops);
+		}
+		if(len > count - done){
+			len = count - done;
+		}
+		if(block_send(sBlock->dataStartIndex + start, skip, len, out_fd) == -1){
+			break;
+		}
+		done += len;
+		skip = 0;
+		block = (fatTable[block] == FAT_EOC) ? -1 : (int)fatTable[block];
+		stats_inc(fat_hops);
+	}
+	if(done == 0 && count > 0){
+		return -1;
+	}
+
+	if(offset != NULL){
+		*offset = pos + done;
+	}
+	else{
+		f->offset = pos + done;
+	}
+	stats_add(bytes_read, done);
+	return done;
+}
+
+//===========================================================================//
+//                      PREALLOCATION / TRUNCATION                           //
+//===========================================================================//
+
+//get the root directory entry of an open file descriptor
+rootEntry* getRootEntryByDescriptor(int fd){
+	fdOp *f = getFdOpByDescriptor(fd);
+	if(f == NULL || f->fileName[0] == '\0'){
+		return NULL;
+	}
+	return entryAt(&f->loc);
+}
+
+//find a run of count free data blocks, trying right after hint first
+int findFreeRun(int count, int hint){
+	int run = 0;
+
+	if(hint > 0 && hint + count <= sBlock->dataBlockCount){
+		for(run = 0; run < count; run++){
+			if(fatTable[hint + run] != 0){
+				break;
+			}
+		}
+		if(run == count){
+			return hint;
+		}
+	}
+
+	run = 0;
+	for(int i = 1; i < sBlock->dataBlockCount; i++){
+		run = (fatTable[i] == 0) ? run + 1 : 0;
+		if(run == count){
+			return i - count + 1;
+		}
+	}
+	return -1;
+}
+
+//a run of free data blocks
+typedef struct {
+	uint32_t start;
+	uint32_t length;
+} freeRun;
+
+static int cmpRunLonger(const void* a, const void* b){
+	const freeRun* x = a;
+	const freeRun* y = b;
+	return (x->length < y->length) - (x->length > y->length);
+}
+
+static int cmpRunStart(const void* a, const void* b){
+	const freeRun* x = a;
+	const freeRun* y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+//pick free runs adding up to count blocks in one pass over the FAT, the
+//longest ones so that the file gets as few fragments as possible, and return
+//them in disk order with the last one cut down to what is left
+//returns the number of runs, or -1 if they can't be listed
+static int pickFreeRuns(uint32_t count, freeRun** picked){
+	freeRun* runs = NULL;
+	uint32_t n = 0;
+	uint32_t capacity = 0;
+
+	for(uint32_t i = 1; i < sBlock->dataBlockCount; i++){
+		if(fatTable[i] != 0){
+			continue;
+		}
+		if(n > 0 && runs[n - 1].start + runs[n - 1].length == i){
+			runs[n - 1].length++;
+			continue;
+		}
+		if(n == capacity){
+			capacity = capacity ? capacity * 2 : 64;
+			freeRun* grown = realloc(runs, capacity * sizeof(freeRun));
+			if(grown == NULL){
+				free(runs);
+				return -1;
+			}
+			runs = grown;
+		}
+		runs[n].start = i;
+		runs[n].length = 1;
+		n++;
+	}
+
+	qsort(runs, n, sizeof(freeRun), cmpRunLonger);
+	uint32_t used = 0;
+	uint32_t total = 0;
+	while(used < n && total < count){
+		total += runs[used++].length;
+	}
+	if(total < count){
+		free(runs);
+		return -1;
+	}
+	runs[used - 1].length -= total - count;
+	qsort(runs, used, sizeof(freeRun), cmpRunStart);
+	*picked = runs;
+	return used;
+}
+
+static int do_fs_fallocate(int fd, size_t offset, size_t len)
+{
+	fdOp *f = getFdOpByDescriptor(fd);
+	rootEntry *entry = getRootEntryByDescriptor(fd);
+
+	//the size has to fit in the entry, so writes never go past UINT32_MAX
+	if(entry == NULL || len > SIZE_MAX - offset || offset + len > UINT32_MAX){
+		return -1;
+	}
+	if(ownFirstBlock(&f->loc) == -1){
+		return -1;
+	}
+
+	//walk to the end of the chain, counting the blocks already owned
+	uint64_t have = 1;
+	int last = entry->dataStartIndex;
+	if(!chainBlock(last)){
+		return -1;
+	}
+	while(fatTable[last] != FAT_EOC){
+		last = fatTable[last];
+		if(!chainBlock(last)){
+			return -1;
+		}
+		have++;
+		stats_inc(fat_hops);
+	}
+
+	uint64_t want = ((uint64_t)offset + len + blockSize - 1) / blockSize;
+	if(want <= have){
+		return 0;
+	}
+	uint64_t need = want - have;
+
+	//the last block gets relinked, it can't stay shared
+	if(fatRefs != NULL){
+		if(cowPrefix(&f->loc, have - 1) == -1){
+			return -1;
+		}
+		entry = entryAt(&f->loc);
+		last = entry->dataStartIndex;
+		while(fatTable[last] != FAT_EOC){
+			last = fatTable[last];
+		}
+	}
+
+	//fail early rather than leaving a partial reservation behind
+	if(fatFree < need){
+		return -1;
+	}
+
+	//one contiguous run if there is one, else the longest free runs
+	freeRun one;
+	freeRun* runs = &one;
+	int nruns = 1;
+	int start = findFreeRun(need, last + 1);
+	if(start != -1){
+		one.start = start;
+		one.length = need;
+	}
+	else{
+		nruns = pickFreeRuns(need, &runs);
+		if(nruns == -1){
+			return -1;
+		}
+	}
+	for(int r = 0; r < nruns; r++){
+		for(uint32_t i = 0; i < runs[r].length; i++){
+			int block = runs[r].start + i;
+			markFatDirty(last);
+			fatTable[last] = block;
+			fatTable[block] = FAT_EOC;
+			fatFree--;
+			markFatDirty(block);
+			FS_PROBE1(alloc_block, block);
+			last = block;
+		}
+	}
+	if(runs != &one){
+		free(runs);
+	}
+	return 0;
+}
+
+static int do_fs_truncate(int fd, size_t len)
+{
+	rootEntry *entry = getRootEntryByDescriptor(fd);
+
+	if(entry == NULL || len > entry->fileSize){
+		return -1;
+	}
+
+	//files always own their first block, but those of the reference tools
+	//when they are empty
+	int keep = (len + blockSize - 1) / blockSize;
+	if(keep < 1){
+		keep = 1;
+	}
+
+	fdOp *f = getFdOpByDescriptor(fd);
+	int last = entry->dataStartIndex;
+	if(last == FAT_EOC && len == 0){
+		entry->fileSize = 0;
+		entryDirty(&f->loc);
+		return 0;
+	}
+	if(!chainBlock(last)){
+		return -1;
+	}
+	for(int i = 1; i < keep; i++){
+		last = fatTable[last];
+		if(!chainBlock(last)){
+			return -1;
+		}
+		stats_inc(fat_hops);
+	}
+
+	//the block the chain is cut after can't stay shared
+	if(fatRefs != NULL && fatTable[last] != FAT_EOC){
+		if(cowPrefix(&f->loc, keep - 1) == -1){
+			return -1;
+		}
+		entry = entryAt(&f->loc);
+		last = entry->dataStartIndex;
+		for(int i = 1; i < keep; i++){
+			last = fatTable[last];
+		}
+	}
+
+	//cut the chain and release its tail, up to where another file shares it
+	uint32_t next = fatTable[last];
+	markFatDirty(last);
+	fatTable[last] = FAT_EOC;
+	freeChain(next);
+
+	entry->fileSize = len;
+	entryDirty(&f->loc);
+
+	//no descriptor may be left pointing past the new end of file
+	for(int i = 0; i < fdCapacity; i++){
+		if(fileDes[i].fileName[0] != '\0' && sameLoc(&fileDes[i].loc, &f->loc)
+				&& fileDes[i].offset > len){
+			fileDes[i].offset = len;
+		}
+	}
+	return 0;
+}
+
+//===========================================================================//
+//                            COPY AND CLONE                                 //
+//===========================================================================//
+
+// fs_copy_range() copies within the image, a chunk of blocks at a time, each
+// run of consecutive blocks read or written with a single block I/O. A clone
+// copies nothing past the first block: the chain of the copy links into the
+// second block of the original's, the files sharing their tail from there.
+// A FAT link being single, sharing only ever covers the tail of a chain:
+// fatRefs counts the links to each block beyond the first, and a file about
+// to change a shared block first copies its chain up to that block.
+
+//blocks copied per chunk
+#define COPY_CHUNK 256
+
+//whether some data block is shared between files
+static int fatShared(){
+    if(fatRefs == NULL){
+        return 0;
+    }
+    for(uint32_t i = 1; i < sBlock->dataBlockCount; i++){
+        if(fatRefs[i] > 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//transfer count blocks of a chain from *block on, between the chain and buf,
+//a run of consecutive blocks at a time; *block is left on the block after
+static int chainIo(uint32_t* block, uint32_t count, char* buf, int write){
+    uint32_t done = 0;
+
+    while(done < count){
+        uint32_t start = *block;
+        uint32_t len = 1;
+        while(done + len < count && fatTable[start + len - 1] == start + len){
+            len++;
+        }
+        struct iovec iov = { buf + (size_t)done * blockSize, (size_t)len * blockSize };
+        size_t at = sBlock->dataStartIndex + start;
+        if((write ? block_writev(at, len, &iov, 1) : block_readv(at, len, &iov, 1)) == -1){
+            return -1;
+        }
+        done += len;
+        *block = fatTable[start + len - 1];
+        stats_add(fat_hops, len);
+    }
+    return 0;
+}
+
+//copy count blocks from chain src to chain dst, both long enough
+static int chainCopy(uint32_t src, uint32_t dst, uint32_t count){
+    char* buf = pool_get((size_t)(count < COPY_CHUNK ? count : COPY_CHUNK) * blockSize);
+
+    if(buf == NULL){
+        return -1;
+    }
+    while(count > 0){
+        uint32_t n = (count < COPY_CHUNK) ? count : COPY_CHUNK;
+        if(chainIo(&src, n, buf, 0) == -1 || chainIo(&dst, n, buf, 1) == -1){
+            pool_put(buf);
+            return -1;
+        }
+        count -= n;
+    }
+    pool_put(buf);
+    return 0;
+}
+
+//give the file at loc a copy of its own of every block up to block upto, so
+//that they can be changed or relinked
+int cowPrefix(const entryLoc* loc, uint32_t upto){
+    rootEntry* entry = entryAt(loc);
+
+    if(entry == NULL){
+        return -1;
+    }
+    if(fatRefs == NULL){
+        return 0;
+    }
+
+    //first blocks are never shared, find the first one that is
+    uint32_t prev = entry->dataStartIndex;
+    if(!chainBlock(prev)){
+        return 0;
+    }
+    uint32_t block = fatTable[prev];
+    uint32_t i = 1;
+    while(chainBlock(block) && i <= upto && fatRefs[block] == 0){
+        prev = block;
+        block = fatTable[block];
+        i++;
+    }
+    if(!chainBlock(block) || i > upto){
+        return 0;
+    }
+
+    //copy the blocks from there, as a new chain rejoining the old one after
+    uint32_t count = 1;
+    uint32_t last = block;
+    while(i + count <= upto && chainBlock(fatTable[last])){
+        last = fatTable[last];
+        count++;
+    }
+    int copy = allocChain(count);
+    if(copy == -1){
+        return -1;
+    }
+    if(chainCopy(block, copy, count) == -1){
+        freeChain(copy);
+        return -1;
+    }
+    uint32_t copyLast = copy;
+    while(fatTable[copyLast] != FAT_EOC){
+        copyLast = fatTable[copyLast];
+    }
+    uint32_t after = fatTable[last];
+    if(after != FAT_EOC){
+        fatTable[copyLast] = after;
+        markFatDirty(copyLast);
+        fatRefs[after]++;
+    }
+    fatTable[prev] = copy;
+    markFatDirty(prev);
+    fatRefs[block]--;
+    return 0;
+}
+
+//make the empty file of descriptor out a clone of the file of descriptor in
+static int cloneFile(fdOp* in, fdOp* out){
+    rootEntry* src = entryAt(&in->loc);
+    rootEntry* dst = entryAt(&out->loc);
+
+    if(src == NULL || dst == NULL || !chainBlock(src->dataStartIndex)
+            || ownFirstBlock(&out->loc) == -1){
+        return -1;
+    }
+    //the superblock, which is never journaled, gets the flag before any
+    //shared block can reach the disk
+    if(fatRefs == NULL){
+        char* block = allocBlockBuf();
+        fatRefs = calloc(sBlock->dataBlockCount, sizeof(uint32_t));
+        if(block == NULL || fatRefs == NULL){
+            freeBlockBuf(block);
+            free(fatRefs);
+            fatRefs = NULL;
+            return -1;
+        }
+        sBlock->features |= FEATURE_SHARED;
+        encode_superblock(block);
+        int ret = block_write(0, block);
+        freeBlockBuf(block);
+        if(ret == -1 || block_disk_sync() == -1){
+            sBlock->features &= ~FEATURE_SHARED;
+            free(fatRefs);
+            fatRefs = NULL;
+            return -1;
+        }
+    }
+
+    //the clone keeps its own first block, a copy of the original's
+    uint32_t head = dst->dataStartIndex;
+    freeChain(fatTable[head]);
+    if(block_read(sBlock->dataStartIndex + src->dataStartIndex, ioBlock) == -1
+            || block_write(sBlock->dataStartIndex + head, ioBlock) == -1){
+        fatTable[head] = FAT_EOC;
+        markFatDirty(head);
+        return -1;
+    }
+    uint32_t next = fatTable[src->dataStartIndex];
+    fatTable[head] = next;
+    markFatDirty(head);
+    if(next != FAT_EOC){
+        fatRefs[next]++;
+    }
+    dst->fileSize = src->fileSize;
+    entryDirty(&out->loc);
+    return 0;
+}
+
+static int do_fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out,
+        size_t len, int flags){
+    fdOp* in = getFdOpByDescriptor(fd_in);
+    fdOp* out = getFdOpByDescriptor(fd_out);
+    rootEntry* src = (in == NULL) ? NULL : entryAt(&in->loc);
+    rootEntry* dst = (out == NULL) ? NULL : entryAt(&out->loc);
+
+    if(src == NULL || dst == NULL || off_out > dst->fileSize){
+        return -1;
+    }
+    size_t size = src->fileSize;
+    if(off_in >= size || len == 0){
+        return 0;
+    }
+    if(len > size - off_in){
+        len = size - off_in;
+    }
+    if(len > UINT32_MAX - off_out){
+        len = UINT32_MAX - off_out;
+    }
+    if(len > INT_MAX){
+        len = INT_MAX;
+    }
+    int same = sameLoc(&in->loc, &out->loc);
+    if(same && off_in < off_out + len && off_out < off_in + len){
+        return -1;
+    }
+
+    if((flags & FS_COPY_CLONE) && !same && off_in == 0 && off_out == 0
+            && len == size && dst->fileSize == 0){
+        return (cloneFile(in, out) == -1) ? -1 : (int)len;
+    }
+
+    //reserve the room up front, as a contiguous run when there is one
+    if(do_fs_fallocate(fd_out, off_out, len) == -1
+            || cowPrefix(&out->loc, (off_out + len - 1) / blockSize) == -1){
+        return -1;
+    }
+
+    //block-aligned ranges: whole blocks go from chain to chain
+    size_t done = 0;
+    if(off_in % blockSize == 0 && off_out % blockSize == 0 && len >= blockSize){
+        uint32_t count = len / blockSize;
+        src = entryAt(&in->loc);
+        int from = calcStartBlock(src, off_in / blockSize, 0);
+        dst = entryAt(&out->loc);
+        int to = calcStartBlock(dst, off_out / blockSize, 0);
+        if(from == -1 || to == -1 || chainCopy(from, to, count) == -1){
+            return -1;
+        }
+        done = (size_t)count * blockSize;
+        stats_add(bytes_written, done);
+        dst = entryAt(&out->loc);
+        if(off_out + done > dst->fileSize){
+            dst->fileSize = off_out + done;
+            entryDirty(&out->loc);
+        }
+    }
+
+    //anything else goes through the data path, a chunk at a time
+    if(done < len){
+        size_t chunk = (size_t)COPY_CHUNK * blockSize;
+        char* buf = pool_get(len - done < chunk ? len - done : chunk);
+        if(buf == NULL){
+            return done ? (int)done : -1;
+        }
+        while(done < len){
+            struct iovec iov = { buf, (len - done < chunk) ? len - done : chunk };
+            readPlan plan;
+            if(readPlanMake(&plan, in, iov.iov_len, off_in + done) == -1){
+                break;
+            }
+            int got = blockIo->preadv(&plan, &iov);
+            readPlanDone(&plan);
+            if(got <= 0){
+                break;
+            }
+            iov.iov_len = got;
+            int put = blockIo->pwritev(out, &iov, 1, off_out + done);
+            if(put > 0){
+                done += put;
+            }
+            if(put < got){
+                break;
+            }
+        }
+        pool_put(buf);
+    }
+    return done;
+}
+
+//===========================================================================//
+//                               TRIMMING                                    //
+//===========================================================================//
+
+// Freed data blocks keep their content, and their space, in the disk file.
+// fs_trim() punches holes over the runs of free blocks, which read back as
+// zeroes like the blocks of a fresh image.
+
+static int do_fs_trim(size_t min_blocks, size_t* trimmed){
+    uint32_t total;
+    uint32_t run = 0;
+    size_t done = 0;
+
+    if(sBlock == NULL){
+        return -1;
+    }
+    if(min_blocks == 0){
+        min_blocks = 1;
+    }
+    //the blocks must be free on disk as well, or a crash could bring back a
+    //file whose data is gone
+    if(flushDirtyBlocks() == -1 || block_disk_sync() == -1){
+        return -1;
+    }
+
+    total = sBlock->dataBlockCount;
+    for(uint32_t i = 1; i <= total; i++){
+        if(i < total && fatTable[i] == 0){
+            run++;
+            continue;
+        }
+        if(run >= min_blocks){
+            if(block_discard(sBlock->dataStartIndex + i - run, run) == -1){
+                return -1;
+            }
+            done += run;
+        }
+        run = 0;
+    }
+    if(trimmed != NULL){
+        *trimmed = done;
+    }
+    return 0;
+}
+
+//===========================================================================//
+//                             LAYOUT REPORT                                 //
+//===========================================================================//
+
+// fs_layout() describes where data sits on disk. The global figures and the
+// block map come out of a single pass over the FAT in block order, so they
+// cost the same whatever the number of files. Per-file figures walk only the
+// chains of the directory being reported.
+
+//map cells: all free, partly free, all allocated, holding a chain break
+#define LAYOUT_FREE '.'
+#define LAYOUT_MIXED ':'
+#define LAYOUT_USED '#'
+#define LAYOUT_BREAK 'x'
+
+static void layoutFreeRun(struct fs_layout_report* layout, uint32_t start, uint32_t length){
+    layout->free_runs++;
+    layout->free_hist[31 - __builtin_clz(length)]++;
+    if(length > layout->largest_free){
+        layout->largest_free = length;
+        layout->largest_free_start = start;
+    }
+}
+
+//global figures and, when map is not NULL, a block map of mapLen - 1 cells
+static void layoutScan(struct fs_layout_report* layout, char* map, size_t mapLen){
+    uint32_t total = sBlock->dataBlockCount;
+    uint32_t cells = 0;
+    uint32_t cell = 0;
+    uint64_t cellEnd = 0;
+    uint32_t cellFree = 0;
+    int cellBreak = 0;
+    uint64_t links = 0;
+    uint64_t breaks = 0;
+    uint32_t run = 0;
+
+    memset(layout, 0, sizeof(*layout));
+    layout->data_blocks = total;
+    if(map != NULL && mapLen > 0){
+        cells = (mapLen - 1 < total) ? mapLen - 1 : total;
+        map[cells] = '\0';
+        cellEnd = cells ? (uint64_t)total / cells : 0;
+    }
+
+    //entry 0 is reserved, it counts as allocated
+    for(uint32_t i = 0; i < total; i++){
+        uint32_t next = (i == 0) ? FAT_EOC : fatTable[i];
+        int broken = 0;
+        if(next == 0){
+            layout->free_blocks++;
+            run++;
+        }
+        else{
+            if(run > 0){
+                layoutFreeRun(layout, i - run, run);
+            }
+            run = 0;
+            if(next != FAT_EOC){
+                links++;
+                broken = next != i + 1;
+                breaks += broken;
+            }
+        }
+
+        if(cells == 0){
+            continue;
+        }
+        cellFree += next == 0;
+        cellBreak |= broken;
+        if(i + 1 == cellEnd){
+            uint32_t size = cellEnd - (uint64_t)cell * total / cells;
+            map[cell] = cellBreak ? LAYOUT_BREAK : (cellFree == size) ? LAYOUT_FREE
+                    : cellFree ? LAYOUT_MIXED : LAYOUT_USED;
+            cell++;
+            cellEnd = (uint64_t)(cell + 1) * total / cells;
+            cellFree = 0;
+            cellBreak = 0;
+        }
+    }
+    if(run > 0){
+        layoutFreeRun(layout, total - run, run);
+    }
+    layout->used_blocks = total - layout->free_blocks;
+    layout->score = links ? (double)breaks / links : 0;
+}
+
+//walk the chain of one entry
+static void layoutFile(const struct fs_dirent* ent, struct fs_layout_file* file){
+    uint32_t total = sBlock->dataBlockCount;
+    uint32_t block = ent->first_block;
+    uint32_t breaks = 0;
+
+    memset(file, 0, sizeof(*file));
+    memcpy(file->name, ent->name, FS_FILENAME_LEN);
+    file->size = ent->size;
+    file->is_dir = ent->is_dir;
+    //empty files of the reference tools have no block
+    if(block == FAT_EOC){
+        return;
+    }
+    //a damaged chain is cut short rather than followed forever
+    while(block != 0 && block < total && file->blocks < total){
+        uint32_t next = fatTable[block];
+        file->blocks++;
+        if(next == FAT_EOC){
+            break;
+        }
+        if(next != block + 1){
+            uint32_t gap = (next > block) ? next - block - 1 : block + 1 - next;
+            breaks++;
+            if(gap > file->largest_gap){
+                file->largest_gap = gap;
+            }
+        }
+        block = next;
+    }
+    if(file->blocks > 0){
+        file->extents = breaks + 1;
+        file->avg_run = (double)file->blocks / file->extents;
+    }
+}
+
+static int do_fs_layout(const char *path, struct fs_layout_report *layout,
+        struct fs_layout_file *files, int max, char *map, size_t map_len)
+{
+    struct fs_dirent ents[64];
+    uint64_t pos = 0;
+    int count = 0;
+    int n;
+
+    if(sBlock == NULL || layout == NULL || max < 0 || (max > 0 && files == NULL)){
+        return -1;
+    }
+    while((n = do_fs_readdir(path, &pos, ents, 64)) > 0){
+        for(int i = 0; i < n; i++, count++){
+            if(count < max){
+                layoutFile(&ents[i], &files[count]);
+            }
+        }
+    }
+    if(n == -1){
+        return -1;
+    }
+    layoutScan(layout, map, map_len);
+    return count;
+}
+
+//===========================================================================//
+//                           DEFRAGMENTATION                                 //
+//===========================================================================//
+
+// fs_defrag() packs every chain at the front of the data blocks, in order of
+// their first block, each one ascending and contiguous, so that free space
+// ends up as a single run at the end. Allocated blocks that belong to no
+// chain (the journal, leaked blocks) stay where they are and chains are laid
+// out around them. A chain is placed chunk by chunk: the blocks sitting where
+// the chunk goes are moved out to free blocks at the end of the disk, then
+// the chunk's blocks are moved in, in order.
+//
+// Moving a block copies it to a free block and links the copy instead of the
+// original. The original keeps its FAT entry and stays allocated until that
+// change is committed, so with the journal on, whatever a crash leaves on
+// disk is a set of valid chains, plus at worst some leaked blocks.
+// Subdirectory entries are written ahead of the FAT, so when the first block
+// of a chain listed in one moves, the entry is only pointed at the copy once
+// the FAT holding it is durable, and the blocks moved out of that chain are
+// held one commit longer. The pass can stop at any point and picks up from
+// there on the next call.
+
+//owner of free blocks, and of allocated blocks no chain owns
+#define DEFRAG_FREE 0xFFFFFFFF
+#define DEFRAG_FIXED 0xFFFFFFFE
+//owner of moved blocks that are not free yet
+#define DEFRAG_HELD 0xFFFFFFFD
+//blocks placed between two commits, at most
+#define DEFRAG_CHUNK 1024
+
+typedef struct {
+    entryLoc loc;
+    uint32_t start;
+    uint32_t length;
+    int dir;
+    //its entry waits for the next commit to name start
+    int pending;
+} defragChain;
+
+//a block moved out of a chain, freed by the first commit after which its
+//chain's entry no longer waits
+typedef struct {
+    uint32_t block;
+    uint32_t chain;
+} defragHold;
+
+typedef struct {
+    defragChain* chains;
+    uint32_t count;
+    uint32_t capacity;
+    //chain owning each data block, its predecessor in it (FAT_EOC for the
+    //first one) and its position
+    uint32_t* owner;
+    uint32_t* prev;
+    uint32_t* index;
+    defragHold* holds;
+    uint32_t holdCount;
+    //chains whose entry must point to their new first block after the next
+    //commit
+    uint32_t* pending;
+    uint32_t pendingCount;
+    //no free block above this one
+    uint32_t top;
+    char* buf;
+    //budget, 0 for none
+    uint64_t deadline;
+    size_t maxBlocks;
+    struct fs_defrag_report* report;
+} defragCtx;
+
+static uint64_t defragNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//fragmentation of the FAT: the share of links that don't go to the next
+//block, and the number of free runs
+static void defragScore(double* score, uint64_t* freeRuns){
+    struct fs_layout_report layout;
+
+    layoutScan(&layout, NULL, 0);
+    *score = layout.score;
+    *freeRuns = layout.free_runs;
+}
+
+static int defragAdd(defragCtx* ctx, const entryLoc* loc, const rootEntry* entry){
+    if(ctx->count == ctx->capacity){
+        uint32_t capacity = ctx->capacity ? ctx->capacity * 2 : 256;
+        defragChain* chains = realloc(ctx->chains, capacity * sizeof(defragChain));
+        if(chains == NULL){
+            return -1;
+        }
+        ctx->chains = chains;
+        ctx->capacity = capacity;
+    }
+    defragChain* c = &ctx->chains[ctx->count++];
+    c->loc = *loc;
+    c->start = entry->dataStartIndex;
+    c->length = 0;
+    c->dir = entryType(entry) == ENTRY_DIR;
+    c->pending = 0;
+    return 0;
+}
+
+//list every chain of the directory tree
+static int defragList(defragCtx* ctx){
+    if(load_rootDir() == -1){
+        return -1;
+    }
+    for(uint32_t i = 0; i < (uint32_t)rdir_capacity(); i++){
+        entryLoc loc = { DIR_ROOT, 0, i };
+        if(rootDir->entries[i].fileName[0] != '\0'
+                && defragAdd(ctx, &loc, &rootDir->entries[i]) == -1){
+            return -1;
+        }
+    }
+
+    //the list grows as directories are read
+    for(uint32_t d = 0; d < ctx->count; d++){
+        dirRef dir;
+        if(!ctx->chains[d].dir){
+            continue;
+        }
+        entryLoc self = ctx->chains[d].loc;
+        if(dirOpen(&self, &dir) == -1){
+            return -1;
+        }
+        for(uint32_t b = 0; b < dir.blocks; b++){
+            uint32_t block = dirBlockAt(&dir, b);
+            dirCacheSlot* slot = (block == FAT_EOC) ? NULL : dirBlockGet(block, 0);
+            if(slot == NULL){
+                return -1;
+            }
+            for(uint32_t i = (b == 0) ? 1 : 0; i < entriesPerBlock(); i++){
+                entryLoc loc = { dir.start, block, i };
+                if(slot->entries[i].fileName[0] != '\0'
+                        && defragAdd(ctx, &loc, &slot->entries[i]) == -1){
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+//record who owns every data block, refusing damaged chains
+static int defragMap(defragCtx* ctx){
+    for(uint32_t i = 1; i < sBlock->dataBlockCount; i++){
+        ctx->owner[i] = (fatTable[i] == 0) ? DEFRAG_FREE : DEFRAG_FIXED;
+    }
+    ctx->owner[0] = DEFRAG_FIXED;
+
+    for(uint32_t c = 0; c < ctx->count; c++){
+        uint32_t block = ctx->chains[c].start;
+        uint32_t prev = FAT_EOC;
+        //empty files of the reference tools have no block
+        if(block == FAT_EOC){
+            continue;
+        }
+        while(block != FAT_EOC){
+            //out of range, looping or shared: fs_check() is needed first
+            if(block == 0 || block >= sBlock->dataBlockCount
+                    || ctx->owner[block] != DEFRAG_FIXED){
+                return -1;
+            }
+            ctx->owner[block] = c;
+            ctx->prev[block] = prev;
+            ctx->index[block] = ctx->chains[c].length++;
+            prev = block;
+            block = fatTable[block];
+        }
+    }
+    return 0;
+}
+
+//commit what was moved so far: the copies first, then the metadata naming
+//them. Afterwards, blocks nothing on disk links to anymore are freed, and
+//entries waiting for it can name their new first block
+static int defragCommit(defragCtx* ctx){
+    if(block_disk_sync() == -1 || flushDirtyBlocks() == -1 || block_disk_sync() == -1){
+        return -1;
+    }
+
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < ctx->holdCount; i++){
+        defragHold* hold = &ctx->holds[i];
+        //the entry on disk may still lead to it
+        if(ctx->chains[hold->chain].pending){
+            ctx->holds[kept++] = *hold;
+            continue;
+        }
+        ctx->owner[hold->block] = DEFRAG_FREE;
+        freeBlock(hold->block);
+        if(hold->block > ctx->top){
+            ctx->top = hold->block;
+        }
+    }
+    ctx->holdCount = kept;
+
+    for(uint32_t i = 0; i < ctx->pendingCount; i++){
+        defragChain* c = &ctx->chains[ctx->pending[i]];
+        rootEntry* entry = entryAt(&c->loc);
+        if(entry == NULL){
+            return -1;
+        }
+        entry->dataStartIndex = c->start;
+        entryDirty(&c->loc);
+        c->pending = 0;
+    }
+    ctx->pendingCount = 0;
+    return 0;
+}
+
+//a directory block moved from a to b: point the caches and whatever refers
+//to it to the copy
+static int defragDirMoved(defragCtx* ctx, uint32_t a, uint32_t b, uint32_t oldStart){
+    if(dirCacheDrop(a) == -1){
+        return -1;
+    }
+    dirMapDrop(oldStart);
+    dentryFlush();
+    for(uint32_t c = 0; c < ctx->count; c++){
+        entryLoc* loc = &ctx->chains[c].loc;
+        if(loc->dir != DIR_ROOT && loc->block == a){
+            loc->block = b;
+        }
+        if(loc->dir == a){
+            loc->dir = b;
+        }
+    }
+    for(int i = 0; i < fdCapacity; i++){
+        entryLoc* loc = &fileDes[i].loc;
+        if(fileDes[i].fileName[0] == '\0'){
+            continue;
+        }
+        if(loc->dir != DIR_ROOT && loc->block == a){
+            loc->block = b;
+        }
+        if(loc->dir == a){
+            loc->dir = b;
+        }
+    }
+    return 0;
+}
+
+//copy block a to free block b and link the copy in its place
+static int defragMove(defragCtx* ctx, uint32_t a, uint32_t b){
+    uint32_t c = ctx->owner[a];
+    defragChain* chain = &ctx->chains[c];
+    uint32_t prev = ctx->prev[a];
+    uint32_t next = fatTable[a];
+
+    //a directory block may be newer in the cache or in the journal than on
+    //disk; the copy is new, nothing on disk names it yet
+    dirCacheSlot* slot = chain->dir ? dirCacheFind(a) : NULL;
+    if(slot != NULL){
+        encode_entries(slot->entries, ctx->buf);
+    }
+    else if(chain->dir ? dirBlockRead(a, ctx->buf) == -1
+            : block_read(sBlock->dataStartIndex + a, ctx->buf) == -1){
+        return -1;
+    }
+    if(block_write(sBlock->dataStartIndex + b, ctx->buf) == -1){
+        return -1;
+    }
+
+    fatTable[b] = next;
+    fatFree--;
+    markFatDirty(b);
+    if(next != FAT_EOC){
+        ctx->prev[next] = b;
+    }
+    ctx->owner[b] = c;
+    ctx->prev[b] = prev;
+    ctx->index[b] = ctx->index[a];
+    ctx->owner[a] = DEFRAG_HELD;
+
+    uint32_t oldStart = chain->start;
+    if(prev != FAT_EOC){
+        fatTable[prev] = b;
+        markFatDirty(prev);
+    }
+    else if(chain->loc.dir == DIR_ROOT){
+        //the root directory is committed along with the FAT, or after it
+        chain->start = b;
+        rootDir->entries[chain->loc.slot].dataStartIndex = b;
+        markEntryDirty(&rootDir->entries[chain->loc.slot]);
+    }
+    else{
+        chain->start = b;
+        if(!chain->pending){
+            chain->pending = 1;
+            ctx->pending[ctx->pendingCount++] = c;
+        }
+    }
+    ctx->holds[ctx->holdCount++] = (defragHold){ a, c };
+
+    if(chain->dir && defragDirMoved(ctx, a, b, oldStart) == -1){
+        return -1;
+    }
+    FS_PROBE2(defrag_move, a, b);
+    ctx->report->blocks_moved++;
+    return 0;
+}
+
+static int defragOverBudget(const defragCtx* ctx){
+    return (ctx->maxBlocks && ctx->report->blocks_moved >= ctx->maxBlocks)
+            || (ctx->deadline && defragNow() >= ctx->deadline);
+}
+
+//find a free block past limit, from the end of the disk down
+static uint32_t defragFreeAbove(defragCtx* ctx, uint32_t limit){
+    while(ctx->top > limit && ctx->owner[ctx->top] != DEFRAG_FREE){
+        ctx->top--;
+    }
+    return (ctx->top > limit) ? ctx->top : FAT_EOC;
+}
+
+//place blocks [k0, k0 + n) of chain c at pos + k0 onwards
+//returns 1 when out of budget, 2 when out of room, -1 on error
+static int defragChunk(defragCtx* ctx, uint32_t c, uint32_t pos, uint32_t k0, uint32_t n){
+    uint32_t lo = pos + k0;
+    uint32_t hi = lo + n;
+
+    //clear the way, then wait for what was moved out to be free
+    for(uint32_t p = lo; p < hi; p++){
+        uint32_t owner = ctx->owner[p];
+        if(owner == DEFRAG_FREE || owner == DEFRAG_HELD
+                || (owner == c && ctx->index[p] == p - pos)){
+            continue;
+        }
+        if(defragOverBudget(ctx)){
+            return 1;
+        }
+        uint32_t to = defragFreeAbove(ctx, hi - 1);
+        if(to == FAT_EOC){
+            return 2;
+        }
+        if(defragMove(ctx, p, to) == -1){
+            return -1;
+        }
+    }
+    for(int tries = 0; tries < 2; tries++){
+        int held = 0;
+        for(uint32_t p = lo; p < hi && !held; p++){
+            held = ctx->owner[p] == DEFRAG_HELD;
+        }
+        if(held && defragCommit(ctx) == -1){
+            return -1;
+        }
+    }
+
+    //bring the chunk in, following the chain from the part already placed
+    for(uint32_t k = k0; k < k0 + n; k++){
+        uint32_t block = (k == 0) ? ctx->chains[c].start : fatTable[pos + k - 1];
+        if(block == pos + k){
+            continue;
+        }
+        if(defragOverBudget(ctx)){
+            return 1;
+        }
+        if(defragMove(ctx, block, pos + k) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int cmpKey(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+//lay the chains out one after the other, in order of their first block
+//returns 0 once done, 1 when out of budget, 2 when out of room, -1 on error
+static int defragPack(defragCtx* ctx){
+    //first block in the high bits, chain in the low ones
+    uint64_t* order = malloc((ctx->count + 1) * sizeof(uint64_t));
+    uint32_t pos = 1;
+    int ret = 0;
+
+    if(order == NULL){
+        return -1;
+    }
+    for(uint32_t c = 0; c < ctx->count; c++){
+        order[c] = (uint64_t)ctx->chains[c].start << 32 | c;
+    }
+    qsort(order, ctx->count, sizeof(uint64_t), cmpKey);
+
+    for(uint32_t i = 0; ret == 0 && i < ctx->count; i++){
+        uint32_t c = (uint32_t)order[i];
+        uint32_t length = ctx->chains[c].length;
+        if(length == 0){
+            continue;
+        }
+
+        //the chain goes in the first gap between fixed blocks that fits it
+        uint32_t p = pos;
+        while(p < pos + length && pos + length <= sBlock->dataBlockCount){
+            if(ctx->owner[p] == DEFRAG_FIXED){
+                pos = p + 1;
+            }
+            p++;
+        }
+        if(pos + length > sBlock->dataBlockCount){
+            ret = 2;
+            break;
+        }
+
+        for(uint32_t k = 0; ret == 0 && k < length; k += DEFRAG_CHUNK){
+            uint32_t n = (length - k < DEFRAG_CHUNK) ? length - k : DEFRAG_CHUNK;
+            ret = defragChunk(ctx, c, pos, k, n);
+        }
+        pos += length;
+    }
+    free(order);
+    return ret;
+}
+
+static int do_fs_defrag(const struct fs_defrag_opts *opts,
+        struct fs_defrag_report *report)
+{
+    defragCtx ctx;
+    int ret = -1;
+
+    //moving a shared block would take relinking every chain sharing it
+    if(sBlock == NULL || report == NULL || fatShared()){
+        return -1;
+    }
+    memset(report, 0, sizeof(*report));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.report = report;
+    if(opts != NULL){
+        ctx.deadline = opts->time_ms ? defragNow() + opts->time_ms * 1000000ull : 0;
+        ctx.maxBlocks = opts->max_blocks;
+    }
+    defragScore(&report->score_before, &report->free_runs_before);
+
+    uint32_t n = sBlock->dataBlockCount;
+    ctx.owner = malloc(n * sizeof(uint32_t));
+    ctx.prev = malloc(n * sizeof(uint32_t));
+    ctx.index = malloc(n * sizeof(uint32_t));
+    ctx.holds = malloc(n * sizeof(defragHold));
+    ctx.buf = allocBlockBuf();
+    ctx.top = n - 1;
+    if(ctx.owner != NULL && ctx.prev != NULL && ctx.index != NULL && ctx.holds != NULL
+            && ctx.buf != NULL && defragList(&ctx) == 0
+            && (ctx.pending = malloc((ctx.count + 1) * sizeof(uint32_t))) != NULL
+            && defragMap(&ctx) == 0){
+        ret = defragPack(&ctx);
+    }
+
+    //leave nothing half done: every entry names its chain's first block and
+    //every moved block is free
+    while(ret != -1 && (ctx.holdCount > 0 || ctx.pendingCount > 0)){
+        if(defragCommit(&ctx) == -1){
+            ret = -1;
+        }
+    }
+    if(ret != -1 && report->blocks_moved > 0 && defragCommit(&ctx) == -1){
+        ret = -1;
+    }
+    //out of room, the layout is as packed as it gets
+    if(ret == 2){
+        ret = 0;
+    }
+    defragScore(&report->score_after, &report->free_runs_after);
+
+    free(ctx.chains);
+    free(ctx.owner);
+    free(ctx.prev);
+    free(ctx.index);
+    free(ctx.holds);
+    free(ctx.pending);
+    freeBlockBuf(ctx.buf);
+    return ret;
+}
+
+//===========================================================================//
+//                           EXPORT / IMPORT                                 //
+//===========================================================================//
+
+// An exported image is a header followed by extents: runs of blocks, each
+// with its position and a checksum, ending with an empty extent. The first
+// extent holds the superblock, the FAT and the root directory, the others the
+// allocated data blocks in disk order. Free blocks are left out, and so are
+// blocks of zeroes, such as the unused part of the FAT: they come back as
+// holes of the sparse imported image.
+
+#define EXPORT_MAGIC "ECSIMG01"
+//blocks per extent, and per read or write
+#define EXPORT_CHUNK 256
+
+typedef struct {
+    char magic[8];
+    uint32_t blockSize;
+    uint32_t reserved;
+    uint64_t numBlocks;
+} __attribute__((packed)) exportHeader;
+
+typedef struct {
+    uint64_t start;
+    uint32_t count;
+    uint32_t checksum;
+} __attribute__((packed)) exportExtent;
+
+static int writeAll(int fd, const void* buf, size_t len){
+    const char* p = buf;
+    while(len > 0){
+        ssize_t n = write(fd, p, len);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//-1 on error or if the stream ends early
+static int readAll(int fd, void* buf, size_t len){
+    char* p = buf;
+    while(len > 0){
+        ssize_t n = read(fd, p, len);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int blockIsZero(const char* block){
+    return block[0] == 0 && memcmp(block, block + 1, blockSize - 1) == 0;
+}
+
+//stream blocks [start, start + count) as extents of at most EXPORT_CHUNK,
+//leaving out blocks of zeroes
+static int exportRun(int fd, uint32_t start, uint32_t count, char* buf){
+    while(count > 0){
+        uint32_t n = (count < EXPORT_CHUNK) ? count : EXPORT_CHUNK;
+        struct iovec iov = { buf, n * blockSize };
+        if(block_readv(start, n, &iov, 1) == -1){
+            return -1;
+        }
+        for(uint32_t i = 0; i < n; ){
+            uint32_t j = i;
+            while(j < n && !blockIsZero(buf + (size_t)j * blockSize)){
+                j++;
+            }
+            if(j > i){
+                char* data = buf + (size_t)i * blockSize;
+                size_t len = (size_t)(j - i) * blockSize;
+                exportExtent ext = { start + i, j - i, journal_checksum(2166136261u, data, len) };
+                if(writeAll(fd, &ext, sizeof(ext)) == -1 || writeAll(fd, data, len) == -1){
+                    return -1;
+                }
+            }
+            i = j + 1;
+        }
+        start += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static int do_fs_export(int fd){
+    exportHeader header;
+    exportExtent end;
+    uint32_t run = 0;
+
+    if(sBlock == NULL || fd < 0){
+        return -1;
+    }
+    //put the current metadata in place, so the disk holds all of it
+    if(flushDirtyBlocks() == -1 || (journalBlocks > 0 && journal_checkpoint() == -1)){
+        return -1;
+    }
+
+    char* buf = pool_get((size_t)EXPORT_CHUNK * blockSize);
+    if(buf == NULL){
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXPORT_MAGIC, 8);
+    header.blockSize = blockSize;
+    header.numBlocks = sBlock->numBlocks;
+    int ret = writeAll(fd, &header, sizeof(header));
+    if(ret == 0){
+        ret = exportRun(fd, 0, sBlock->dataStartIndex, buf);
+    }
+
+    //data block 0 is reserved and never holds anything
+    for(uint32_t i = 1; ret == 0 && i <= sBlock->dataBlockCount; i++){
+        if(i < sBlock->dataBlockCount && fatTable[i] != 0){
+            run++;
+            continue;
+        }
+        if(run > 0){
+            ret = exportRun(fd, sBlock->dataStartIndex + i - run, run, buf);
+        }
+        run = 0;
+    }
+
+    memset(&end, 0, sizeof(end));
+    if(ret == 0){
+        ret = writeAll(fd, &end, sizeof(end));
+    }
+    pool_put(buf);
+    return ret;
+}
+
+//write the extents of the stream to the open disk
+static int importExtents(int fd, uint64_t numBlocks){
+    exportExtent ext;
+    char* buf = pool_get((size_t)EXPORT_CHUNK * blockSize);
+    int ret = (buf == NULL) ? -1 : 0;
+
+    while(ret == 0){
+        if(readAll(fd, &ext, sizeof(ext)) == -1){
+            ret = -1;
+            break;
+        }
+        if(ext.count == 0){
+            break;
+        }
+        if(ext.count > EXPORT_CHUNK || ext.start > numBlocks
+                || ext.count > numBlocks - ext.start){
+            ret = -1;
+            break;
+        }
+        struct iovec iov = { buf, ext.count * blockSize };
+        if(readAll(fd, buf, ext.count * blockSize) == -1
+                || journal_checksum(2166136261u, buf, ext.count * blockSize) != ext.checksum
+                || block_writev(ext.start, ext.count, &iov, 1) == -1){
+            ret = -1;
+        }
+    }
+    pool_put(buf);
+    return ret;
+}
+
+static int do_fs_import(int fd, const char *diskname, int flags){
+    exportHeader header;
+
+    if(sBlock != NULL || fd < 0 || diskname == NULL
+            || readAll(fd, &header, sizeof(header)) == -1
+            || memcmp(header.magic, EXPORT_MAGIC, 8) != 0
+            || header.numBlocks == 0 || header.numBlocks >= FAT_EOC_V2){
+        return -1;
+    }
+    if(block_disk_create_sized(diskname, header.numBlocks, header.blockSize) == -1
+            || block_disk_open(diskname) == -1){
+        return -1;
+    }
+    if(block_disk_set_size(header.blockSize) == -1){
+        block_disk_close();
+        return -1;
+    }
+    blockSize = header.blockSize;
+    int ret = importExtents(fd, header.numBlocks);
+    if(ret == 0){
+        ret = block_disk_sync();
+    }
+    blockSize = BLOCK_SIZE;
+    block_disk_close();
+
+    if(ret == 0 && (flags & FS_IMPORT_DEFRAG)){
+        struct fs_defrag_report report;
+        if(do_fs_mount(diskname) == -1){
+            return -1;
+        }
+        //images sharing blocks are imported as they are
+        ret = fatShared() ? 0 : do_fs_defrag(NULL, &report);
+        if(do_fs_umount() == -1){
+            ret = -1;
+        }
+    }
+    return ret;
 }
 
-int rdir_count(void)
+//===========================================================================//
+//                             FORMATTING                                    //
+//===========================================================================//
+
+static size_t do_fs_format_max_blocks(const struct fs_format_opts *opts)
 {
-    rootDirectory* rBlock = getRootDirectory();
+	size_t block_size = (opts && opts->block_size) ? opts->block_size : BLOCK_SIZE;
+	size_t dir_entries = (opts && opts->dir_entries) ? opts->dir_entries
+		: FS_FILE_MAX_COUNT;
+	int flags = opts ? opts->flags : 0;
+
+	if(block_size < BLOCK_SIZE || block_size > BLOCK_SIZE_MAX
+			|| (block_size & (block_size - 1)) != 0){
+		return 0;
+	}
+
+	//same geometry as fs_format()
+	size_t dirPerBlock = block_size / sizeof(rootEntryV1);
+	size_t dirBlocks = (dir_entries + dirPerBlock - 1) / dirPerBlock;
+	int wide = (flags & FS_FORMAT_WIDE) != 0 || block_size != BLOCK_SIZE
+		|| dirBlocks > 1;
+	size_t perBlock = wide ? FAT_PER_BLOCK_V2(block_size)
+		: FAT_PER_BLOCK_V1(block_size);
+	size_t limit = wide ? FAT_EOC_V2 : FAT_EOC_V1;
+
+	if(limit <= 2 + dirBlocks){
+		return 0;
+	}
+	size_t data = limit - 2 - dirBlocks;
+	if(!wide && data > UINT8_MAX * perBlock){
+		data = UINT8_MAX * perBlock;
+	}
+	//every data block also takes a share of a FAT block
+	while(data > 0){
+		size_t total = 1 + (data + perBlock - 1) / perBlock + dirBlocks + data;
+		if(total < limit){
+			break;
+		}
+		data -= (total - limit + 1 < data) ? total - limit + 1 : data;
+	}
+	return data;
+}
+
+static int do_fs_format(const char *diskname, size_t data_blocks,
+		const struct fs_format_opts *opts)
+{
+	size_t block_size = (opts && opts->block_size) ? opts->block_size : BLOCK_SIZE;
+	size_t dir_entries = (opts && opts->dir_entries) ? opts->dir_entries
+		: FS_FILE_MAX_COUNT;
+	int flags = opts ? opts->flags : 0;
+	char* block;
+
+	if(diskname == NULL || data_blocks < 1 || block_size < BLOCK_SIZE
+			|| block_size > BLOCK_SIZE_MAX
+			|| (block_size & (block_size - 1)) != 0){
+		return -1;
+	}
+
+	size_t dirPerBlock = block_size / sizeof(rootEntryV1);
+	size_t dirBlocks = (dir_entries + dirPerBlock - 1) / dirPerBlock;
+	//only the wide superblock records a block size and a directory range
+	int wide = (flags & FS_FORMAT_WIDE) != 0 || block_size != BLOCK_SIZE
+		|| dirBlocks > 1;
+	size_t perBlock = wide ? FAT_PER_BLOCK_V2(block_size)
+		: FAT_PER_BLOCK_V1(block_size);
+
+	size_t fatBlocks = (data_blocks + perBlock - 1) / perBlock;
+	size_t total = 1 + fatBlocks + dirBlocks + data_blocks;
+
+	//block numbers must fit the on-disk fields and stay clear of FAT_EOC
+	if(!wide && (total >= FAT_EOC_V1 || fatBlocks > UINT8_MAX)){
+		return -1;
+	}
+	if(wide && total >= FAT_EOC_V2){
+		return -1;
+	}
+
+	//the block layer handles a single disk at a time
+	pthread_mutex_lock(&fsLock);
+	if(sBlock != NULL
+			|| block_disk_create_sized(diskname, total, block_size) == -1
+			|| block_disk_open(diskname) == -1){
+		pthread_mutex_unlock(&fsLock);
+		return -1;
+	}
+	block = pool_get(block_size);
+	if(block == NULL || block_disk_set_size(block_size) == -1){
+		pool_put(block);
+		block_disk_close();
+		pthread_mutex_unlock(&fsLock);
+		return -1;
+	}
+
+	if(wide){
+		superblockV2* disk = (superblockV2*)block;
+		memcpy(disk->signature, SIGNATURE_V2, 8);
+		disk->numBlocks = total;
+		disk->rootIndex = fatBlocks + 1;
+		disk->dataStartIndex = fatBlocks + 1 + dirBlocks;
+		disk->dataBlockCount = data_blocks;
+		disk->fatBlockCount = fatBlocks;
+		disk->blockSize = block_size;
+		disk->rootBlockCount = dirBlocks;
+	}
+	else{
+		superblockV1* disk = (superblockV1*)block;
+		memcpy(disk->signature, SIGNATURE_V1, 8);
+		disk->numBlocks = total;
+		disk->rootIndex = fatBlocks + 1;
+		disk->dataStartIndex = fatBlocks + 2;
+		disk->dataBlockCount = data_blocks;
+		disk->fatBlockCount = fatBlocks;
+	}
+	int ret = block_write(0, block);
+
+	//entry 0 of the FAT is reserved, every other entry and the root directory
+	//start out zeroed, which the freshly created disk file already is
+	memset(block, 0, block_size);
+	if(wide){
+		((uint32_t*)block)[0] = FAT_EOC_V2;
+	}
+	else{
+		((uint16_t*)block)[0] = FAT_EOC_V1;
+	}
+	if(ret == 0){
+		ret = block_write(1, block);
+	}
+	if(ret == 0){
+		ret = block_disk_sync();
+	}
+
+	pool_put(block);
+	block_disk_close();
+	pthread_mutex_unlock(&fsLock);
+	return ret;
+}
+
+//===========================================================================//
+//                           CONSISTENCY CHECK                               //
+//===========================================================================//
+
+// fs_check() works on an unmounted image, with the same in-memory superblock
+// and FAT as a mount. It first lists the chains that should exist: the
+// journal's, and those of every entry reachable from the root directory,
+// reading subdirectories level by level. The chains are then walked in
+// parallel, each walk claiming the blocks it visits in an owner map with a
+// compare-and-swap: finding a block already claimed means a cycle (claimed by
+// the same chain) or a cross-link (claimed by another one). Chains caught in a
+// cross-link are walked again one at a time, directories first, so that who
+// keeps the shared blocks doesn't depend on thread timing. Allocated blocks
+// left without an owner are leaked. On a file system with FEATURE_SHARED, a
+// file's chain running into another file's past its first block is sharing
+// its tail rather than cross-linked.
+
+//outcome of a chain walk
+#define CHAIN_OK 0
+//no block at all, how the reference tools store empty files
+#define CHAIN_EMPTY 1
+#define CHAIN_BAD_START 2
+#define CHAIN_BAD_LINK 3
+#define CHAIN_CYCLE 4
+#define CHAIN_CROSSED 5
+
+//owner of the blocks of the journal
+#define CHECK_JOURNAL 0xFFFFFFFF
+//chains handed out to a walker at a time
+#define CHECK_BATCH 64
+
+//FAT entries compared at once, as a 128-bit vector
+typedef uint32_t fatVec __attribute__((vector_size(16)));
+typedef int32_t fatMask __attribute__((vector_size(16)));
+#define FAT_VEC_LANES (sizeof(fatVec) / sizeof(uint32_t))
+
+typedef struct {
+    rootEntry entry;
+    entryLoc loc;
+    //chain of the directory holding the entry, -1 for the root directory
+    int parent;
+    int state;
+    //blocks claimed by the walk, and the last one to keep when cutting it
+    uint32_t length;
+    uint32_t last;
+    //block where the chain joined the tail of another file's, 0 if none
+    uint32_t merge;
+    //set when another chain ran into one of its blocks
+    int conflict;
+    //entry dropped, along with whatever lies below it
+    int dropped;
+    //directories: read in full, live entries and tombstones found in them,
+    //and how many of those live entries the repair drops
+    int complete;
+    uint32_t live;
+    uint32_t dead;
+    uint32_t lost;
+} checkChain;
+
+//what a thread counted over its slice of the FAT
+typedef struct {
+    uint64_t bad;
+    uint64_t free;
+    uint64_t leaked;
+} checkShare;
+
+typedef struct {
+    checkChain* chains;
+    uint32_t count;
+    uint32_t capacity;
+    //index + 1 of the chain owning each data block, 0 if none
+    uint32_t* owner;
+    //data blocks already read as part of a directory
+    uint8_t* dirRead;
+    //FAT blocks changed by the repair
+    uint8_t* fatDirty;
+    unsigned int threads;
+    checkShare shares[FS_CHECK_THREADS_MAX];
+    //next chain to hand out to a walker
+    uint32_t next;
+    //a directory that stays could not be read in full, so leaks can't be
+    //trusted
+    int incomplete;
+    //the journal is where the superblock says
+    int journal;
+    int flags;
+    struct fs_check_report* report;
+} checkCtx;
+
+typedef void (*checkFn)(checkCtx* ctx, unsigned int t);
+
+typedef struct {
+    checkCtx* ctx;
+    checkFn fn;
+    unsigned int t;
+} checkWorker;
+
+//print what is wrong, after the path of chain id unless it is -1
+static void checkSay(const checkCtx* ctx, int id, const char* fmt, ...){
+    int path[PATH_DEPTH_MAX];
+    int depth = 0;
+
+    if(!(ctx->flags & FS_CHECK_VERBOSE)){
+        return;
+    }
+    if(id >= 0){
+        for(; id >= 0 && depth < PATH_DEPTH_MAX; id = ctx->chains[id].parent){
+            path[depth++] = id;
+        }
+        if(id >= 0){
+            printf("...");
+        }
+        while(depth > 0){
+            printf("/%.16s", ctx->chains[path[--depth]].entry.fileName);
+        }
+        printf(": ");
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+}
+
+static void* checkRun(void* arg){
+    checkWorker* w = arg;
+    w->fn(w->ctx, w->t);
+    return NULL;
+}
+
+//run fn for every thread share, the calling thread taking share 0
+static void checkParallel(checkCtx* ctx, checkFn fn){
+    pthread_t tids[FS_CHECK_THREADS_MAX];
+    checkWorker workers[FS_CHECK_THREADS_MAX];
+    unsigned int started = 1;
+
+    for(; started < ctx->threads; started++){
+        workers[started] = (checkWorker){ ctx, fn, started };
+        if(pthread_create(&tids[started], NULL, checkRun, &workers[started]) != 0){
+            break;
+        }
+    }
+    fn(ctx, 0);
+    for(unsigned int t = 1; t < started; t++){
+        pthread_join(tids[t], NULL);
+    }
+    //shares whose thread couldn't be started
+    for(unsigned int t = started; t < ctx->threads; t++){
+        fn(ctx, t);
+    }
+}
+
+//get the data blocks [lo, hi) of the FAT that share t covers, entry 0 aside
+static void checkSlice(const checkCtx* ctx, unsigned int t, uint32_t* lo, uint32_t* hi){
+    uint32_t n = sBlock->dataBlockCount - 1;
+    uint32_t per = (n / ctx->threads + FAT_VEC_LANES) & ~(FAT_VEC_LANES - 1);
+
+    *lo = 1 + (uint64_t)per * t < sBlock->dataBlockCount ? 1 + per * t
+            : sBlock->dataBlockCount;
+    *hi = (uint64_t)*lo + per < sBlock->dataBlockCount ? *lo + per
+            : sBlock->dataBlockCount;
+}
+
+//count the FAT entries of a share that are free, and those that are neither
+//free, nor the end of a chain, nor a data block
+static void checkScanFat(checkCtx* ctx, unsigned int t){
+    const uint32_t limit = sBlock->dataBlockCount;
+    fatMask badLanes = { 0 };
+    fatMask freeLanes = { 0 };
+    uint32_t lo, hi;
+
+    checkSlice(ctx, t, &lo, &hi);
+    uint32_t i = lo;
+    for(; i + FAT_VEC_LANES <= hi; i += FAT_VEC_LANES){
+        fatVec v;
+        memcpy(&v, &fatTable[i], sizeof(v));
+        fatMask zero = (v == 0);
+        //comparisons give -1 in the lanes where they hold
+        badLanes -= ~zero & (v != FAT_EOC) & (v >= limit);
+        freeLanes -= zero;
+    }
+
+    checkShare* share = &ctx->shares[t];
+    share->bad = 0;
+    share->free = 0;
+    for(unsigned int l = 0; l < FAT_VEC_LANES; l++){
+        share->bad += (uint32_t)badLanes[l];
+        share->free += (uint32_t)freeLanes[l];
+    }
+    for(; i < hi; i++){
+        share->free += fatTable[i] == 0;
+        share->bad += fatTable[i] != 0 && fatTable[i] != FAT_EOC && fatTable[i] >= limit;
+    }
+}
+
+//find the allocated blocks of a share that no chain owns, freeing them when
+//repairing
+static void checkScanLeaks(checkCtx* ctx, unsigned int t){
+    int repair = (ctx->flags & FS_CHECK_REPAIR) && !ctx->incomplete;
+    checkShare* share = &ctx->shares[t];
+    uint32_t lo, hi;
+
+    checkSlice(ctx, t, &lo, &hi);
+    share->leaked = 0;
+    share->free = 0;
+    for(uint32_t i = lo; i < hi; i++){
+        uint32_t owner = ctx->owner[i];
+        if(fatTable[i] != 0 && (owner == 0 || (owner != CHECK_JOURNAL
+                && ctx->chains[owner - 1].dropped))){
+            share->leaked++;
+            if(repair){
+                fatTable[i] = 0;
+                __atomic_store_n(&ctx->fatDirty[fatBlockOf(i)], 1, __ATOMIC_RELAXED);
+            }
+        }
+        share->free += fatTable[i] == 0;
+    }
+}
+
+//an entry's first block, when it has none: how the reference tools store an
+//empty file (0xFFFF on disk in the legacy format, decoded to FAT_EOC)
+static int checkNoBlock(uint32_t start){
+    return start == FAT_EOC;
+}
+
+//whether chain c, running into block of the chain seen owns after block prev,
+//shares that chain's tail
+static int checkShares(const checkCtx* ctx, const checkChain* c, uint32_t seen,
+        uint32_t block, uint32_t prev){
+    if(!(sBlock->features & FEATURE_SHARED) || prev == FAT_EOC || seen == CHECK_JOURNAL){
+        return 0;
+    }
+    const checkChain* other = &ctx->chains[seen - 1];
+    return entryType(&c->entry) != ENTRY_DIR && entryType(&other->entry) != ENTRY_DIR
+            && other->entry.dataStartIndex != block;
+}
+
+//walk chain id, claiming its blocks until its end or a block already claimed
+static void checkWalk(checkCtx* ctx, uint32_t id){
+    checkChain* c = &ctx->chains[id];
+    uint32_t block = c->entry.dataStartIndex;
+    uint32_t prev = FAT_EOC;
+
+    c->length = 0;
+    c->last = FAT_EOC;
+    c->merge = 0;
+    //any other first block has to be a data block of the FAT
+    if(checkNoBlock(block)){
+        c->state = CHAIN_EMPTY;
+        return;
+    }
+    if(!chainBlock(block)){
+        c->state = CHAIN_BAD_START;
+        return;
+    }
+    while(1){
+        uint32_t seen = 0;
+        if(!__atomic_compare_exchange_n(&ctx->owner[block], &seen, id + 1, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            if(seen == id + 1){
+                c->state = CHAIN_CYCLE;
+            }
+            else if(checkShares(ctx, c, seen, block, prev)){
+                c->state = CHAIN_OK;
+                c->merge = block;
+            }
+            else{
+                c->state = CHAIN_CROSSED;
+                __atomic_store_n(&c->conflict, 1, __ATOMIC_RELAXED);
+                if(seen != CHECK_JOURNAL){
+                    __atomic_store_n(&ctx->chains[seen - 1].conflict, 1, __ATOMIC_RELAXED);
+                }
+            }
+            c->last = prev;
+            return;
+        }
+        c->length++;
+
+        uint32_t next = fatTable[block];
+        if(next == FAT_EOC || next == 0 || next >= sBlock->dataBlockCount){
+            c->state = (next == FAT_EOC) ? CHAIN_OK : CHAIN_BAD_LINK;
+            c->last = block;
+            return;
+        }
+        prev = block;
+        block = next;
+    }
+}
+
+static void checkWalkShare(checkCtx* ctx, unsigned int t){
+    (void)t;
+    while(1){
+        uint32_t first = __atomic_fetch_add(&ctx->next, CHECK_BATCH, __ATOMIC_RELAXED);
+        if(first >= ctx->count){
+            return;
+        }
+        for(uint32_t id = first; id < first + CHECK_BATCH && id < ctx->count; id++){
+            checkWalk(ctx, id);
+        }
+    }
+}
+
+//walk again, one at a time, every chain caught in a cross-link: directories
+//first, then in the order they were found
+static void checkRewalk(checkCtx* ctx){
+    for(uint32_t i = 1; i < sBlock->dataBlockCount; i++){
+        uint32_t owner = ctx->owner[i];
+        if(owner != 0 && owner != CHECK_JOURNAL && ctx->chains[owner - 1].conflict){
+            ctx->owner[i] = 0;
+        }
+    }
+    for(int pass = 0; pass < 2; pass++){
+        for(uint32_t id = 0; id < ctx->count; id++){
+            checkChain* c = &ctx->chains[id];
+            if(c->conflict && (entryType(&c->entry) == ENTRY_DIR) == (pass == 0)){
+                checkWalk(ctx, id);
+            }
+        }
+    }
+}
+
+//follow the tails chains share with others: count their blocks, or once the
+//chains are judged claim those held by a dropped chain
+static void checkMerges(checkCtx* ctx, int claim){
+    for(uint32_t id = 0; id < ctx->count; id++){
+        checkChain* c = &ctx->chains[id];
+        if(c->merge == 0 || c->dropped){
+            continue;
+        }
+        uint32_t block = c->merge;
+        for(uint32_t n = 0; n < sBlock->dataBlockCount && block != 0
+                && block < sBlock->dataBlockCount; n++){
+            uint32_t owner = ctx->owner[block];
+            if(!claim){
+                c->length++;
+            }
+            else if(owner != 0 && owner != CHECK_JOURNAL && ctx->chains[owner - 1].dropped){
+                ctx->owner[block] = id + 1;
+            }
+            block = fatTable[block];
+        }
+    }
+}
+
+static int checkAdd(checkCtx* ctx, const rootEntry* entry, const entryLoc* loc, int parent){
+    if(ctx->count == ctx->capacity){
+        uint32_t capacity = ctx->capacity ? ctx->capacity * 2 : 1024;
+        checkChain* chains = realloc(ctx->chains, capacity * sizeof(checkChain));
+        if(chains == NULL){
+            return -1;
+        }
+        ctx->chains = chains;
+        ctx->capacity = capacity;
+    }
+    checkChain* c = &ctx->chains[ctx->count++];
+    memset(c, 0, sizeof(checkChain));
+    c->entry = *entry;
+    c->loc = *loc;
+    c->parent = parent;
+    return 0;
+}
+
+//read the blocks of subdirectory d, listing its live entries
+static int checkReadDir(checkCtx* ctx, uint32_t d, char* block){
+    rootEntry entry = ctx->chains[d].entry;
+    uint32_t blocks = entry.fileSize / blockSize;
+    uint32_t b = entry.dataStartIndex;
+    uint32_t live = 0;
+    uint32_t dead = 0;
+
+    for(uint32_t k = 0; k < blocks; k++){
+        //stop at a broken link, or at a block some directory already holds
+        if(b == 0 || b >= sBlock->dataBlockCount
+                || (ctx->dirRead[b / 8] & (1 << (b % 8)))){
+            return 0;
+        }
+        ctx->dirRead[b / 8] |= 1 << (b % 8);
+        if(block_read(sBlock->dataStartIndex + b, block) == -1){
+            return -1;
+        }
+
+        for(uint32_t i = 0; i < entriesPerBlock(); i++){
+            rootEntry child;
+            decode_rootEntry(block, i, &child);
+            if(k == 0 && i == 0){
+                if(strcmp(child.fileName, ".") != 0 || entryType(&child) != ENTRY_DIR){
+                    checkSay(ctx, d, "damaged directory header");
+                    ctx->report->dir_errors++;
+                    return 0;
+                }
+                continue;
+            }
+            if(child.fileName[0] == '\0'){
+                dead += entryType(&child) == ENTRY_TOMBSTONE;
+                continue;
+            }
+            entryLoc loc = { entry.dataStartIndex, b, i };
+            if(checkAdd(ctx, &child, &loc, d) == -1){
+                return -1;
+            }
+            live++;
+        }
+        b = fatTable[b];
+    }
+    ctx->chains[d].complete = 1;
+    ctx->chains[d].live = live;
+    ctx->chains[d].dead = dead;
+    return 0;
+}
+
+//list the entries of the root directory, then of the subdirectories they
+//lead to, level by level
+static int checkScanDirs(checkCtx* ctx, char* block){
+    uint32_t perBlock = entriesPerBlock();
+
+    for(uint32_t b = 0; b < sBlock->rootBlockCount; b++){
+        if(block_read(sBlock->rootIndex + b, block) == -1){
+            return -1;
+        }
+        for(uint32_t i = 0; i < perBlock; i++){
+            rootEntry entry;
+            decode_rootEntry(block, i, &entry);
+            entryLoc loc = { DIR_ROOT, 0, b * perBlock + i };
+            if(entry.fileName[0] != '\0' && checkAdd(ctx, &entry, &loc, -1) == -1){
+                return -1;
+            }
+        }
+    }
+
+    //the list grows as directories are read
+    for(uint32_t d = 0; d < ctx->count; d++){
+        rootEntry* entry = &ctx->chains[d].entry;
+        if(entryType(entry) != ENTRY_DIR){
+            continue;
+        }
+        uint32_t blocks = entry->fileSize / blockSize;
+        if(entry->fileSize % blockSize != 0 || blocks == 0 || (blocks & (blocks - 1)) != 0){
+            checkSay(ctx, d, "directory size %u is not a power of two blocks",
+                    entry->fileSize);
+            ctx->report->dir_errors++;
+            continue;
+        }
+        if(checkReadDir(ctx, d, block) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//write entry at loc, in place
+static int checkWriteEntry(const entryLoc* loc, const rootEntry* entry, char* block){
+    uint32_t perBlock = entriesPerBlock();
+    uint32_t index = (loc->dir == DIR_ROOT) ? sBlock->rootIndex + loc->slot / perBlock
+            : sBlock->dataStartIndex + loc->block;
+    uint32_t slot = (loc->dir == DIR_ROOT) ? loc->slot % perBlock : loc->slot;
+    rootEntry* entries = malloc(perBlock * sizeof(rootEntry));
+
+    if(entries == NULL || block_read(index, block) == -1){
+        free(entries);
+        return -1;
+    }
+    for(uint32_t i = 0; i < perBlock; i++){
+        decode_rootEntry(block, i, &entries[i]);
+    }
+    entries[slot] = *entry;
+    encode_entries(entries, block);
+    free(entries);
+    return block_write(index, block);
+}
+
+//end chain id at its last block to keep
+static void checkCut(checkCtx* ctx, const checkChain* c){
+    fatTable[c->last] = FAT_EOC;
+    ctx->fatDirty[fatBlockOf(c->last)] = 1;
+}
+
+//judge the walk of chain id, and repair what it found
+static int checkChainDone(checkCtx* ctx, uint32_t id, char* block){
+    struct fs_check_report* report = ctx->report;
+    int repair = ctx->flags & FS_CHECK_REPAIR;
+    checkChain* c = &ctx->chains[id];
+    int dir = entryType(&c->entry) == ENTRY_DIR;
+
+    //below a dropped directory, entries are gone with it
+    if(c->parent >= 0 && ctx->chains[c->parent].dropped){
+        c->dropped = 1;
+        return 0;
+    }
+
+    //entries without a first block of their own are dropped
+    if((c->state == CHAIN_EMPTY && dir) || c->state == CHAIN_BAD_START
+            || (c->state == CHAIN_CROSSED && c->last == FAT_EOC)){
+        if(c->state == CHAIN_CROSSED){
+            checkSay(ctx, id, "first block %u owned by another chain",
+                    c->entry.dataStartIndex);
+            report->cross_links++;
+        }
+        else{
+            checkSay(ctx, id, "first block %u out of range", c->entry.dataStartIndex);
+            report->bad_entries++;
+        }
+        c->dropped = 1;
+        if(repair){
+            if(c->parent >= 0){
+                ctx->chains[c->parent].lost++;
+            }
+            rootEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            if(c->loc.dir != DIR_ROOT){
+                entryType(&entry) = ENTRY_TOMBSTONE;
+            }
+            if(checkWriteEntry(&c->loc, &entry, block) == -1){
+                return -1;
+            }
+            report->repaired++;
+        }
+        return 0;
+    }
+
+    if(dir){
+        report->dirs++;
+    }
+    else{
+        report->files++;
+    }
+
+    if(c->state == CHAIN_CYCLE || c->state == CHAIN_CROSSED || c->state == CHAIN_BAD_LINK){
+        if(c->state == CHAIN_CYCLE){
+            checkSay(ctx, id, "chain loops back after block %u", c->last);
+            report->cycles++;
+        }
+        else if(c->state == CHAIN_CROSSED){
+            checkSay(ctx, id, "chain runs into another one after block %u", c->last);
+            report->cross_links++;
+        }
+        else{
+            //counted with the other bad FAT entries
+            checkSay(ctx, id, "chain goes out of range after block %u", c->last);
+        }
+        if(repair){
+            checkCut(ctx, c);
+            report->repaired += c->state != CHAIN_BAD_LINK;
+        }
+    }
+
+    if(dir){
+        //a directory can't be shrunk without rehashing its entries
+        if(c->length < c->entry.fileSize / blockSize){
+            checkSay(ctx, id, "directory of %u blocks has a chain of %u",
+                    c->entry.fileSize / blockSize, c->length);
+            report->dir_errors++;
+        }
+        return 0;
+    }
+
+    uint64_t need = ((uint64_t)c->entry.fileSize + blockSize - 1) / blockSize;
+    if(c->length < need){
+        checkSay(ctx, id, "size %u needs %llu blocks, chain has %u", c->entry.fileSize,
+                (unsigned long long)need, c->length);
+        report->size_mismatches++;
+        if(repair){
+            c->entry.fileSize = c->length * blockSize;
+            if(checkWriteEntry(&c->loc, &c->entry, block) == -1){
+                return -1;
+            }
+            report->repaired++;
+        }
+    }
+    return 0;
+}
+
+//check the live entry count of subdirectory d, once its entries are judged
+static int checkDirDone(checkCtx* ctx, uint32_t d, char* block){
+    checkChain* c = &ctx->chains[d];
+    rootEntry header;
+    entryLoc loc = { c->entry.dataStartIndex, c->entry.dataStartIndex, 0 };
+
+    if(entryType(&c->entry) != ENTRY_DIR || c->dropped || !c->complete){
+        return 0;
+    }
+    uint32_t index = sBlock->dataStartIndex + loc.block;
+    if(block_read(index, block) == -1){
+        return -1;
+    }
+    decode_rootEntry(block, 0, &header);
+    if(header.fileSize != c->live){
+        checkSay(ctx, d, "header counts %u entries, found %u", header.fileSize, c->live);
+        ctx->report->dir_errors++;
+        ctx->report->repaired += (ctx->flags & FS_CHECK_REPAIR) != 0;
+    }
+    //entries dropped by the repair are no longer counted, but left as
+    //tombstones; the tombstone count only steers rehashing and isn't reported
+    uint32_t dead = c->dead + c->lost;
+    if((header.fileSize != c->live - c->lost || dirTombstones(&header) != dead)
+            && (ctx->flags & FS_CHECK_REPAIR)){
+        header.fileSize = c->live - c->lost;
+        dirSetTombstones(&header, dead);
+        return checkWriteEntry(&loc, &header, block);
+    }
+    return 0;
+}
+
+//check the journal location, replay it if repairing, and claim its blocks
+static int checkJournal(checkCtx* ctx, char* block){
+    struct fs_check_report* report = ctx->report;
+    int repair = ctx->flags & FS_CHECK_REPAIR;
+    uint32_t start = sBlock->journalStart;
+    uint32_t count = sBlock->journalBlockCount;
+
+    if(count == 0){
+        return 0;
+    }
+    journalHeader* header = (journalHeader*)block;
+    if(start == 0 || count < 4 || (uint64_t)start + count > sBlock->dataBlockCount
+            || block_read(sBlock->dataStartIndex + start, block) == -1
+            || memcmp(header->magic, JOURNAL_MAGIC, 8) != 0){
+        //its blocks show up as leaked, and get freed with the journal disabled
+        checkSay(ctx, -1, "journal: no header at block %u", start);
+        report->journal_errors++;
+        if(repair){
+            sBlock->journalStart = 0;
+            sBlock->journalBlockCount = 0;
+            encode_superblock(block);
+            if(block_write(0, block) == -1){
+                return -1;
+            }
+            report->repaired++;
+        }
+        return 0;
+    }
+
+    if(repair){
+        int replayed = journal_recover();
+        journalBlocks = 0;
+        if(replayed == -1){
+            return -1;
+        }
+        report->journal_replayed = replayed;
+    }
+    else{
+        uint64_t sequence = header->sequence;
+        journalDescriptor* desc = (journalDescriptor*)block;
+        if(block_read(sBlock->dataStartIndex + start + 1, block) == -1){
+            return -1;
+        }
+        if(memcmp(desc->magic, JOURNAL_DESC_MAGIC, 8) == 0 && desc->sequence >= sequence){
+            checkSay(ctx, -1, "journal: committed transactions not replayed yet");
+            report->journal_pending = 1;
+        }
+    }
+    ctx->journal = 1;
+    return 0;
+}
+
+//claim the journal blocks, which must be reserved as one chain
+static void checkJournalChain(checkCtx* ctx){
+    uint32_t start = sBlock->journalStart;
+    uint32_t count = sBlock->journalBlockCount;
+    int broken = 0;
+
+    for(uint32_t i = start; i < start + count; i++){
+        uint32_t next = (i == start + count - 1) ? FAT_EOC : i + 1;
+        ctx->owner[i] = CHECK_JOURNAL;
+        if(fatTable[i] != next){
+            broken = 1;
+            if(ctx->flags & FS_CHECK_REPAIR){
+                fatTable[i] = next;
+                ctx->fatDirty[fatBlockOf(i)] = 1;
+            }
+        }
+    }
+    if(broken){
+        checkSay(ctx, -1, "journal: blocks %u to %u not reserved", start, start + count - 1);
+        ctx->report->journal_errors++;
+        ctx->report->repaired += (ctx->flags & FS_CHECK_REPAIR) != 0;
+    }
+}
+
+static int checkImage(checkCtx* ctx, char* block){
+    struct fs_check_report* report = ctx->report;
+    int repair = ctx->flags & FS_CHECK_REPAIR;
+
+    if(checkJournal(ctx, block) == -1){
+        return -1;
+    }
+    fatTable = init_fat();
+    ctx->owner = calloc(sBlock->dataBlockCount, sizeof(uint32_t));
+    ctx->dirRead = calloc(sBlock->dataBlockCount / 8 + 1, 1);
+    ctx->fatDirty = calloc(sBlock->fatBlockCount + 1, 1);
+    if(fatTable == NULL || ctx->owner == NULL || ctx->dirRead == NULL
+            || ctx->fatDirty == NULL){
+        return -1;
+    }
+
+    //entry 0 is reserved, everything else must lead somewhere valid
+    if(fatTable[0] != FAT_EOC){
+        checkSay(ctx, -1, "FAT: reserved entry 0 is %u", fatTable[0]);
+        report->bad_fat_entries++;
+        if(repair){
+            fatTable[0] = FAT_EOC;
+            ctx->fatDirty[1] = 1;
+            report->repaired++;
+        }
+    }
+    checkParallel(ctx, checkScanFat);
+    for(unsigned int t = 0; t < ctx->threads; t++){
+        report->bad_fat_entries += ctx->shares[t].bad;
+    }
+
+    if(ctx->journal){
+        checkJournalChain(ctx);
+    }
+    if(checkScanDirs(ctx, block) == -1){
+        return -1;
+    }
+
+    ctx->next = 0;
+    checkParallel(ctx, checkWalkShare);
+    for(uint32_t id = 0; id < ctx->count; id++){
+        if(ctx->chains[id].conflict){
+            checkRewalk(ctx);
+            break;
+        }
+    }
 
-    if(rBlock == NULL){
-        return -1;
+    checkMerges(ctx, 0);
+
+    //parents come before their entries in the list
+    for(uint32_t id = 0; id < ctx->count; id++){
+        if(checkChainDone(ctx, id, block) == -1){
+            return -1;
+        }
+    }
+    checkMerges(ctx, 1);
+    for(uint32_t id = 0; id < ctx->count; id++){
+        checkChain* c = &ctx->chains[id];
+        if(entryType(&c->entry) == ENTRY_DIR && !c->dropped && !c->complete){
+            ctx->incomplete = 1;
+        }
+        if(checkDirDone(ctx, id, block) == -1){
+            return -1;
+        }
     }
 
-	int count = 0;
-	for(int i = 0; i < MAX_FILE_COUNT; i++){
-		if(rBlock->entries[i].fileSize == 0){
-			if(rBlock->entries[i].fileName[0] == '\0'){
-				count++;
-			}
-		}
-	}
-	return count;
-}
+    checkParallel(ctx, checkScanLeaks);
+    for(unsigned int t = 0; t < ctx->threads; t++){
+        report->leaked_blocks += ctx->shares[t].leaked;
+        report->free_blocks += ctx->shares[t].free;
+    }
+    if(report->leaked_blocks > 0){
+        checkSay(ctx, -1, "FAT: %llu blocks leaked%s", (unsigned long long)report->leaked_blocks,
+                repair && ctx->incomplete ? ", left alone as a directory is damaged" : "");
+        if(repair && !ctx->incomplete){
+            report->repaired += report->leaked_blocks;
+        }
+    }
+    //bad FAT entries were either cut from their chain or freed as leaked
+    if(repair && report->bad_fat_entries > 0){
+        uint64_t left = fatTable[0] != FAT_EOC;
+        checkParallel(ctx, checkScanFat);
+        for(unsigned int t = 0; t < ctx->threads; t++){
+            left += ctx->shares[t].bad;
+        }
+        report->repaired += report->bad_fat_entries - left;
+    }
 
-int fs_info(void)
-{
-    nodePtr nd = list_get(blockList, 0);
-    superblock* sBlock = (superblock*)getData(nd);
+    for(uint32_t b = 1; b <= sBlock->fatBlockCount; b++){
+        if(ctx->fatDirty[b]){
+            encode_fat(b, block);
+            if(block_write(b, block) == -1){
+                return -1;
+            }
+        }
+    }
+    if(repair && block_disk_sync() == -1){
+        return -1;
+    }
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", sBlock->numBlocks);
-	printf("fat_blk_count=%d\n", sBlock->fatBlockCount);
-	printf("rdir_blk=%d\n", sBlock->rootIndex);
-	printf("data_blk=%d\n", sBlock->dataStartIndex);
-	printf("data_blk_count=%d\n", sBlock->dataBlockCount);
-	printf("fat_free_ratio=%d/%d\n", (sBlock->dataBlockCount - fat_count())
-					, sBlock->dataBlockCount);
-	printf("rdir_free_ratio=%d/%d\n", rdir_count(), MAX_FILE_COUNT);
-	return 0;
+    return report->bad_fat_entries + report->bad_entries + report->cycles
+            + report->cross_links + report->leaked_blocks + report->size_mismatches
+            + report->dir_errors + report->journal_errors + report->journal_pending;
 }
 
-int fs_create(const char *filename)
+static int do_fs_check(const char *diskname, unsigned int nthreads, int flags,
+        struct fs_check_report *report)
 {
+    checkCtx ctx;
+    int ret = -1;
 
-	nodePtr nd = list_get(blockList, 0);
+    if(report == NULL || nthreads > FS_CHECK_THREADS_MAX){
+        return -1;
+    }
+    memset(report, 0, sizeof(*report));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.flags = flags;
+    ctx.report = report;
+    ctx.threads = nthreads;
+    if(ctx.threads == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        ctx.threads = (cpus < 1) ? 1 : (cpus > FS_CHECK_THREADS_MAX) ? FS_CHECK_THREADS_MAX
+                : cpus;
+    }
 
-    if(nd == NULL){
+    //the block layer handles a single disk at a time
+    pthread_mutex_lock(&fsLock);
+    if(sBlock != NULL || block_disk_open(diskname) == -1){
+        pthread_mutex_unlock(&fsLock);
         return -1;
     }
+    sBlock = init_superblock();
+    if(sBlock != NULL){
+        blockSize = sBlock->blockSize;
+    }
+    if(sBlock != NULL && block_disk_set_size(blockSize) == 0 && check_superblock() == 0){
+        fatPerBlock = (sBlock->version == 1) ? FAT_PER_BLOCK_V1(blockSize)
+                : FAT_PER_BLOCK_V2(blockSize);
+        char* block = allocBlockBuf();
+        if(block != NULL){
+            ret = checkImage(&ctx, block);
+        }
+        freeBlockBuf(block);
+    }
+
+    free(ctx.chains);
+    free(ctx.owner);
+    free(ctx.dirRead);
+    free(ctx.fatDirty);
+    release_mount();
+    block_disk_close();
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+//===========================================================================//
+//                          BACKGROUND FLUSHER                               //
+//===========================================================================//
 
-    superblock* sBlock = (superblock*)getData(nd);
+pthread_t flusherThread;
+int flusherRunning = 0;
+int flusherStopping = 0;
+//set when the dirty threshold is crossed, cleared by the flusher
+int flusherKicked = 0;
+unsigned int flushInterval = 0;
+unsigned int flushThreshold = 0;
+
+//sync requests are numbered: a caller waits until the flusher has completed a
+//batch that includes its ticket, so one fdatasync serves every waiting caller
+uint64_t syncRequested = 0;
+uint64_t syncCompleted = 0;
+
+//a caller waiting for its ticket; the flusher hands it the result of the
+//batch that included it, whatever batches complete before it wakes up
+typedef struct syncWaiter {
+    uint64_t ticket;
+    int done;
+    int ret;
+    struct syncWaiter* next;
+} syncWaiter;
+
+syncWaiter* syncWaiters = NULL;
+pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t syncKick;
+pthread_cond_t syncDone = PTHREAD_COND_INITIALIZER;
+
+//wake the flusher up if there are now enough dirty blocks (fsLock held)
+void flusher_kick(void){
+    if(flushThreshold == 0 || dirtyCount < flushThreshold){
+        return;
+    }
+    pthread_mutex_lock(&syncLock);
+    if(flusherRunning && !flusherKicked){
+        flusherKicked = 1;
+        pthread_cond_signal(&syncKick);
+    }
+    pthread_mutex_unlock(&syncLock);
+}
 
-    nodePtr rootNd = list_get(blockList, sBlock->rootIndex);
-    rootDirectory* rBlock = (rootDirectory*)getData(rootNd);
+void *flusher_main(void *arg){
+    pthread_mutex_lock(&syncLock);
+    while(1){
+        if(!flusherStopping && !flusherKicked && syncRequested == syncCompleted){
+            if(flushInterval == 0){
+                pthread_cond_wait(&syncKick, &syncLock);
+            }
+            else{
+                struct timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += flushInterval / 1000;
+                deadline.tv_nsec += (flushInterval % 1000) * 1000000L;
+                if(deadline.tv_nsec >= 1000000000L){
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&syncKick, &syncLock, &deadline);
+            }
+        }
+        uint64_t target = syncRequested;
+        int stopping = flusherStopping;
+        flusherKicked = 0;
+        pthread_mutex_unlock(&syncLock);
+
+        pthread_mutex_lock(&fsLock);
+        int flushed = flushDirtyBlocks();
+        pthread_mutex_unlock(&fsLock);
+
+        int ret = flushed == -1 ? -1 : 0;
+        //data blocks are written synchronously, so even a batch that found no
+        //dirty metadata needs the fdatasync when somebody asked for it
+        if(ret == 0 && (flushed > 0 || target != syncCompleted)){
+            ret = block_disk_sync();
+        }
 
-    for(int i = 0; i<list_length(blockList); i++){
+        pthread_mutex_lock(&syncLock);
+        syncCompleted = target;
+        for(syncWaiter** link = &syncWaiters; *link != NULL;){
+            syncWaiter* w = *link;
+            if(w->ticket > target){
+                link = &w->next;
+                continue;
+            }
+            w->ret = ret;
+            w->done = 1;
+            *link = w->next;
+        }
+        pthread_cond_broadcast(&syncDone);
+        if(stopping){
+            break;
+        }
+    }
+    pthread_mutex_unlock(&syncLock);
+    return NULL;
+}
 
-        nodePtr nd = list_get(blockList, i);
+static int do_fs_flusher_start(unsigned int interval_ms, unsigned int dirty_threshold)
+{
+    pthread_mutex_lock(&fsLock);
+    if(sBlock == NULL){
+        pthread_mutex_unlock(&fsLock);
+        return -1;
+    }
+    pthread_mutex_lock(&syncLock);
+    if(flusherRunning){
+        pthread_mutex_unlock(&syncLock);
+        pthread_mutex_unlock(&fsLock);
+        return -1;
+    }
 
-        //if the block is FAT, count the number of entries within it
-        if(getType(nd) == BLOCK_FAT){
-            fat* fBlock = (fat*) getData(nd);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&syncKick, &attr);
+    pthread_condattr_destroy(&attr);
+
+    flushInterval = interval_ms;
+    flushThreshold = dirty_threshold;
+    flusherStopping = 0;
+    flusherKicked = 0;
+    syncRequested = syncCompleted = 0;
+
+    if(pthread_create(&flusherThread, NULL, flusher_main, NULL) != 0){
+        pthread_cond_destroy(&syncKick);
+        pthread_mutex_unlock(&syncLock);
+        pthread_mutex_unlock(&fsLock);
+        return -1;
+    }
+    flusherRunning = 1;
+    pthread_mutex_unlock(&syncLock);
+    pthread_mutex_unlock(&fsLock);
+    return 0;
+}
 
-        	for(int j = 0; j < FAT_ARRAY_SIZE; j++){
-        		if (fBlock->entries[j] == 0){
-        			fBlock->entries[j] = FAT_EOC;
+static int do_fs_flusher_stop(void)
+{
+    pthread_mutex_lock(&syncLock);
+    if(!flusherRunning){
+        pthread_mutex_unlock(&syncLock);
+        return -1;
+    }
+    flusherStopping = 1;
+    pthread_cond_signal(&syncKick);
+    pthread_mutex_unlock(&syncLock);
 
-                    for(int k=0; k<MAX_FILE_COUNT; k++){
-                        //the first character of the filename of entry is '0'
-                        if(rBlock->entries[k].fileName[0] == '\0'){
+    pthread_join(flusherThread, NULL);
 
-                            memcpy(rBlock->entries[k].fileName, (void *)filename , 16);
-                            rBlock->entries[k].fileSize = 0;
-                            rBlock->entries[k].dataStartIndex = j;
+    pthread_mutex_lock(&syncLock);
+    flusherRunning = 0;
+    pthread_cond_destroy(&syncKick);
+    pthread_mutex_unlock(&syncLock);
+    return 0;
+}
 
-                            changedBlocks[i] = 1;
-				            changedBlocks[sBlock->rootIndex] = 1;
-                            return 0;
-                        }
-                    }
-        		}
-        	}
+int fs_sync(void)
+{
+    FS_PROBE(fs_sync_entry);
+    stats_inc(sync_requests);
+
+    pthread_mutex_lock(&syncLock);
+    //past its last batch, a stopping flusher would never serve the ticket
+    if(flusherRunning && !flusherStopping){
+        syncWaiter w = { ++syncRequested, 0, 0, syncWaiters };
+        syncWaiters = &w;
+        pthread_cond_signal(&syncKick);
+        while(!w.done){
+            pthread_cond_wait(&syncDone, &syncLock);
         }
+        int ret = w.ret;
+        pthread_mutex_unlock(&syncLock);
+        FS_PROBE1(fs_sync_return, ret);
+        return ret;
     }
+    pthread_mutex_unlock(&syncLock);
 
-	return 0;
+    pthread_mutex_lock(&fsLock);
+    int ret = sBlock == NULL ? -1 : flushDirtyBlocks();
+    pthread_mutex_unlock(&fsLock);
+
+    if(ret != -1){
+        ret = block_disk_sync();
+    }
+    FS_PROBE1(fs_sync_return, ret);
+    return ret;
 }
 
-int fs_delete(const char *filename)
+static int do_fs_fsync(int fd)
 {
-	nodePtr nd = list_get(blockList, 0);
+    pthread_mutex_lock(&fsLock);
+    fdOp *f = sBlock == NULL ? NULL : getFdOpByDescriptor(fd);
+    int valid = f != NULL && f->fileName[0] != '\0';
+    pthread_mutex_unlock(&fsLock);
 
-    if(nd == NULL){
+    if(!valid){
         return -1;
     }
+    return fs_sync();
+}
 
-    superblock* sBlock = (superblock*)getData(nd);
+//===========================================================================//
+//                      INSTRUMENTED ENTRY POINTS                            //
+//===========================================================================//
 
-    nodePtr rootNd = list_get(blockList, sBlock->rootIndex);
-    rootDirectory* rBlock = (rootDirectory*)getData(rootNd);
+// every public call fires a libfs:<name>_entry/<name>_return probe pair, the
+// return probe carrying the result; the hot ones are also timed. Calls are
+// serialized by fsLock, which the background flusher takes as well; reads
+// drop it while their data blocks are transferred
 
-    for(int j = 0; j<list_length(blockList); j++){
+int fs_set_open_max(size_t max)
+{
+	FS_PROBE1(fs_set_open_max_entry, max);
+	int ret = -1;
+	if(max > 0 && max <= FS_OPEN_MAX_LIMIT){
+		pthread_mutex_lock(&fsLock);
+		if(max >= fdOpenCount){
+			fdLimit = max;
+			ret = 0;
+		}
+		pthread_mutex_unlock(&fsLock);
+	}
+	FS_PROBE1(fs_set_open_max_return, ret);
+	return ret;
+}
 
-        nodePtr nd = list_get(blockList, j);
-        //if the block is FAT, count the number of entries within it
-        if(getType(nd) == BLOCK_FAT){
-            fat* fBlock = (fat*) getData(nd);
+int fs_set_io_mode(int flags)
+{
+	FS_PROBE1(fs_set_io_mode_entry, flags);
+	int ret = -1;
+	if(!(flags & ~(FS_IO_DIRECT | FS_IO_HUGEPAGE))){
+		pthread_mutex_lock(&fsLock);
+		ioMode = flags;
+		pthread_mutex_unlock(&fsLock);
+		ret = 0;
+	}
+	FS_PROBE1(fs_set_io_mode_return, ret);
+	return ret;
+}
 
-    	for(int i = 0; i < MAX_FILE_COUNT; i++){
-    		if(strcmp(rBlock->entries[i].fileName, filename) == 0){
-    			int fatNum = rBlock->entries[i].dataStartIndex % FAT_ARRAY_SIZE;
+//the format and the check open the disk themselves, under fsLock
+int fs_format(const char *diskname, size_t data_blocks,
+		const struct fs_format_opts *opts)
+{
+	FS_PROBE2(fs_format_entry, (uintptr_t)diskname, data_blocks);
+	int ret = do_fs_format(diskname, data_blocks, opts);
+	FS_PROBE1(fs_format_return, ret);
+	return ret;
+}
 
-    			int nextBlock = fBlock->entries[fatNum];
-    			fBlock->entries[fatNum] = 0;
+size_t fs_format_max_blocks(const struct fs_format_opts *opts)
+{
+	FS_PROBE1(fs_format_max_blocks_entry, (uintptr_t)opts);
+	size_t ret = do_fs_format_max_blocks(opts);
+	FS_PROBE1(fs_format_max_blocks_return, ret);
+	return ret;
+}
 
-    			while(nextBlock != FAT_EOC){
+int fs_check(const char *diskname, unsigned int nthreads, int flags,
+        struct fs_check_report *report)
+{
+	FS_PROBE3(fs_check_entry, (uintptr_t)diskname, nthreads, flags);
+	int ret = do_fs_check(diskname, nthreads, flags, report);
+	FS_PROBE1(fs_check_return, ret);
+	return ret;
+}
 
-    				nd = list_get(blockList, (nextBlock / FAT_ARRAY_SIZE) + 1);
-    				fBlock = getData(nd);
-    				fatNum = nextBlock;
-    				nextBlock = fBlock->entries[nextBlock];
-    				fBlock->entries[fatNum] = 0;
-    		    }
-    			rBlock->entries[i].fileName[0] = '\0';
-    			rBlock->entries[i].fileSize = 0;
-    			rBlock->entries[i].dataStartIndex = 0;
+int fs_journal_create(unsigned int nblocks)
+{
+	FS_PROBE1(fs_journal_create_entry, nblocks);
+	int ret = do_fs_journal_create(nblocks);
+	FS_PROBE1(fs_journal_create_return, ret);
+	return ret;
+}
 
-    	 	    for(int i = 0; i < 32; i++){
-    				if(strcmp(fileDes[i]->fileName, filename) == 0){
-    					fileDes[i]->fileName[0] = '\0';
-    					fileDes[i]->offset = 0;
-    				}
-    			}
-    		    changedBlocks[j] = 1;
-    		    changedBlocks[sBlock->rootIndex] = 1;
-                return 0;
-    		}
-    	}
-	}
+//the flusher has locks of its own, see fs_sync()
+int fs_flusher_start(unsigned int interval_ms, unsigned int dirty_threshold)
+{
+	FS_PROBE2(fs_flusher_start_entry, interval_ms, dirty_threshold);
+	int ret = do_fs_flusher_start(interval_ms, dirty_threshold);
+	FS_PROBE1(fs_flusher_start_return, ret);
+	return ret;
 }
-	return -1;
+
+int fs_flusher_stop(void)
+{
+	FS_PROBE(fs_flusher_stop_entry);
+	int ret = do_fs_flusher_stop();
+	FS_PROBE1(fs_flusher_stop_return, ret);
+	return ret;
 }
 
-int fs_ls(void)
+int fs_fsync(int fd)
 {
-    rootDirectory* rBlock = getRootDirectory();
-    if(rBlock == NULL){
-        return -1;
-    }
+	FS_PROBE1(fs_fsync_entry, fd);
+	int ret = do_fs_fsync(fd);
+	FS_PROBE1(fs_fsync_return, ret);
+	return ret;
+}
 
-	printf("FS Ls:\n");
-	for(int i = 0; i < MAX_FILE_COUNT; i++){
-		if (rBlock->entries[i].fileName[0] != '\0'){
-			printf("file: %s, size: %d, data_blk: %d\n", rBlock->entries[i].fileName, rBlock->entries[i].fileSize, rBlock->entries[i].dataStartIndex);
-		}
+int fs_mount(const char *diskname)
+{
+	FS_PROBE1(fs_mount_entry, (uintptr_t)diskname);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_mount(diskname);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_MOUNT, start);
+	FS_PROBE1(fs_mount_return, ret);
+	return ret;
+}
+
+int fs_umount(void)
+{
+	FS_PROBE(fs_umount_entry);
+	uint64_t start = lat_start();
+	//the flusher takes fsLock, it is stopped first and restarted if the file
+	//system stays mounted
+	int flusher = do_fs_flusher_stop() == 0;
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_umount();
+	pthread_mutex_unlock(&fsLock);
+	if(ret == -1 && flusher){
+		do_fs_flusher_start(flushInterval, flushThreshold);
 	}
-	return 0;
+	lat_record(FS_OP_UMOUNT, start);
+	FS_PROBE1(fs_umount_return, ret);
+	return ret;
 }
 
-int fs_open(const char *filename)
+int fs_info(void)
 {
-	rootDirectory* rBlock = getRootDirectory();
-    if(rBlock == NULL){
-        return -1;
-    }
+	FS_PROBE(fs_info_entry);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_info();
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_info_return, ret);
+	return ret;
+}
 
-	for(int i = 0; i < MAX_FILE_COUNT; i++){
-		if( strcmp(rBlock->entries[i].fileName, filename) == 0){
-			for(int j = 0; j < 32; j++){
-				if(fileDes[j]->fileName[0] == '\0'){
-					strcpy(fileDes[j]->fileName, filename);
-					return j;
-				}
-			}
-			return -1;
-		}
-	}
-	return -1;
+int fs_create(const char *filename)
+{
+	FS_PROBE1(fs_create_entry, (uintptr_t)filename);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_create(filename);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_CREATE, start);
+	FS_PROBE1(fs_create_return, ret);
+	return ret;
 }
 
-int fs_close(int fd)
+int fs_delete(const char *filename)
 {
-	if(fileDes[fd]->fileName[0] == '\0'){
-		return -1;
-	}
-	fileDes[fd]->fileName[0] = '\0';
-	fileDes[fd]->offset = 0;
-	return 0;
+	FS_PROBE1(fs_delete_entry, (uintptr_t)filename);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_delete(filename);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_DELETE, start);
+	FS_PROBE1(fs_delete_return, ret);
+	return ret;
 }
 
-int fs_stat(int fd)
+int fs_ls(void)
 {
-    if(fileDes[fd]->fileName[0] == '\0'){
-		return -1;
-	}
-	char* name = fileDes[fd]->fileName;
+	FS_PROBE(fs_ls_entry);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_ls();
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_ls_return, ret);
+	return ret;
+}
 
-    rootDirectory* rBlock = getRootDirectory();
-    if(rBlock == NULL){
-        return -1;
-    }
+int fs_open(const char *filename)
+{
+	FS_PROBE1(fs_open_entry, (uintptr_t)filename);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_open(filename);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_OPEN, start);
+	FS_PROBE1(fs_open_return, ret);
+	return ret;
+}
 
-	for(int i = 0; i < MAX_FILE_COUNT; i++){
-		if(strcmp(rBlock->entries[i].fileName, name) == 0){
-            return rBlock->entries[i].fileSize;
-		}
-	}
-	return -1;
+int fs_mkdir(const char *path)
+{
+	FS_PROBE1(fs_mkdir_entry, (uintptr_t)path);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_mkdir(path);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_mkdir_return, ret);
+	return ret;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_rmdir(const char *path)
 {
-	if(fileDes[fd]->fileName[0] == '\0'){
-		return -1;
-	}
+	FS_PROBE1(fs_rmdir_entry, (uintptr_t)path);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_rmdir(path);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_rmdir_return, ret);
+	return ret;
+}
 
-	int size = fs_stat(fd);
-	if(offset > size){
-		return -1;
-	}
+int fs_rename(const char *oldpath, const char *newpath)
+{
+	FS_PROBE2(fs_rename_entry, (uintptr_t)oldpath, (uintptr_t)newpath);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_rename(oldpath, newpath);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_rename_return, ret);
+	return ret;
+}
 
-	fileDes[fd]->offset = offset;
-	return 0;
+int fs_readdir(const char *path, uint64_t *pos, struct fs_dirent *ents, int max)
+{
+	FS_PROBE2(fs_readdir_entry, (uintptr_t)path, max);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_readdir(path, pos, ents, max);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_readdir_return, ret);
+	return ret;
 }
 
-int calcStartBlock(char *filename, int offset){
-	int blockNum = offset / BLOCK_SIZE;
-	rootDirectory *rBlock = getRootDirectory();
+int fs_stat_many(const char **paths, int count, struct fs_dirent *ents)
+{
+	FS_PROBE1(fs_stat_many_entry, count);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_stat_many(paths, count, ents);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_stat_many_return, ret);
+	return ret;
+}
 
-	for(int i = 0; i < MAX_FILE_COUNT; i++){
-		if (strcmp(rBlock->entries[i].fileName, filename) == 0){
-			if(offset > rBlock->entries[i].fileSize){
-				return -1;
-			}
-			int currBlock = rBlock->entries[i].dataStartIndex;
-			for(int j = 1; j < blockNum; j++){
-				nodePtr nd = list_get(blockList, (currBlock / FAT_ARRAY_SIZE) + 1);
-				fat *fBlock = (fat *)getData(nd);
-				currBlock = fBlock->entries[currBlock % FAT_ARRAY_SIZE];
-			}
-		    return currBlock;
-		}
-	}
-	return -1;
+int fs_lsdir(const char *path)
+{
+	FS_PROBE1(fs_lsdir_entry, (uintptr_t)path);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_lsdir(path);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_lsdir_return, ret);
+	return ret;
 }
 
-int findEmptyBlock(){
-	for(int i = 1; i < 5; i++){
-		nodePtr nd = list_get(blockList, i);
+int fs_close(int fd)
+{
+	FS_PROBE1(fs_close_entry, fd);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_close(fd);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_close_return, ret);
+	return ret;
+}
 
-		if(getType(nd) == BLOCK_FAT){
-			fat *fBlock = (fat *)getData(nd);
+int fs_stat(int fd)
+{
+	FS_PROBE1(fs_stat_entry, fd);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_stat(fd);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_stat_return, ret);
+	return ret;
+}
 
-			for(int j = 0; j < FAT_ARRAY_SIZE; j++){
-				if(fBlock->entries[j] == 0){
-					return (FAT_ARRAY_SIZE * (i - 1)) + j;
-				}
-			}
-		}
-	}
-	return -1;
+int fs_lseek(int fd, size_t offset)
+{
+	FS_PROBE2(fs_lseek_entry, fd, offset);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_lseek(fd, offset);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_lseek_return, ret);
+	return ret;
 }
 
 int fs_write(int fd, void *buf, size_t count)
 {
-	nodePtr nd = list_get(blockList, 0);
-	rootDirectory *rBlock = getRootDirectory();
-	superblock *sBlock = (superblock *)getData(nd);
-	fdOp *f = getFdOpByDescriptor(fd);
-	size_t currAmtCopied = 0;
-	char hold[BLOCK_SIZE];
+	FS_PROBE2(fs_write_entry, fd, count);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_write(fd, buf, count);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_WRITE, start);
+	FS_PROBE1(fs_write_return, ret);
+	return ret;
+}
 
-	if (f == NULL){
-		return -1;
-	}
-	int currBlock = calcStartBlock(f->fileName, f->offset);
-	nd = list_get(blockList, (currBlock / FAT_ARRAY_SIZE) + 1);
-	fat *fBlock = (fat *)getData(nd);
-	// if starting in the middle of block
-	if((f->offset % BLOCK_SIZE) != 0){
+int fs_read(int fd, void *buf, size_t count)
+{
+	FS_PROBE2(fs_read_entry, fd, count);
+	uint64_t start = lat_start();
+	int ret = do_fs_read(fd, buf, count);
+	lat_record(FS_OP_READ, start);
+	FS_PROBE1(fs_read_return, ret);
+	return ret;
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+	FS_PROBE3(fs_pwrite_entry, fd, count, offset);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_pwrite(fd, buf, count, offset);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_WRITE, start);
+	FS_PROBE1(fs_pwrite_return, ret);
+	return ret;
+}
 
-		int offCount = f->offset % BLOCK_SIZE;
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	FS_PROBE3(fs_pread_entry, fd, count, offset);
+	uint64_t start = lat_start();
+	int ret = do_fs_pread(fd, buf, count, offset);
+	lat_record(FS_OP_READ, start);
+	FS_PROBE1(fs_pread_return, ret);
+	return ret;
+}
 
-		char * bounce = malloc(BLOCK_SIZE * sizeof(char));
-		block_read(sBlock->dataStartIndex + currBlock, hold);
-		// if the amount to write can't fit in this block
-		if(count - offCount >= BLOCK_SIZE){
-			memcpy(hold + offCount, buf, BLOCK_SIZE - offCount);
-			currAmtCopied = BLOCK_SIZE - offCount;
-		}
-		else {
-			strncpy(bounce, buf, count);
-			for(int i = 0 ; i < count; i++){
-				hold[offCount + i] = bounce[i];
-			}
-			currAmtCopied = count;
-		}
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	FS_PROBE2(fs_writev_entry, fd, iovcnt);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_writev(fd, iov, iovcnt);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_WRITE, start);
+	FS_PROBE1(fs_writev_return, ret);
+	return ret;
+}
 
-		block_write(sBlock->dataStartIndex + currBlock, hold);
-		// if the current block in FAT doesn't point to FAT_EOC
-		if(fBlock->entries[currBlock % FAT_ARRAY_SIZE] != FAT_EOC){
-			nd = list_get(blockList, (currBlock / FAT_ARRAY_SIZE) + 1);
-			fBlock = (fat *)getData(nd);
-			currBlock = fBlock->entries[currBlock % FAT_ARRAY_SIZE];
-		}
-		// if there is still more to write
-		else if(count - currAmtCopied > 0){
-			int newBlock = findEmptyBlock();
-			fBlock->entries[currBlock] = newBlock;
-			currBlock = newBlock;
-			nd = list_get(blockList, (currBlock / FAT_ARRAY_SIZE) + 1);
-			fBlock = (fat *)getData(nd);
-			fBlock->entries[currBlock % FAT_ARRAY_SIZE] = FAT_EOC;
-		}
-	}
-	while(currAmtCopied < count){
-		if(count - currAmtCopied >= BLOCK_SIZE){
-
-			memcpy(hold, (char *)buf + currAmtCopied, BLOCK_SIZE);
-			currAmtCopied += BLOCK_SIZE;
-			block_write(sBlock->dataStartIndex + currBlock, hold);
-			// update currBlock for next write
-			if(fBlock->entries[currBlock % FAT_ARRAY_SIZE] != FAT_EOC){
-				nd = list_get(blockList, (currBlock / FAT_ARRAY_SIZE) + 1);
-				fBlock = (fat *)getData(nd);
-				currBlock = fBlock->entries[currBlock % FAT_ARRAY_SIZE];
-			}
-			else if(count - currAmtCopied > 0){
-				int newBlock = findEmptyBlock();
-				fBlock->entries[currBlock] = newBlock;
-				currBlock = newBlock;
-				nd = list_get(blockList, (currBlock / FAT_ARRAY_SIZE) + 1);
-				fBlock = (fat *)getData(nd);
-				fBlock->entries[currBlock % FAT_ARRAY_SIZE] = FAT_EOC;
-			}
-		}
-		else {
-			memcpy(hold, (char *)buf + currAmtCopied, (count - currAmtCopied));
-			block_write(sBlock->dataStartIndex + currBlock, hold);
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	FS_PROBE2(fs_readv_entry, fd, iovcnt);
+	uint64_t start = lat_start();
+	int ret = do_fs_readv(fd, iov, iovcnt);
+	lat_record(FS_OP_READ, start);
+	FS_PROBE1(fs_readv_return, ret);
+	return ret;
+}
 
-			currAmtCopied += count - currAmtCopied;
-		}
-	}
+int fs_pwritev(int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	FS_PROBE3(fs_pwritev_entry, fd, iovcnt, offset);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_pwritev(fd, iov, iovcnt, offset);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_WRITE, start);
+	FS_PROBE1(fs_pwritev_return, ret);
+	return ret;
+}
 
-	if(fs_stat(fd) <= f->offset + count){
-		for(int i = 0; i < MAX_FILE_COUNT; i++){
-			if(strcmp(rBlock->entries[i].fileName, f->fileName) == 0){
-				rBlock->entries[i].fileSize = (f->offset + count);
-				changedBlocks[sBlock->rootIndex] = 1;
-			}
-		}
-	}
-	else if(fs_stat(fd) == UINT_MAX){
-		for(int i = 0; i < MAX_FILE_COUNT; i++){
-			if(strcmp(rBlock->entries[i].fileName, f->fileName) == 0){
-				rBlock->entries[i].fileSize = count;
-				changedBlocks[sBlock->rootIndex] = 1;
-			}
-		}
+int fs_preadv(int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	FS_PROBE3(fs_preadv_entry, fd, iovcnt, offset);
+	uint64_t start = lat_start();
+	int ret = do_fs_preadv(fd, iov, iovcnt, offset);
+	lat_record(FS_OP_READ, start);
+	FS_PROBE1(fs_preadv_return, ret);
+	return ret;
+}
 
-	}
-	return currAmtCopied;
+int fs_sendfile(int out_fd, int fd, size_t *offset, size_t count)
+{
+	FS_PROBE3(fs_sendfile_entry, out_fd, fd, count);
+	uint64_t start = lat_start();
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_sendfile(out_fd, fd, offset, count);
+	pthread_mutex_unlock(&fsLock);
+	lat_record(FS_OP_READ, start);
+	FS_PROBE1(fs_sendfile_return, ret);
+	return ret;
 }
 
+int fs_fallocate(int fd, size_t offset, size_t len)
+{
+	FS_PROBE3(fs_fallocate_entry, fd, offset, len);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_fallocate(fd, offset, len);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_fallocate_return, ret);
+	return ret;
+}
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_truncate(int fd, size_t len)
 {
-	nodePtr nd = list_get(blockList, 0);
-	superblock *sBlock = (superblock *)getData(nd);
-	fdOp *f = getFdOpByDescriptor(fd);
-	size_t currAmtCopied = 0;
-	char hold[BLOCK_SIZE];
+	FS_PROBE2(fs_truncate_entry, fd, len);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_truncate(fd, len);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_truncate_return, ret);
+	return ret;
+}
 
-	if (f == NULL || fs_stat(fd) < (count + f->offset)){
-		return -1;
-	}
-	int currBlock = calcStartBlock(f->fileName, f->offset);
-	// if starting in the middle of block
-	if((f->offset % BLOCK_SIZE) != 0){
-		currAmtCopied = f->offset % BLOCK_SIZE;
-		block_read(sBlock->dataStartIndex + currBlock, hold);
-		memcpy((char *)buf, hold , currAmtCopied);
-		// update currBlock for next read
-		nd = list_get(blockList, (currBlock / FAT_ARRAY_SIZE) + 1);
-		fat *fBlock = (fat *)getData(nd);
-		currBlock = fBlock->entries[currBlock % FAT_ARRAY_SIZE];
-	}
-	// while there is still more to read
-	while(currAmtCopied < count){
-		if(count - currAmtCopied >= BLOCK_SIZE){
+int fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out,
+		  size_t len, int flags)
+{
+	FS_PROBE3(fs_copy_range_entry, fd_in, fd_out, len);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_copy_range(fd_in, off_in, fd_out, off_out, len, flags);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_copy_range_return, ret);
+	return ret;
+}
 
-			int check = block_read(sBlock->dataStartIndex + currBlock, hold);
-			if(check == -1){
-				return -1;
-			}
-			// read one block at a time
-			memcpy((char *)buf + currAmtCopied, hold, BLOCK_SIZE);
-			currAmtCopied += BLOCK_SIZE;
-			// update currBlock for next read
-			nd = list_get(blockList, (currBlock / FAT_ARRAY_SIZE) + 1);
-			fat *fBlock = (fat *)getData(nd);
-			currBlock = fBlock->entries[currBlock % FAT_ARRAY_SIZE];
-		}
-		else {
-			int check = block_read(sBlock->dataStartIndex + currBlock, hold);
-			if(check == -1){
-				return -1;
-			}
-			memcpy((char *)buf + currAmtCopied, hold, (count - currAmtCopied));
-			currAmtCopied += count - currAmtCopied;
-		}
-	}
-	return currAmtCopied;
+int fs_trim(size_t min_blocks, size_t *trimmed)
+{
+	FS_PROBE1(fs_trim_entry, min_blocks);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_trim(min_blocks, trimmed);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_trim_return, ret);
+	return ret;
+}
+
+int fs_defrag(const struct fs_defrag_opts *opts, struct fs_defrag_report *report)
+{
+	FS_PROBE2(fs_defrag_entry, opts ? opts->time_ms : 0, opts ? opts->max_blocks : 0);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_defrag(opts, report);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_defrag_return, ret);
+	return ret;
+}
+
+int fs_export(int fd)
+{
+	FS_PROBE1(fs_export_entry, fd);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_export(fd);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_export_return, ret);
+	return ret;
+}
+
+int fs_import(int fd, const char *diskname, int flags)
+{
+	FS_PROBE2(fs_import_entry, fd, flags);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_import(fd, diskname, flags);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_import_return, ret);
+	return ret;
+}
+
+int fs_layout(const char *path, struct fs_layout_report *layout,
+	      struct fs_layout_file *files, int max, char *map, size_t map_len)
+{
+	FS_PROBE2(fs_layout_entry, (uintptr_t)path, max);
+	pthread_mutex_lock(&fsLock);
+	int ret = do_fs_layout(path, layout, files, max, map, map_len);
+	pthread_mutex_unlock(&fsLock);
+	FS_PROBE1(fs_layout_return, ret);
+	return ret;
 }
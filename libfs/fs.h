@@ -1,17 +1,478 @@
 #ifndef _FS_H
 #define _FS_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/**
+ * Maximum number of files in a one-block root directory, such as the one of
+ * the legacy format. See fs_format() for larger directories.
+ */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Default maximum number of open files, see fs_set_open_max() */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Largest maximum number of open files fs_set_open_max() accepts */
+#define FS_OPEN_MAX_LIMIT (1 << 20)
+
+/**
+ * fs_set_open_max - Set the maximum number of open files
+ * @max: Maximum number of files open at the same time
+ *
+ * The limit holds across mounts and starts out as %FS_OPEN_MAX_COUNT. The
+ * descriptor table grows as needed up to it, and opening or closing a file
+ * costs the same however many files are open. Descriptors are not reused
+ * right away: a stale descriptor of a closed file stays invalid even once its
+ * table slot is handed out again.
+ *
+ * Return: -1 if @max is 0 or larger than %FS_OPEN_MAX_LIMIT, or if more than
+ * @max files are currently open. 0 otherwise.
+ */
+int fs_set_open_max(size_t max);
+
+/** fs_set_io_mode() flag: bypass the host page cache with direct I/O */
+#define FS_IO_DIRECT 0x1
+/** fs_set_io_mode() flag: back the block buffer pool with huge pages */
+#define FS_IO_HUGEPAGE 0x2
+
+/**
+ * fs_set_io_mode - Choose how the next mounts do their block I/O
+ * @flags: I/O mode flags (%FS_IO_DIRECT, %FS_IO_HUGEPAGE), 0 for the default
+ *
+ * The mode holds across mounts and starts out as 0, block I/O going through
+ * the host page cache. With %FS_IO_DIRECT, the virtual disk file is opened
+ * with O_DIRECT, so that a large image isn't cached by the host on top of the
+ * library. Every mount sets aside a fixed pool of aligned block buffers, which
+ * the library draws its own buffers from, and with %FS_IO_HUGEPAGE the pool
+ * is backed by huge pages when the host has some. With direct I/O, data the
+ * caller's buffers hold as whole blocks aligned on 4096 bytes is transferred
+ * straight from or to them, and anything else through the pool.
+ *
+ * Return: -1 if @flags holds an unknown flag. 0 otherwise. Mounting with
+ * %FS_IO_DIRECT fails if the host file system of the virtual disk file
+ * doesn't support direct I/O.
+ */
+int fs_set_io_mode(int flags);
+
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @offset: Start of the range to reserve
+ * @len: Length of the range to reserve
+ *
+ * Make sure that the file referenced by file descriptor @fd owns the data
+ * blocks backing bytes [@offset, @offset + @len), without writing any data.
+ * Missing blocks are appended to the file's chain as a contiguous run when one
+ * is available (preferably right after the file's current last block). The
+ * file size is not changed: the reserved blocks are consumed by subsequent
+ * fs_write() calls that extend the file.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if the range ends past the largest file size (%UINT32_MAX bytes), or
+ * if there are not enough free blocks on disk, in which case nothing is
+ * reserved. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t offset, size_t len);
+
+/**
+ * fs_truncate - Shrink a file
+ * @fd: File descriptor
+ * @len: New size of the file
+ *
+ * Set the size of the file referenced by file descriptor @fd to @len and free
+ * the data blocks past the new end of file, including blocks reserved with
+ * fs_fallocate(). File descriptors whose offset lies beyond @len are moved
+ * back to @len.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @len is larger than the current size of the file. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t len);
+
+/** fs_copy_range() flag: share the blocks of the file rather than copy them */
+#define FS_COPY_CLONE 0x1
+
+/**
+ * fs_copy_range - Copy a range of bytes between two files
+ * @fd_in: File descriptor of the file to copy from
+ * @off_in: Offset of the range in the file to copy from
+ * @fd_out: File descriptor of the file to copy to
+ * @off_out: Offset of the range in the file to copy to
+ * @len: Length of the range
+ * @flags: Copy flags (%FS_COPY_CLONE)
+ *
+ * Copy up to @len bytes of the file referenced by @fd_in, starting at
+ * @off_in, to the file referenced by @fd_out, starting at @off_out, without
+ * going through user buffers. The room needed is reserved up front as with
+ * fs_fallocate(), and block-aligned ranges are copied a run of consecutive
+ * blocks at a time. The copy stops at the end of the source file, and extends
+ * the destination file if needed. File descriptor offsets are not changed.
+ *
+ * With %FS_COPY_CLONE, copying a whole file at offset 0 to an empty file makes
+ * it a clone: the two files share their data blocks, but the first, until
+ * either of them writes to, truncates or extends the shared part, which is then
+ * copied. Other copies are done as without the flag. A file system holding
+ * clones is flagged as such in its superblock, fs_check() then allowing files
+ * to share blocks, and can't be defragmented until the clones are gone.
+ *
+ * Return: -1 if a file descriptor is invalid (out of bounds or not currently
+ * open), if @off_out is beyond the end of the destination file, if the source
+ * and destination ranges overlap in the same file, or if there are not enough
+ * free blocks on disk. Otherwise, the number of bytes copied, which is 0 if
+ * @off_in is at or beyond the end of the source file.
+ */
+int fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out,
+		  size_t len, int flags);
+
+/**
+ * fs_trim - Release free blocks on the host
+ * @min_blocks: Smallest run of free blocks worth releasing, 0 for any
+ * @trimmed: Where to store the number of free blocks now released, or NULL
+ *
+ * Commit the metadata, then punch holes in the virtual disk file over every run
+ * of at least @min_blocks free data blocks, so that the image only takes host
+ * space for allocated blocks. Blocks freed afterwards keep their space until
+ * the next call. Released blocks read back as zeroes.
+ *
+ * Return: -1 if no virtual disk is mounted, in case of failure writing the
+ * metadata, or if the host file system doesn't support punching holes. 0
+ * otherwise.
+ */
+int fs_trim(size_t min_blocks, size_t *trimmed);
+
+/**
+ * struct fs_defrag_opts - Budget of a defragmentation pass
+ * @time_ms: Stop after about this many milliseconds, 0 for no limit
+ * @max_blocks: Stop after moving this many blocks, 0 for no limit
+ */
+struct fs_defrag_opts {
+	unsigned int time_ms;
+	size_t max_blocks;
+};
+
+/**
+ * struct fs_defrag_report - Outcome of a defragmentation pass
+ * @score_before: Fragmentation score before the pass
+ * @score_after: Fragmentation score after the pass
+ * @free_runs_before: Number of runs of free blocks before the pass
+ * @free_runs_after: Number of runs of free blocks after the pass
+ * @blocks_moved: Number of data blocks copied to a new location
+ *
+ * The fragmentation score is the share of FAT links that don't lead to the
+ * next block on disk: 0 when every chain is contiguous and ascending, 1 when
+ * no two consecutive blocks of a file are adjacent.
+ */
+struct fs_defrag_report {
+	double score_before;
+	double score_after;
+	uint64_t free_runs_before;
+	uint64_t free_runs_after;
+	uint64_t blocks_moved;
+};
+
+/**
+ * fs_defrag - Defragment the mounted file system
+ * @opts: Budget of the pass, or NULL for none
+ * @report: Where to store the outcome of the pass
+ *
+ * Relocate data blocks so that the chain of every file and directory is
+ * contiguous and ascending, with the chains packed at the start of the data
+ * blocks and the free space gathered in a single run at the end. Blocks are
+ * copied before being unlinked and the metadata is committed as the pass
+ * goes, so the file system stays consistent if it is interrupted. Blocks
+ * allocated to no file, such as those of the journal, are left in place.
+ *
+ * A pass that runs out of budget leaves the file system partly defragmented;
+ * calling fs_defrag() again resumes the work.
+ *
+ * Return: -1 if no virtual disk is mounted, if the FAT has damaged chains (see
+ * fs_check()), if files share blocks (see fs_copy_range()), or in case of
+ * failure reading or writing the disk. 1 if the budget ran out before the pass
+ * was done. 0 otherwise.
+ */
+int fs_defrag(const struct fs_defrag_opts *opts, struct fs_defrag_report *report);
+
+/**
+ * fs_sync - Flush file system to disk
+ *
+ * Write back every dirty metadata block (FAT and root directory) and make the
+ * virtual disk durable with fdatasync(). When the background flusher is
+ * running, the request is handed over to it and the caller waits: concurrent
+ * callers are grouped so that a whole batch costs a single fdatasync().
+ *
+ * Return: -1 if no file system is mounted or if writing back fails. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_fsync - Flush a file to disk
+ * @fd: File descriptor
+ *
+ * Make the content and size of the file referenced by file descriptor @fd
+ * durable. Metadata is shared between files, so this amounts to fs_sync().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the flush fails. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_flusher_start - Start the background flusher
+ * @interval_ms: Write back dirty metadata at least every @interval_ms
+ * milliseconds (0 to only flush on threshold or sync requests)
+ * @dirty_threshold: Write back as soon as that many metadata blocks are dirty
+ * (0 to disable)
+ *
+ * Start a thread that writes dirty FAT and root directory blocks in the
+ * background and serves fs_sync()/fs_fsync() requests in batches. The flusher
+ * is stopped automatically by fs_umount().
+ *
+ * Return: -1 if no file system is mounted, if the flusher is already running or
+ * if the thread cannot be created. 0 otherwise.
+ */
+int fs_flusher_start(unsigned int interval_ms, unsigned int dirty_threshold);
+
+/**
+ * fs_flusher_stop - Stop the background flusher
+ *
+ * Perform a last write back and stop the background flusher thread.
+ *
+ * Return: -1 if the flusher is not running. 0 otherwise.
+ */
+int fs_flusher_stop(void);
+
+/**
+ * fs_journal_create - Add a metadata journal to the mounted file system
+ * @nblocks: Size of the journal in blocks
+ *
+ * Reserve @nblocks contiguous data blocks as a write-ahead journal for the FAT
+ * and the directories, and record it in the superblock. From then on, dirty
+ * metadata is committed to the journal in groups (by fs_sync(), the background
+ * flusher or fs_umount()) and checkpointed in place when the journal fills up
+ * or at unmount. fs_mount() replays committed transactions left by a crash.
+ *
+ * The journal must hold a transaction of every FAT and root directory block,
+ * that is at least that many blocks plus 3 (header, descriptor and commit).
+ *
+ * Return: -1 if no file system is mounted, if it already has a journal, if
+ * @nblocks is too small, or if there is no run of @nblocks free data blocks. 0
+ * otherwise.
+ */
+int fs_journal_create(unsigned int nblocks);
+
+/**
+ * struct fs_stats - Runtime performance counters
+ * @block_reads: Blocks read, by block_read() or block_readv()
+ * @block_writes: Blocks written, by block_write() or block_writev()
+ * @bytes_read: Bytes returned to callers by fs_read()
+ * @bytes_written: Bytes accepted from callers by fs_write()
+ * @fat_hops: FAT entries followed while walking file chains
+ * @alloc_scans: Calls into the free block allocator
+ * @alloc_entries_scanned: FAT entries inspected by the allocator
+ * @umount_flushed: Dirty metadata blocks written back to disk
+ * @syncs: Flushes of the virtual disk to stable storage
+ * @sync_requests: fs_sync() and fs_fsync() calls
+ * @journal_commits: Transactions committed to the metadata journal
+ * @journal_checkpoints: Times the journal was written back in place
+ * @journal_replayed: Transactions replayed from the journal at mount time
+ * @cache_hits: Metadata block lookups served from memory
+ * @cache_misses: Metadata block lookups that had to go to disk
+ * @dentry_hits: Subdirectory name lookups served by the lookup cache
+ * @dentry_misses: Subdirectory name lookups that had to probe the directory
+ * @blocks_discarded: Blocks released on the host by block_discard()
+ * @bytes_spliced: Bytes block_send() wrote to the host without a bounce buffer
+ *
+ * Counters are always on and cumulative since program start or the last
+ * fs_reset_stats(), across mounts.
+ */
+struct fs_stats {
+	uint64_t block_reads;
+	uint64_t block_writes;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t fat_hops;
+	uint64_t alloc_scans;
+	uint64_t alloc_entries_scanned;
+	uint64_t umount_flushed;
+	uint64_t syncs;
+	uint64_t sync_requests;
+	uint64_t journal_commits;
+	uint64_t journal_checkpoints;
+	uint64_t journal_replayed;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t dentry_hits;
+	uint64_t dentry_misses;
+	uint64_t blocks_discarded;
+	uint64_t bytes_spliced;
+};
+
+/** fs_format() flag: 32-bit FAT entries and block numbers, for large disks */
+#define FS_FORMAT_WIDE 0x1
+
+/**
+ * struct fs_format_opts - File system layout options
+ * @block_size: Size of a block in bytes, 0 for %BLOCK_SIZE
+ * @dir_entries: Root directory capacity in files, 0 for %FS_FILE_MAX_COUNT
+ * @flags: Format flags (%FS_FORMAT_WIDE)
+ */
+struct fs_format_opts {
+	size_t block_size;
+	size_t dir_entries;
+	int flags;
+};
+
+/**
+ * fs_format - Create a new file system
+ * @diskname: Name of the virtual disk file to create
+ * @data_blocks: Number of data blocks
+ * @opts: Layout options, or NULL for the defaults
+ *
+ * Create virtual disk file @diskname, large enough to hold a superblock, the
+ * FAT, the root directory and @data_blocks data blocks, and write an empty
+ * file system on it. By default the legacy format is used (16-bit FAT, up to
+ * about 65K blocks). With %FS_FORMAT_WIDE, the FAT and block numbers are
+ * 32-bit wide, which lifts that limit. Both formats are recognized by
+ * fs_mount() through the superblock signature.
+ *
+ * Only the superblock and the first FAT block are written. The rest of the
+ * FAT, the root directory and the data blocks are left as holes of the sparse
+ * disk file, so formatting takes the same time and host disk space whatever
+ * the size of the file system.
+ *
+ * The block size must be a power of two between %BLOCK_SIZE and
+ * %BLOCK_SIZE_MAX. Larger blocks mean shorter FAT chains and fewer, larger
+ * disk transfers, at the cost of more slack at the end of each file. The root
+ * directory capacity is rounded up to whole blocks of 32-byte entries. Only
+ * the wide superblock records the block size and a root directory of more
+ * than one block, so asking for either implies %FS_FORMAT_WIDE.
+ *
+ * Return: -1 if @diskname or the block size is invalid, if @data_blocks does
+ * not fit the requested format, if a file system is currently mounted, or if
+ * the virtual disk cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks,
+	      const struct fs_format_opts *opts);
+
+/**
+ * fs_format_max_blocks - Get the largest file system fs_format() can create
+ * @opts: Layout options, or NULL for the defaults
+ *
+ * Return: the largest number of data blocks that fits the format that @opts
+ * select, or 0 if @opts are invalid.
+ */
+size_t fs_format_max_blocks(const struct fs_format_opts *opts);
+
+/**
+ * fs_export - Stream the mounted file system to a host file
+ * @fd: Host file descriptor to write to, such as a file, pipe or socket
+ *
+ * Commit the metadata in place, then write to @fd a compact copy of the
+ * image: the superblock, the FAT, the root directory and the allocated data
+ * blocks, read in disk order in large runs. Free blocks are left out, so the
+ * size of the stream follows the space in use rather than the capacity of the
+ * disk.
+ *
+ * Return: -1 if no virtual disk is mounted, if @fd is invalid, or in case of
+ * failure reading the disk or writing to @fd. 0 otherwise.
+ */
+int fs_export(int fd);
+
+/** fs_import() flag: defragment the image once it is rebuilt */
+#define FS_IMPORT_DEFRAG 0x1
+
+/**
+ * fs_import - Rebuild an image from an exported stream
+ * @fd: Host file descriptor to read the stream from
+ * @diskname: Name of the virtual disk file to create
+ * @flags: Import flags (%FS_IMPORT_DEFRAG)
+ *
+ * Create virtual disk file @diskname from a stream written by fs_export().
+ * Only the blocks present in the stream are written, the free blocks being
+ * left as holes of the sparse disk file. With %FS_IMPORT_DEFRAG, the image is
+ * then mounted and fs_defrag() is run on it, unless its files share blocks.
+ *
+ * Return: -1 if a file system is currently mounted, if the stream is invalid,
+ * truncated or corrupted, if the virtual disk cannot be created, or if the
+ * requested defragmentation fails. 0 otherwise.
+ */
+int fs_import(int fd, const char *diskname, int flags);
+
+/** fs_check() flag: fix the problems found, writing to the image */
+#define FS_CHECK_REPAIR 0x1
+/** fs_check() flag: print every problem found, with the path involved */
+#define FS_CHECK_VERBOSE 0x2
+
+/** Most threads fs_check() runs */
+#define FS_CHECK_THREADS_MAX 64
+
+/**
+ * struct fs_check_report - Outcome of a consistency check
+ * @files: Files found in the directory tree
+ * @dirs: Subdirectories found in the directory tree
+ * @free_blocks: Free data blocks, once repaired if asked to
+ * @bad_fat_entries: FAT entries pointing outside of the data blocks
+ * @bad_entries: Directory entries whose first block is out of range
+ * @cycles: Chains looping back onto one of their own blocks
+ * @cross_links: Chains running into a block that another chain owns
+ * @leaked_blocks: Allocated data blocks that no chain reaches
+ * @size_mismatches: Files whose size needs more blocks than their chain has
+ * @dir_errors: Subdirectories with a damaged header, size or entry count
+ * @journal_errors: Problems with the journal location or its reservation
+ * @journal_pending: Committed transactions that the next mount would replay
+ * @journal_replayed: Transactions replayed before a repair
+ * @repaired: Problems fixed
+ */
+struct fs_check_report {
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t free_blocks;
+	uint64_t bad_fat_entries;
+	uint64_t bad_entries;
+	uint64_t cycles;
+	uint64_t cross_links;
+	uint64_t leaked_blocks;
+	uint64_t size_mismatches;
+	uint64_t dir_errors;
+	uint64_t journal_errors;
+	uint64_t journal_pending;
+	uint64_t journal_replayed;
+	uint64_t repaired;
+};
+
+/**
+ * fs_check - Check the consistency of an unmounted file system
+ * @diskname: Name of the virtual disk file
+ * @nthreads: Threads to use, 0 for one per online CPU
+ * @flags: Check flags (%FS_CHECK_REPAIR, %FS_CHECK_VERBOSE)
+ * @report: Filled with what was found
+ *
+ * Verify the superblock, validate every FAT entry, then walk the chain of every
+ * file and directory reachable from the root directory, and the journal's,
+ * looking for cycles, cross-links, leaked blocks and files too large for their
+ * chain. The first block of an entry must be a data block, or the end of chain
+ * marker of an empty file. The FAT is validated and the chains are walked by @nthreads threads.
+ *
+ * With %FS_CHECK_REPAIR, committed journal transactions are replayed first.
+ * Chains are then cut where they loop or run into a block owned by a chain
+ * seen earlier (directories before files), sizes are shrunk to fit, entries
+ * without a usable first block are removed and leaked blocks are freed. Leaked
+ * blocks are left alone when a directory could not be read in full. Without
+ * it, the image is only read.
+ *
+ * Return: -1 if a file system is currently mounted, if @diskname cannot be
+ * opened, if its superblock is invalid, or if the check cannot complete.
+ * Otherwise, the number of problems found, repaired or not.
+ */
+int fs_check(const char *diskname, unsigned int nthreads, int flags,
+	     struct fs_check_report *report);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,6 +481,11 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * @diskname can also name another backend than a host file: "ram:<name>" for a
+ * disk in memory, created with fs_format() by the same process, "mmap:<path>"
+ * for a host file mapped in memory, and "sim:<diskname>" for disk <diskname>
+ * slowed down as set with block_sim_config() (see disk.h).
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -47,24 +513,25 @@ int fs_info(void);
 
 /**
  * fs_create - Create a new file
- * @filename: File name
+ * @filename: File path
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file at path @filename of the mounted file system.
+ * Paths are made of names separated by '/', resolved from the root directory
+ * whether or not they start with '/'; "." and ".." are understood. Each name,
+ * the last one included, cannot exceed %FS_FILENAME_LEN characters (including
+ * the NULL character).
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if a name of @filename is too long, or if its directory is full. 0
+ * otherwise.
  */
 int fs_create(const char *filename);
 
 /**
  * fs_delete - Delete a file
- * @filename: File name
+ * @filename: File path
  *
- * Delete the file named @filename from the root directory of the mounted file
+ * Delete the file at path @filename (see fs_create()) of the mounted file
  * system.
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
@@ -83,22 +550,183 @@ int fs_ls(void);
 
 /**
  * fs_open - Open a file
- * @filename: File name
+ * @filename: File path
  *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * Open the file at path @filename (see fs_create()) for reading and writing,
+ * and return the corresponding file descriptor. The file descriptor is a
+ * non-negative integer that is used subsequently to access the contents of the
+ * file. The file offset of the file descriptor is set to 0 initially
+ * (beginning of the file). If the same file is opened multiple files,
+ * fs_open() must return distinct file descriptors. A maximum of
+ * %FS_OPEN_MAX_COUNT files, or the limit set with fs_set_open_max(), can be
+ * open simultaneously.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the maximum number of files are already open. Otherwise, return the
+ * file descriptor.
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_mkdir - Create a directory
+ * @path: Directory path
+ *
+ * Create a new and empty directory at path @path (see fs_create()). Directories
+ * are stored as hashed tables of entries that grow as they fill up, so lookups
+ * stay fast however many files a directory holds.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @path is invalid or
+ * already exists, or if there is no room left for the directory. 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @path: Directory path
+ *
+ * Return: -1 if no underlying virtual disk was opened, if there is no
+ * directory at path @path, or if it is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *path);
+
+/**
+ * fs_rename - Rename or move a file or a directory
+ * @oldpath: Current path
+ * @newpath: New path
+ *
+ * Move the entry at path @oldpath to path @newpath, possibly in another
+ * directory. File descriptors open on a moved file stay valid.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if there is nothing at
+ * path @oldpath, if something other than the entry itself is at path
+ * @newpath, if a directory would be moved below itself, or if the destination
+ * directory is full. 0 otherwise.
+ */
+int fs_rename(const char *oldpath, const char *newpath);
+
+/**
+ * fs_lsdir - List the files of a directory
+ * @path: Directory path, "/" for the root directory
+ *
+ * Return: -1 if no underlying virtual disk was opened or if there is no
+ * directory at path @path. 0 otherwise.
+ */
+int fs_lsdir(const char *path);
+
+/**
+ * struct fs_dirent - Directory entry
+ * @name: Name of the entry, NULL-terminated
+ * @size: Size of the file in bytes (for a directory, of its entry table)
+ * @first_block: First data block of the entry
+ * @is_dir: Non-zero for a directory
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	uint32_t size;
+	uint32_t first_block;
+	int is_dir;
+};
+
+/**
+ * fs_readdir - Read entries of a directory
+ * @path: Directory path, "/" for the root directory
+ * @pos: Position in the directory, 0 to start from its beginning
+ * @ents: Array filled with entries
+ * @max: Size of @ents
+ *
+ * Fill @ents with the next entries of directory @path, starting at position
+ * @pos, and move @pos past them. Iterating until fs_readdir() returns 0 lists
+ * the whole directory without allocating anything, provided it doesn't change
+ * in between. Entries created meanwhile may or may not be listed.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if there is no
+ * directory at path @path or if an argument is invalid. Otherwise return the
+ * number of entries stored in @ents, 0 once the directory is exhausted.
+ */
+int fs_readdir(const char *path, uint64_t *pos, struct fs_dirent *ents,
+	       int max);
+
+/**
+ * fs_stat_many - Get the entries of several files at once
+ * @paths: Paths of the files
+ * @count: Number of paths in @paths
+ * @ents: Array of @count entries, filled in the order of @paths
+ *
+ * An entry whose path doesn't exist is zeroed, its name being empty.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if an argument is
+ * invalid. Otherwise return the number of paths found.
+ */
+int fs_stat_many(const char **paths, int count, struct fs_dirent *ents);
+
+/** Free runs are counted per power of two of their length, in blocks */
+#define FS_LAYOUT_HIST_BUCKETS 32
+
+/**
+ * struct fs_layout_report - Layout of the data blocks
+ * @data_blocks: Number of data blocks
+ * @used_blocks: Number of allocated data blocks
+ * @free_blocks: Number of free data blocks
+ * @free_runs: Number of runs of contiguous free blocks
+ * @largest_free: Length of the largest free run, in blocks
+ * @largest_free_start: First block of the largest free run
+ * @free_hist: Free runs of [2^i, 2^(i+1)) blocks are counted in @free_hist[i]
+ * @score: Fragmentation score, as reported by fs_defrag()
+ */
+struct fs_layout_report {
+	uint64_t data_blocks;
+	uint64_t used_blocks;
+	uint64_t free_blocks;
+	uint64_t free_runs;
+	uint64_t largest_free;
+	uint64_t largest_free_start;
+	uint64_t free_hist[FS_LAYOUT_HIST_BUCKETS];
+	double score;
+};
+
+/**
+ * struct fs_layout_file - Layout of one file
+ * @name: Name of the entry, NULL-terminated
+ * @size: Size of the file in bytes
+ * @is_dir: Non-zero for a directory
+ * @blocks: Number of data blocks in the file's chain
+ * @extents: Number of runs of contiguous blocks in the chain
+ * @avg_run: Average length of those runs, in blocks
+ * @largest_gap: Largest distance, in blocks, between the end of a run and the
+ * start of the next one
+ */
+struct fs_layout_file {
+	char name[FS_FILENAME_LEN];
+	uint32_t size;
+	int is_dir;
+	uint32_t blocks;
+	uint32_t extents;
+	double avg_run;
+	uint32_t largest_gap;
+};
+
+/**
+ * fs_layout - Report how data is laid out on disk
+ * @path: Directory whose files are reported, "/" for the root directory
+ * @layout: Filled with figures about the whole disk
+ * @files: Array filled with the layout of the entries of @path
+ * @max: Size of @files
+ * @map: Buffer receiving a block map, or NULL
+ * @map_len: Size of @map, including the terminating NULL byte
+ *
+ * The figures of @layout and the block map come out of a single pass over the
+ * FAT. Each character of the map covers an equal slice of the data blocks: '.'
+ * when they are all free, ':' when some of them are, '#' when none is, and 'x'
+ * when the chain of some file jumps away from one of them.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if there is no
+ * directory at path @path or if an argument is invalid. Otherwise return the
+ * number of entries in directory @path, of which only the first @max are
+ * stored in @files.
+ */
+int fs_layout(const char *path, struct fs_layout_report *layout,
+	      struct fs_layout_file *files, int max, char *map, size_t map_len);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
@@ -151,6 +779,8 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * The file offset of the file descriptor is implicitly incremented by the
+ * number of bytes that were actually written.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
@@ -177,4 +807,352 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: Offset in the file to write at
+ *
+ * Like fs_write(), but write at @offset and leave the file offset of the file
+ * descriptor alone. Threads sharing @fd can therefore call fs_pwrite() and
+ * fs_pread() concurrently without coordinating around fs_lseek().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or if @offset is past the end of the file. Otherwise return the number
+ * of bytes actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: Offset in the file to read from
+ *
+ * Like fs_read(), but read from @offset and leave the file offset of the file
+ * descriptor alone (see fs_pwrite()). Only looking the blocks of the range up
+ * is serialized with the other calls: concurrent reads overlap their I/O.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read, 0 if @offset is
+ * at or past the end of the file.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/** Maximum number of threads of the asynchronous request worker pool */
+#define FS_AIO_WORKERS_MAX 64
+
+/**
+ * struct fs_aiocb - Asynchronous request
+ * @fd: File descriptor
+ * @buf: Data buffer to read into or to write from
+ * @count: Number of bytes to read or write
+ * @offset: Offset in the file (requests leave the file offset alone)
+ * @callback: Function called on completion, from a worker thread; if NULL the
+ * completed request is queued for fs_aio_poll() instead
+ * @arg: Caller data, left untouched
+ * @result: Once completed, what fs_pread(), fs_pwrite() or fs_fsync() returned
+ *
+ * A request is owned by libfs from its submission until it is handed back, to
+ * @callback or by fs_aio_poll(), and must stay valid in between.
+ */
+struct fs_aiocb {
+	int fd;
+	void *buf;
+	size_t count;
+	size_t offset;
+	void (*callback)(struct fs_aiocb *cb);
+	void *arg;
+	int result;
+	/* private */
+	int op;
+	struct fs_aiocb *next;
+};
+
+/**
+ * fs_aio_start - Start the asynchronous request worker pool
+ * @nworkers: Number of worker threads
+ *
+ * Requests are served by a pool of @nworkers threads, so that submitting one
+ * never blocks the caller. The pool is independent of mounts: requests issued
+ * while nothing is mounted complete with a result of -1.
+ *
+ * Return: -1 if @nworkers is 0 or larger than %FS_AIO_WORKERS_MAX, if the pool
+ * is already running or if its threads cannot be created. 0 otherwise.
+ */
+int fs_aio_start(unsigned int nworkers);
+
+/**
+ * fs_aio_stop - Stop the asynchronous request worker pool
+ *
+ * Wait for every submitted request to complete, then stop the worker threads.
+ * Completed requests not polled yet can still be collected by fs_aio_poll().
+ *
+ * Return: -1 if the pool is not running. 0 otherwise.
+ */
+int fs_aio_stop(void);
+
+/**
+ * fs_read_async - Submit an asynchronous positional read
+ * @cb: Request (see fs_pread())
+ *
+ * Return: -1 if @cb is NULL or if the worker pool is not running. 0 otherwise.
+ */
+int fs_read_async(struct fs_aiocb *cb);
+
+/**
+ * fs_write_async - Submit an asynchronous positional write
+ * @cb: Request (see fs_pwrite())
+ *
+ * Return: -1 if @cb is NULL or if the worker pool is not running. 0 otherwise.
+ */
+int fs_write_async(struct fs_aiocb *cb);
+
+/**
+ * fs_fsync_async - Submit an asynchronous fs_fsync()
+ * @cb: Request, of which only @fd, @callback and @arg are used
+ *
+ * Return: -1 if @cb is NULL or if the worker pool is not running. 0 otherwise.
+ */
+int fs_fsync_async(struct fs_aiocb *cb);
+
+/**
+ * fs_aio_poll - Collect completed requests
+ * @done: Array filled with completed requests, in completion order
+ * @max: Size of @done
+ * @timeout_ms: Milliseconds to wait for a first completion, 0 not to wait and
+ * -1 to wait as long as requests are in flight
+ *
+ * Only requests submitted without a callback are collected this way.
+ *
+ * Return: -1 if @done is NULL or @max is not positive. Otherwise return the
+ * number of requests stored in @done.
+ */
+int fs_aio_poll(struct fs_aiocb **done, int max, int timeout_ms);
+
+/**
+ * fs_aio_eventfd - Get the completion event file descriptor
+ *
+ * The returned eventfd becomes readable whenever completed requests are
+ * waiting for fs_aio_poll(), so that an event loop can watch it along with
+ * its other file descriptors. fs_aio_poll() resets it.
+ *
+ * Return: -1 if the worker pool is not running. Otherwise return the file
+ * descriptor, which is owned by libfs.
+ */
+int fs_aio_eventfd(void);
+
+/** Maximum number of buffers of a vectored read or write */
+#define FS_IOV_MAX 1024
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers holding the data to write, in order
+ * @iovcnt: Number of buffers in @iov, at most %FS_IOV_MAX
+ *
+ * Like fs_write(), for the data of all the buffers of @iov one after the
+ * other. The buffers are written in a single pass over the file, and whole
+ * blocks go to disk straight from them, with physically consecutive blocks
+ * transferred in one vectored disk write.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or if @iovcnt is out of range. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to fill, in order
+ * @iovcnt: Number of buffers in @iov, at most %FS_IOV_MAX
+ *
+ * Like fs_read(), filling the buffers of @iov one after the other (see
+ * fs_writev()).
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or if @iovcnt is out of range. Otherwise return the number of bytes
+ * actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pwritev - Write to a file from several buffers at a given offset
+ * @fd: File descriptor
+ * @iov: Buffers holding the data to write, in order
+ * @iovcnt: Number of buffers in @iov, at most %FS_IOV_MAX
+ * @offset: Offset in the file to write at
+ *
+ * Like fs_writev(), at @offset and leaving the file offset of the file
+ * descriptor alone (see fs_pwrite()).
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iovcnt is out of range or if @offset is past the end of the
+ * file. Otherwise return the number of bytes actually written.
+ */
+int fs_pwritev(int fd, const struct iovec *iov, int iovcnt, size_t offset);
+
+/**
+ * fs_preadv - Read from a file into several buffers at a given offset
+ * @fd: File descriptor
+ * @iov: Buffers to fill, in order
+ * @iovcnt: Number of buffers in @iov, at most %FS_IOV_MAX
+ * @offset: Offset in the file to read from
+ *
+ * Like fs_readv(), from @offset and leaving the file offset of the file
+ * descriptor alone (see fs_pwrite()).
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or if @iovcnt is out of range. Otherwise return the number of bytes
+ * actually read, 0 if @offset is at or past the end of the file.
+ */
+int fs_preadv(int fd, const struct iovec *iov, int iovcnt, size_t offset);
+
+/**
+ * fs_sendfile - Copy data from a file to a host file descriptor
+ * @out_fd: Host file descriptor to write to
+ * @fd: File descriptor
+ * @offset: Offset in the file to read from, or NULL
+ * @count: Number of bytes of data to be copied
+ *
+ * Write up to @count bytes of the file referenced by file descriptor @fd to
+ * host file descriptor @out_fd, at its current file offset. As with
+ * sendfile(2), the data is read from *@offset, which is then moved past what
+ * was copied, or from the file offset of @fd, which is then moved instead, if
+ * @offset is NULL. Each run of consecutive data blocks is handed to the host
+ * kernel, which copies it without it going through user space when it can,
+ * so memory use doesn't depend on @count.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if nothing could be written to @out_fd. Otherwise return the
+ * number of bytes actually copied, 0 if the offset is at or past the end of
+ * the file.
+ */
+int fs_sendfile(int out_fd, int fd, size_t *offset, size_t count);
+
+/**
+ * fs_get_stats - Get performance counters
+ * @stats: Structure to be filled with the current counter values
+ *
+ * Take a snapshot of the library's runtime performance counters. Can be called
+ * whether or not a file system is currently mounted.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_get_stats(struct fs_stats *stats);
+
+/**
+ * fs_reset_stats - Reset performance counters
+ *
+ * Set all the counters reported by fs_get_stats() back to zero.
+ */
+void fs_reset_stats(void);
+
+/**
+ * enum fs_op - Operations timed by the latency histograms
+ */
+enum fs_op {
+	FS_OP_MOUNT,
+	FS_OP_UMOUNT,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_OPEN,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_OP_BLOCK_READ,
+	FS_OP_BLOCK_WRITE,
+	FS_OP_COUNT
+};
+
+/** Each power of two is split in 2^%FS_HIST_SUB_BITS buckets (~6% precision) */
+#define FS_HIST_SUB_BITS 4
+#define FS_HIST_SUB_COUNT (1 << FS_HIST_SUB_BITS)
+
+/** Samples are clamped to 2^%FS_HIST_MAX_BITS ns (about 18 minutes) */
+#define FS_HIST_MAX_BITS 40
+
+/** Number of buckets in a latency histogram */
+#define FS_HIST_BUCKETS \
+	((FS_HIST_MAX_BITS - FS_HIST_SUB_BITS + 1) * FS_HIST_SUB_COUNT)
+
+/**
+ * struct fs_hist - Log-bucketed latency histogram
+ * @count: Number of samples
+ * @sum_ns: Sum of all samples, in nanoseconds
+ * @min_ns: Smallest sample
+ * @max_ns: Largest sample
+ * @buckets: Sample count per bucket
+ */
+struct fs_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t buckets[FS_HIST_BUCKETS];
+};
+
+/**
+ * fs_latency_enable - Switch latency collection on or off
+ * @enable: Non-zero to start timing operations, zero to stop
+ *
+ * Collection is off by default. While off, timed operations only pay for one
+ * relaxed load and a branch. Samples are kept in per-thread shards so that
+ * recording threads never contend with each other.
+ */
+void fs_latency_enable(int enable);
+
+/**
+ * fs_latency_snapshot - Get the latency histogram of an operation
+ * @op: Operation
+ * @hist: Histogram to be filled
+ *
+ * Merge the shards of every thread that recorded @op into @hist.
+ *
+ * Return: -1 if @op or @hist is invalid. 0 otherwise.
+ */
+int fs_latency_snapshot(enum fs_op op, struct fs_hist *hist);
+
+/**
+ * fs_latency_reset - Drop all recorded latency samples
+ */
+void fs_latency_reset(void);
+
+/**
+ * fs_hist_merge - Merge two histograms
+ * @dst: Histogram to accumulate into
+ * @src: Histogram to add to @dst
+ */
+void fs_hist_merge(struct fs_hist *dst, const struct fs_hist *src);
+
+/**
+ * fs_hist_percentile - Get a percentile out of a histogram
+ * @hist: Histogram
+ * @pct: Percentile, between 0 and 100 (e.g. 99.9)
+ *
+ * Return: the upper bound, in nanoseconds, of the bucket holding the requested
+ * percentile, or 0 if @hist is empty.
+ */
+uint64_t fs_hist_percentile(const struct fs_hist *hist, double pct);
+
+/**
+ * fs_op_name - Get the printable name of an operation
+ * @op: Operation
+ *
+ * Return: NULL if @op is invalid, the name of the operation otherwise.
+ */
+const char *fs_op_name(enum fs_op op);
+
+/**
+ * fs_latency_print - Display latency percentiles
+ *
+ * Display the sample count, p50, p99, p999 and maximum latency of every
+ * operation that recorded at least one sample.
+ *
+ * Return: -1 if memory for the snapshot cannot be allocated. 0 otherwise.
+ */
+int fs_latency_print(void);
+
 #endif /* _FS_H */
@@ -0,0 +1,300 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "latency.h"
+#include "probes.h"
+
+/* Per-thread set of histograms, one per operation */
+struct lat_shard {
+	struct fs_hist hist[FS_OP_COUNT];
+	struct lat_shard *next;
+};
+
+int lat_enabled;
+
+/* Shards of the live threads, so that snapshots can merge them */
+static struct lat_shard *shards;
+/* Samples of the threads that exited, folded in when their shard was freed */
+static struct fs_hist retired[FS_OP_COUNT];
+static pthread_mutex_t shardsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Shard owned by the calling thread (allocated on its first sample) */
+static __thread struct lat_shard *myShard;
+/* Key whose destructor retires the shard of an exiting thread */
+static pthread_key_t shardKey;
+static int shardKeyValid;
+static pthread_once_t shardKeyOnce = PTHREAD_ONCE_INIT;
+
+static const char *opNames[FS_OP_COUNT] = {
+	[FS_OP_MOUNT]       = "fs_mount",
+	[FS_OP_UMOUNT]      = "fs_umount",
+	[FS_OP_CREATE]      = "fs_create",
+	[FS_OP_DELETE]      = "fs_delete",
+	[FS_OP_OPEN]        = "fs_open",
+	[FS_OP_READ]        = "fs_read",
+	[FS_OP_WRITE]       = "fs_write",
+	[FS_OP_BLOCK_READ]  = "block_read",
+	[FS_OP_BLOCK_WRITE] = "block_write",
+};
+
+uint64_t lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//map a value to its log-linear bucket: values below FS_HIST_SUB_COUNT are
+//exact, above that each power of two is split in FS_HIST_SUB_COUNT buckets
+static int hist_bucket(uint64_t ns)
+{
+	if (ns < FS_HIST_SUB_COUNT)
+		return ns;
+	if (ns >> FS_HIST_MAX_BITS)
+		ns = (1ULL << FS_HIST_MAX_BITS) - 1;
+
+	int msb = 63 - __builtin_clzll(ns);
+	int shift = msb - FS_HIST_SUB_BITS;
+
+	return (shift + 1) * FS_HIST_SUB_COUNT
+		+ ((ns >> shift) & (FS_HIST_SUB_COUNT - 1));
+}
+
+//highest value that falls into bucket @idx
+static uint64_t hist_bucket_value(int idx)
+{
+	if (idx < FS_HIST_SUB_COUNT)
+		return idx;
+
+	int shift = idx / FS_HIST_SUB_COUNT - 1;
+	uint64_t sub = idx % FS_HIST_SUB_COUNT;
+
+	return ((FS_HIST_SUB_COUNT | sub) << shift) + (1ULL << shift) - 1;
+}
+
+static void hist_merge(struct fs_hist *dst, const struct fs_hist *src)
+{
+	uint64_t count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	if (count == 0)
+		return;
+
+	uint64_t min = __atomic_load_n(&src->min_ns, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+
+	if (dst->count == 0 || min < dst->min_ns)
+		dst->min_ns = min;
+	if (max > dst->max_ns)
+		dst->max_ns = max;
+	dst->count += count;
+	dst->sum_ns += __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < FS_HIST_BUCKETS; i++)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i],
+						   __ATOMIC_RELAXED);
+}
+
+//fold the samples of an exiting thread into the retired totals, and free its
+//shard
+static void retire_shard(void *arg)
+{
+	struct lat_shard *shard = arg;
+
+	pthread_mutex_lock(&shardsLock);
+	for (struct lat_shard **s = &shards; *s; s = &(*s)->next) {
+		if (*s == shard) {
+			*s = shard->next;
+			break;
+		}
+	}
+	for (int op = 0; op < FS_OP_COUNT; op++)
+		hist_merge(&retired[op], &shard->hist[op]);
+	pthread_mutex_unlock(&shardsLock);
+
+	myShard = NULL;
+	free(shard);
+}
+
+static void create_shard_key(void)
+{
+	shardKeyValid = pthread_key_create(&shardKey, retire_shard) == 0;
+}
+
+static struct lat_shard *get_shard(void)
+{
+	if (myShard)
+		return myShard;
+
+	struct lat_shard *shard = calloc(1, sizeof(struct lat_shard));
+	if (!shard)
+		return NULL;
+
+	//without the key, the shard simply lives as long as the process
+	pthread_once(&shardKeyOnce, create_shard_key);
+	if (shardKeyValid)
+		pthread_setspecific(shardKey, shard);
+
+	pthread_mutex_lock(&shardsLock);
+	shard->next = shards;
+	shards = shard;
+	pthread_mutex_unlock(&shardsLock);
+
+	myShard = shard;
+	return shard;
+}
+
+//only the owning thread writes to a shard, so plain load/store pairs are
+//enough; they are atomic so that a concurrent snapshot never sees a torn value
+#define shard_add(field, n) \
+	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void lat_add(enum fs_op op, uint64_t ns)
+{
+	struct lat_shard *shard = get_shard();
+	if (!shard)
+		return;
+
+	struct fs_hist *h = &shard->hist[op];
+
+	shard_add(h->buckets[hist_bucket(ns)], 1);
+	shard_add(h->sum_ns, ns);
+	if (h->count == 0 || ns < h->min_ns)
+		__atomic_store_n(&h->min_ns, ns, __ATOMIC_RELAXED);
+	if (ns > h->max_ns)
+		__atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+	shard_add(h->count, 1);
+}
+
+static int lat_snapshot(enum fs_op op, struct fs_hist *hist)
+{
+	if (op < 0 || op >= FS_OP_COUNT || !hist)
+		return -1;
+
+	memset(hist, 0, sizeof(*hist));
+
+	pthread_mutex_lock(&shardsLock);
+	hist_merge(hist, &retired[op]);
+	for (struct lat_shard *s = shards; s; s = s->next)
+		hist_merge(hist, &s->hist[op]);
+	pthread_mutex_unlock(&shardsLock);
+
+	return 0;
+}
+
+static void lat_reset(void)
+{
+	pthread_mutex_lock(&shardsLock);
+	memset(retired, 0, sizeof(retired));
+	for (struct lat_shard *s = shards; s; s = s->next)
+		memset(s->hist, 0, sizeof(s->hist));
+	pthread_mutex_unlock(&shardsLock);
+}
+
+static uint64_t hist_percentile(const struct fs_hist *hist, double pct)
+{
+	if (!hist || hist->count == 0)
+		return 0;
+
+	//rank of the sample we are looking for, 1-based
+	uint64_t rank = (uint64_t)(pct / 100.0 * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < FS_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			uint64_t value = hist_bucket_value(i);
+			return value > hist->max_ns ? hist->max_ns : value;
+		}
+	}
+	return hist->max_ns;
+}
+
+static int lat_print(void)
+{
+	struct fs_hist *hist = malloc(sizeof(struct fs_hist));
+	if (!hist)
+		return -1;
+
+	printf("FS Latency (ns):\n");
+	printf("%-12s %10s %10s %10s %10s %10s\n", "op", "count", "p50", "p99",
+	       "p999", "max");
+	for (int op = 0; op < FS_OP_COUNT; op++) {
+		lat_snapshot(op, hist);
+		if (hist->count == 0)
+			continue;
+		printf("%-12s %10llu %10llu %10llu %10llu %10llu\n", opNames[op],
+		       (unsigned long long)hist->count,
+		       (unsigned long long)hist_percentile(hist, 50.0),
+		       (unsigned long long)hist_percentile(hist, 99.0),
+		       (unsigned long long)hist_percentile(hist, 99.9),
+		       (unsigned long long)hist->max_ns);
+	}
+
+	free(hist);
+	return 0;
+}
+
+/*
+ * Public entry points, each firing a libfs:<name>_entry/<name>_return probe
+ * pair like the calls of fs.c
+ */
+
+void fs_latency_enable(int enable)
+{
+	FS_PROBE1(fs_latency_enable_entry, enable);
+	__atomic_store_n(&lat_enabled, enable != 0, __ATOMIC_RELAXED);
+	FS_PROBE(fs_latency_enable_return);
+}
+
+void fs_hist_merge(struct fs_hist *dst, const struct fs_hist *src)
+{
+	FS_PROBE2(fs_hist_merge_entry, (uintptr_t)dst, (uintptr_t)src);
+	hist_merge(dst, src);
+	FS_PROBE(fs_hist_merge_return);
+}
+
+int fs_latency_snapshot(enum fs_op op, struct fs_hist *hist)
+{
+	FS_PROBE2(fs_latency_snapshot_entry, op, (uintptr_t)hist);
+	int ret = lat_snapshot(op, hist);
+	FS_PROBE1(fs_latency_snapshot_return, ret);
+	return ret;
+}
+
+void fs_latency_reset(void)
+{
+	FS_PROBE(fs_latency_reset_entry);
+	lat_reset();
+	FS_PROBE(fs_latency_reset_return);
+}
+
+uint64_t fs_hist_percentile(const struct fs_hist *hist, double pct)
+{
+	/* Probe arguments are integers, which @pct is not */
+	FS_PROBE1(fs_hist_percentile_entry, (uintptr_t)hist);
+	uint64_t ret = hist_percentile(hist, pct);
+	FS_PROBE1(fs_hist_percentile_return, ret);
+	return ret;
+}
+
+const char *fs_op_name(enum fs_op op)
+{
+	FS_PROBE1(fs_op_name_entry, op);
+	const char *ret = (op < 0 || op >= FS_OP_COUNT) ? NULL : opNames[op];
+	FS_PROBE1(fs_op_name_return, (uintptr_t)ret);
+	return ret;
+}
+
+int fs_latency_print(void)
+{
+	FS_PROBE(fs_latency_print_entry);
+	int ret = lat_print();
+	FS_PROBE1(fs_latency_print_return, ret);
+	return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/* Non-zero while latency collection is switched on */
+extern int lat_enabled;
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t lat_now(void);
+
+/* Account one sample of @ns nanoseconds to @op in the calling thread's shard */
+void lat_add(enum fs_op op, uint64_t ns);
+
+/*
+ * lat_start - Timestamp the beginning of an operation
+ *
+ * Return: 0 when collection is off, so that a disabled build of the hot path
+ * costs a single relaxed load and a branch.
+ */
+static inline uint64_t lat_start(void)
+{
+	if (!__atomic_load_n(&lat_enabled, __ATOMIC_RELAXED))
+		return 0;
+	return lat_now();
+}
+
+/* Record the operation started at @start, if it was being timed */
+static inline void lat_record(enum fs_op op, uint64_t start)
+{
+	if (start)
+		lat_add(op, lat_now() - start);
+}
+
+#endif /* _LATENCY_H */
@@ -0,0 +1,113 @@
+/* MAP_HUGETLB and MADV_HUGEPAGE */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+/* Huge page size assumed when rounding the mapping */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static struct {
+	/* Mapping the buffers are carved from, NULL when there is no pool */
+	char *base;
+	size_t len;
+	size_t size;
+	size_t count;
+	/* Free buffers, as a stack */
+	void **free;
+	size_t nfree;
+} pool;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+int pool_init(size_t size, size_t count, int flags)
+{
+	size_t len, i;
+	char *base = MAP_FAILED;
+
+	pool_destroy();
+	if (!size || !count || size % BLOCK_ALIGN)
+		return -1;
+
+	len = size * count;
+	if (flags & POOL_HUGEPAGE) {
+		len = (len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+		base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	/* No reserved huge pages: transparent ones may still back it */
+	if (base == MAP_FAILED) {
+		base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+			return -1;
+		if (flags & POOL_HUGEPAGE)
+			madvise(base, len, MADV_HUGEPAGE);
+	}
+
+	pthread_mutex_lock(&poolLock);
+	pool.free = malloc(count * sizeof(void *));
+	if (!pool.free) {
+		pthread_mutex_unlock(&poolLock);
+		munmap(base, len);
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+		pool.free[i] = base + (count - 1 - i) * size;
+	pool.nfree = count;
+	pool.base = base;
+	pool.len = len;
+	pool.size = size;
+	pool.count = count;
+	pthread_mutex_unlock(&poolLock);
+
+	return 0;
+}
+
+void pool_destroy(void)
+{
+	pthread_mutex_lock(&poolLock);
+	if (pool.base)
+		munmap(pool.base, pool.len);
+	free(pool.free);
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_unlock(&poolLock);
+}
+
+void *pool_get(size_t size)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&poolLock);
+	if (size == pool.size && pool.nfree > 0)
+		buf = pool.free[--pool.nfree];
+	pthread_mutex_unlock(&poolLock);
+
+	if (!buf) {
+		size = (size + BLOCK_ALIGN - 1) & ~(size_t)(BLOCK_ALIGN - 1);
+		if (posix_memalign(&buf, BLOCK_ALIGN, size ? size : BLOCK_ALIGN))
+			return NULL;
+	}
+	memset(buf, 0, size);
+
+	return buf;
+}
+
+void pool_put(void *buf)
+{
+	char *p = buf;
+
+	pthread_mutex_lock(&poolLock);
+	if (pool.base && p >= pool.base
+	    && p < pool.base + pool.size * pool.count) {
+		pool.free[pool.nfree++] = p;
+		p = NULL;
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	free(p);
+}
@@ -0,0 +1,38 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+
+#include "disk.h"
+
+/* pool_init() flag: back the pool with huge pages when the host has some */
+#define POOL_HUGEPAGE 0x1
+
+/*
+ * pool_init - Set up the pool of block buffers
+ *
+ * Carve @count buffers of @size bytes, aligned on %BLOCK_ALIGN, out of a
+ * single mapping made once, so that the memory the buffers take is known up
+ * front. A pool set up before is destroyed first.
+ *
+ * Return: -1 if the mapping can't be made. 0 otherwise.
+ */
+int pool_init(size_t size, size_t count, int flags);
+
+/* Release the pool, whose buffers must all have been put back */
+void pool_destroy(void);
+
+/*
+ * pool_get - Get a zeroed buffer aligned on %BLOCK_ALIGN
+ *
+ * Buffers of the pool's size come from the pool, others and those asked for
+ * while the pool is empty are allocated on the side.
+ *
+ * Return: NULL if no memory is left.
+ */
+void *pool_get(size_t size);
+
+/* Give back a buffer from pool_get() (NULL is ignored) */
+void pool_put(void *buf);
+
+#endif /* _POOL_H */
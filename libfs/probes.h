@@ -0,0 +1,15 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+#include "sdt.h"
+
+/*
+ * Static tracepoints of the "libfs" provider, e.g.:
+ *   bpftrace -e 'usdt:./test_fs.x:libfs:block_read { @[arg0] = count(); }'
+ */
+#define FS_PROBE(name) STAP_PROBE(libfs, name)
+#define FS_PROBE1(name, a1) STAP_PROBE1(libfs, name, a1)
+#define FS_PROBE2(name, a1, a2) STAP_PROBE2(libfs, name, a1, a2)
+#define FS_PROBE3(name, a1, a2, a3) STAP_PROBE3(libfs, name, a1, a2, a3)
+
+#endif /* _PROBES_H */
@@ -0,0 +1,94 @@
+#ifndef _SDT_H
+#define _SDT_H
+
+/*
+ * Minimal, self-contained implementation of the SystemTap static probe (USDT)
+ * ABI, compatible with the .note.stapsdt records emitted by <sys/sdt.h>, so
+ * that perf, bpftrace and systemtap can attach to libfs without an external
+ * dependency.
+ *
+ * A probe site compiles to a single nop; the probe's address, provider, name
+ * and argument locations are recorded in a non-allocated ELF note. Arguments
+ * must be integers (cast pointers to uintptr_t).
+ *
+ * Define FS_NO_USDT to compile every probe to nothing.
+ */
+
+#if !defined(FS_NO_USDT) && defined(__GNUC__) && defined(__ELF__) && \
+	(defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+
+#ifdef __LP64__
+#define _SDT_ASM_ADDR ".8byte"
+#else
+#define _SDT_ASM_ADDR ".4byte"
+#endif
+
+/* Argument size as expected by the consumers: negative when signed */
+#define _SDT_SIGNED(x) ((__typeof__((x) + 0))-1 < 1)
+#define _SDT_SIZE(x) ((_SDT_SIGNED(x) ? 1 : -1) * (int)sizeof((x) + 0))
+
+#define _SDT_OP(n, x) [_sdt_s##n] "n" (_SDT_SIZE(x)), [_sdt_a##n] "nor" (x)
+#define _SDT_FMT(n) "%n[_sdt_s" #n "]@%[_sdt_a" #n "]"
+
+#define _SDT_NOTE(provider, name, args)					\
+	"990:	nop\n"							\
+	"	.pushsection .note.stapsdt,\"?\",\"note\"\n"		\
+	"	.balign 4\n"						\
+	"	.4byte 992f-991f,994f-993f,3\n"				\
+	"991:	.asciz \"stapsdt\"\n"					\
+	"992:	.balign 4\n"						\
+	"993:	" _SDT_ASM_ADDR " 990b\n"				\
+	"	" _SDT_ASM_ADDR " _.stapsdt.base\n"			\
+	"	" _SDT_ASM_ADDR " 0\n"					\
+	"	.asciz \"" #provider "\"\n"				\
+	"	.asciz \"" #name "\"\n"					\
+	"	.asciz \"" args "\"\n"					\
+	"994:	.balign 4\n"						\
+	"	.popsection\n"						\
+	"	.ifndef _.stapsdt.base\n"				\
+	"	.pushsection .stapsdt.base,\"aG\",\"progbits\","	\
+	".stapsdt.base,comdat\n"					\
+	"	.weak _.stapsdt.base\n"					\
+	"	.hidden _.stapsdt.base\n"				\
+	"_.stapsdt.base: .space 1\n"					\
+	"	.size _.stapsdt.base, 1\n"				\
+	"	.popsection\n"						\
+	"	.endif\n"
+
+#define STAP_PROBE(provider, name)					\
+	__asm__ __volatile__(_SDT_NOTE(provider, name, ""))
+
+#define STAP_PROBE1(provider, name, a1)					\
+	__asm__ __volatile__(_SDT_NOTE(provider, name, _SDT_FMT(1))	\
+			     :: _SDT_OP(1, a1))
+
+#define STAP_PROBE2(provider, name, a1, a2)				\
+	__asm__ __volatile__(_SDT_NOTE(provider, name,			\
+				       _SDT_FMT(1) " " _SDT_FMT(2))	\
+			     :: _SDT_OP(1, a1), _SDT_OP(2, a2))
+
+#define STAP_PROBE3(provider, name, a1, a2, a3)				\
+	__asm__ __volatile__(_SDT_NOTE(provider, name,			\
+				       _SDT_FMT(1) " " _SDT_FMT(2) " "	\
+				       _SDT_FMT(3))			\
+			     :: _SDT_OP(1, a1), _SDT_OP(2, a2),		\
+				_SDT_OP(3, a3))
+
+#define STAP_PROBE4(provider, name, a1, a2, a3, a4)			\
+	__asm__ __volatile__(_SDT_NOTE(provider, name,			\
+				       _SDT_FMT(1) " " _SDT_FMT(2) " "	\
+				       _SDT_FMT(3) " " _SDT_FMT(4))	\
+			     :: _SDT_OP(1, a1), _SDT_OP(2, a2),		\
+				_SDT_OP(3, a3), _SDT_OP(4, a4))
+
+#else /* FS_NO_USDT or unsupported target */
+
+#define STAP_PROBE(provider, name) do { } while (0)
+#define STAP_PROBE1(provider, name, a1) do { } while (0)
+#define STAP_PROBE2(provider, name, a1, a2) do { } while (0)
+#define STAP_PROBE3(provider, name, a1, a2, a3) do { } while (0)
+#define STAP_PROBE4(provider, name, a1, a2, a3, a4) do { } while (0)
+
+#endif
+
+#endif /* _SDT_H */
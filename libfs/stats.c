@@ -0,0 +1,38 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+#include "probes.h"
+#include "stats.h"
+
+struct fs_stats fs_counters;
+
+/* Number of 64-bit counters held in struct fs_stats */
+#define STATS_COUNT (sizeof(struct fs_stats) / sizeof(uint64_t))
+
+int fs_get_stats(struct fs_stats *stats)
+{
+	uint64_t *src = (uint64_t *)&fs_counters;
+	uint64_t *dst = (uint64_t *)stats;
+	int ret = -1;
+
+	FS_PROBE1(fs_get_stats_entry, (uintptr_t)stats);
+	if (stats) {
+		for (size_t i = 0; i < STATS_COUNT; i++)
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		ret = 0;
+	}
+	FS_PROBE1(fs_get_stats_return, ret);
+
+	return ret;
+}
+
+void fs_reset_stats(void)
+{
+	uint64_t *counters = (uint64_t *)&fs_counters;
+
+	FS_PROBE(fs_reset_stats_entry);
+	for (size_t i = 0; i < STATS_COUNT; i++)
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+	FS_PROBE(fs_reset_stats_return);
+}
@@ -0,0 +1,18 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "fs.h"
+
+/* Live counters, shared by the block and file system layers */
+extern struct fs_stats fs_counters;
+
+/*
+ * Counters are bumped with relaxed atomics: they never order other memory
+ * accesses, so the cost is a single locked add on the hot paths.
+ */
+#define stats_add(field, n) \
+	__atomic_fetch_add(&fs_counters.field, (n), __ATOMIC_RELAXED)
+
+#define stats_inc(field) stats_add(field, 1)
+
+#endif /* _STATS_H */
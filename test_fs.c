@@ -6,8 +6,10 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -77,12 +79,27 @@ void thread_fs_stat(void *arg)
 	printf("Size of file '%s' is %zu bytes\n", filename, stat);
 }
 
+/* Stream a whole file to a host file descriptor, in constant memory */
+static size_t send_file(int fs_fd, int fd, size_t size)
+{
+	size_t sent = 0;
+	int ret;
+
+	while (sent < size) {
+		ret = fs_sendfile(fd, fs_fd, NULL, size - sent);
+		if (ret <= 0)
+			break;
+		sent += ret;
+	}
+	return sent;
+}
+
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fs_fd;
-	size_t stat, read;
+	char *diskname, *filename;
+	int fs_fd, stat;
+	size_t sent;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -109,14 +126,64 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
+
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+
+	/* The content goes straight from the disk file to stdout */
+	sent = send_file(fs_fd, STDOUT_FILENO, stat);
+
+	if (fs_close(fs_fd)) {
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot close file");
 	}
 
-	read = fs_read(fs_fd, buf, stat);
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	if (sent < (size_t)stat)
+		die("Cannot read file (%zu/%d bytes)", sent, stat);
+}
+
+void thread_fs_get(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *hostname;
+	int fd, fs_fd, stat;
+	size_t sent;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename> [host filename]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	hostname = (t_arg->argc > 2) ? t_arg->argv[2] : filename;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	fd = open(hostname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fs_umount();
+		die_perror("open");
+	}
+
+	sent = send_file(fs_fd, fd, stat);
+	if (close(fd))
+		die_perror("close");
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -126,10 +193,11 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%zu/%zu bytes)\n", filename, read, stat);
-	printf("Content of the file:\n%s", buf);
+	if (sent < (size_t)stat)
+		die("Cannot read file (%zu/%d bytes)", sent, stat);
 
-	free(buf);
+	printf("Extracted file '%s' to '%s' (%zu bytes)\n", filename, hostname,
+	       sent);
 }
 
 void thread_fs_rm(void *arg)
@@ -239,6 +307,249 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <path>");
+
+	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(path)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", path);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <path>");
+
+	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(path)) {
+		fs_umount();
+		die("Cannot remove directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", path);
+}
+
+void thread_fs_mv(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *oldpath, *newpath;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <old path> <new path>");
+
+	diskname = t_arg->argv[0];
+	oldpath = t_arg->argv[1];
+	newpath = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rename(oldpath, newpath)) {
+		fs_umount();
+		die("Cannot rename '%s'", oldpath);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Renamed '%s' to '%s'\n", oldpath, newpath);
+}
+
+void thread_fs_cp(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+	int flags = 0, in, out, copied;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <source> <destination> [clone]");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+	if (t_arg->argc > 3 && !strcmp(t_arg->argv[3], "clone"))
+		flags |= FS_COPY_CLONE;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	in = fs_open(src);
+	if (in < 0 || fs_create(dst) || (out = fs_open(dst)) < 0) {
+		fs_umount();
+		die("Cannot open '%s' and create '%s'", src, dst);
+	}
+
+	copied = fs_copy_range(in, 0, out, 0, fs_stat(in), flags);
+	if (copied < 0) {
+		fs_umount();
+		die("Cannot copy '%s'", src);
+	}
+
+	fs_close(in);
+	fs_close(out);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("%s '%s' to '%s' (%d bytes)\n",
+	       (flags & FS_COPY_CLONE) ? "Cloned" : "Copied", src, dst, copied);
+}
+
+void thread_fs_lsdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <path>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_lsdir(t_arg->argv[1])) {
+		fs_umount();
+		die("Cannot list directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_du(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent ents[64];
+	char *diskname, *path = "/";
+	size_t files = 0, bytes = 0;
+	uint64_t pos = 0;
+	int i, n;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<path>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		path = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	while ((n = fs_readdir(path, &pos, ents, ARRAY_SIZE(ents))) > 0) {
+		for (i = 0; i < n; i++) {
+			printf("%10u %s%s\n", ents[i].size, ents[i].name,
+			       ents[i].is_dir ? "/" : "");
+			files++;
+			bytes += ents[i].size;
+		}
+	}
+	if (n < 0) {
+		fs_umount();
+		die("Cannot read directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("%zu bytes in %zu entries\n", bytes, files);
+}
+
+size_t get_argv(char *argv);
+
+void thread_fs_layout(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_layout_report rep;
+	struct fs_layout_file *files;
+	char *diskname, *path = "/", *map;
+	size_t width = 256, len;
+	int i, n;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<path>] [map=<width>]");
+
+	diskname = t_arg->argv[0];
+	for (i = 1; i < t_arg->argc; i++) {
+		if (!strncmp(t_arg->argv[i], "map=", 4))
+			width = get_argv(t_arg->argv[i] + 4);
+		else
+			path = t_arg->argv[i];
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* the first call only counts the entries */
+	n = fs_layout(path, &rep, NULL, 0, NULL, 0);
+	files = malloc((n > 0 ? n : 1) * sizeof(*files));
+	map = malloc(width + 1);
+	if (n < 0 || !files || !map
+	    || (n = fs_layout(path, &rep, files, n, map, width + 1)) < 0) {
+		fs_umount();
+		die("Cannot read layout");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("%10s %8s %8s %8s %8s  %s\n", "size", "blocks", "extents",
+	       "avg_run", "max_gap", "name");
+	for (i = 0; i < n; i++)
+		printf("%10u %8u %8u %8.1f %8u  %s%s\n", files[i].size,
+		       files[i].blocks, files[i].extents, files[i].avg_run,
+		       files[i].largest_gap, files[i].name,
+		       files[i].is_dir ? "/" : "");
+
+	printf("data_blocks=%llu used=%llu free=%llu score=%.3f\n",
+	       (unsigned long long)rep.data_blocks,
+	       (unsigned long long)rep.used_blocks,
+	       (unsigned long long)rep.free_blocks, rep.score);
+	printf("free_runs=%llu largest_free=%llu@%llu\n",
+	       (unsigned long long)rep.free_runs,
+	       (unsigned long long)rep.largest_free,
+	       (unsigned long long)rep.largest_free_start);
+	for (i = 0; i < FS_LAYOUT_HIST_BUCKETS; i++) {
+		if (rep.free_hist[i])
+			printf("free runs of %llu+ blocks: %llu\n",
+			       1ULL << i, (unsigned long long)rep.free_hist[i]);
+	}
+
+	len = strlen(map);
+	for (i = 0; (size_t)i < len; i += 64)
+		printf("|%.64s|\n", map + i);
+
+	free(files);
+	free(map);
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -258,6 +569,501 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_journal(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t nblocks;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <journal block count>");
+
+	diskname = t_arg->argv[0];
+	nblocks = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_journal_create(nblocks)) {
+		fs_umount();
+		die("Cannot create journal");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created journal of %zu blocks\n", nblocks);
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	struct fs_format_opts opts = { 0 };
+	size_t data_blocks;
+	int i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [wide] [bs=<bytes>] "
+		    "[files=<count>]");
+
+	diskname = t_arg->argv[0];
+	data_blocks = get_argv(t_arg->argv[1]);
+	for (i = 2; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "wide"))
+			opts.flags |= FS_FORMAT_WIDE;
+		else if (!strncmp(t_arg->argv[i], "bs=", 3))
+			opts.block_size = get_argv(t_arg->argv[i] + 3);
+		else if (!strncmp(t_arg->argv[i], "files=", 6))
+			opts.dir_entries = get_argv(t_arg->argv[i] + 6);
+		else
+			die("Unknown format option '%s'", t_arg->argv[i]);
+	}
+
+	if (fs_format(diskname, data_blocks, &opts))
+		die("Cannot format diskname");
+
+	printf("Created file system '%s' with %zu data blocks\n", diskname,
+	       data_blocks);
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+		+ (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void thread_fs_fsck(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_check_report rep;
+	int flags = FS_CHECK_VERBOSE;
+	unsigned int threads = 0;
+	struct timespec start;
+	double secs;
+	int found;
+	int i;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [repair] [threads=<count>]");
+
+	for (i = 1; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "repair"))
+			flags |= FS_CHECK_REPAIR;
+		else if (!strncmp(t_arg->argv[i], "threads=", 8))
+			threads = get_argv(t_arg->argv[i] + 8);
+		else
+			die("Unknown fsck option '%s'", t_arg->argv[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	found = fs_check(t_arg->argv[0], threads, flags, &rep);
+	secs = elapsed(&start);
+	if (found < 0)
+		die("Cannot check diskname");
+
+	printf("files=%llu dirs=%llu free_blocks=%llu\n",
+	       (unsigned long long)rep.files, (unsigned long long)rep.dirs,
+	       (unsigned long long)rep.free_blocks);
+	printf("bad_fat_entries=%llu bad_entries=%llu cycles=%llu "
+	       "cross_links=%llu\n",
+	       (unsigned long long)rep.bad_fat_entries,
+	       (unsigned long long)rep.bad_entries,
+	       (unsigned long long)rep.cycles,
+	       (unsigned long long)rep.cross_links);
+	printf("leaked_blocks=%llu size_mismatches=%llu dir_errors=%llu "
+	       "journal_errors=%llu\n",
+	       (unsigned long long)rep.leaked_blocks,
+	       (unsigned long long)rep.size_mismatches,
+	       (unsigned long long)rep.dir_errors,
+	       (unsigned long long)rep.journal_errors);
+	printf("journal_pending=%llu journal_replayed=%llu\n",
+	       (unsigned long long)rep.journal_pending,
+	       (unsigned long long)rep.journal_replayed);
+	printf("%d problems found, %llu repaired, in %.3f s\n", found,
+	       (unsigned long long)rep.repaired, secs);
+	if (found && !(flags & FS_CHECK_REPAIR))
+		exit(1);
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_defrag_opts opts = { 0 };
+	struct fs_defrag_report rep;
+	struct timespec start;
+	double secs;
+	int ret;
+	int i;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [ms=<time>] [blocks=<count>]");
+
+	for (i = 1; i < t_arg->argc; i++) {
+		if (!strncmp(t_arg->argv[i], "ms=", 3))
+			opts.time_ms = get_argv(t_arg->argv[i] + 3);
+		else if (!strncmp(t_arg->argv[i], "blocks=", 7))
+			opts.max_blocks = get_argv(t_arg->argv[i] + 7);
+		else
+			die("Unknown defrag option '%s'", t_arg->argv[i]);
+	}
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = fs_defrag(&opts, &rep);
+	secs = elapsed(&start);
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot defragment diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("score=%.3f->%.3f free_runs=%llu->%llu\n",
+	       rep.score_before, rep.score_after,
+	       (unsigned long long)rep.free_runs_before,
+	       (unsigned long long)rep.free_runs_after);
+	printf("%llu blocks moved in %.3f s%s\n",
+	       (unsigned long long)rep.blocks_moved, secs,
+	       ret ? ", out of budget" : "");
+}
+
+/* Host file behind a disk name, NULL for a RAM disk */
+static const char *host_path(const char *diskname)
+{
+	for (;;) {
+		if (!strncmp(diskname, "sim:", 4))
+			diskname += 4;
+		else if (!strncmp(diskname, "mmap:", 5))
+			diskname += 5;
+		else
+			break;
+	}
+
+	return strncmp(diskname, "ram:", 4) ? diskname : NULL;
+}
+
+void thread_fs_trim(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	const char *path;
+	size_t min_blocks = 0, trimmed;
+	struct stat before, after;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<min blocks>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		min_blocks = get_argv(t_arg->argv[1]);
+
+	path = host_path(diskname);
+	if (path && stat(path, &before))
+		die_perror("stat");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_trim(min_blocks, &trimmed)) {
+		fs_umount();
+		die("Cannot trim diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (!path) {
+		printf("Trimmed %zu free blocks\n", trimmed);
+		return;
+	}
+
+	if (stat(path, &after))
+		die_perror("stat");
+
+	printf("Trimmed %zu free blocks, host usage %lld -> %lld KiB\n",
+	       trimmed, (long long)before.st_blocks / 2,
+	       (long long)after.st_blocks / 2);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <stream file, - for stdout>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (!strcmp(filename, "-"))
+		fd = STDOUT_FILENO;
+	else if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		die_perror("open");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_export(fd)) {
+		fs_umount();
+		die("Cannot export diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (fd != STDOUT_FILENO)
+		close(fd);
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int flags = 0;
+	int fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <stream file, - for stdin> <diskname> [defrag]");
+
+	filename = t_arg->argv[0];
+	diskname = t_arg->argv[1];
+	if (t_arg->argc > 2 && !strcmp(t_arg->argv[2], "defrag"))
+		flags |= FS_IMPORT_DEFRAG;
+
+	if (!strcmp(filename, "-"))
+		fd = STDIN_FILENO;
+	else if ((fd = open(filename, O_RDONLY)) < 0)
+		die_perror("open");
+
+	if (fs_import(fd, diskname, flags))
+		die("Cannot import into diskname");
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+}
+
+void thread_fs_bench(void *arg)
+{
+	static const size_t default_sizes[] = {
+		4096, 16384, 65536, 262144, 1048576
+	};
+	struct thread_arg *t_arg = arg;
+	char *diskname, *buf, *check;
+	size_t mib, len, i, nsizes;
+	struct fs_stats st;
+	int fs_fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <file size in MiB> [<block size>...]");
+
+	diskname = t_arg->argv[0];
+	mib = get_argv(t_arg->argv[1]);
+	len = mib << 20;
+	nsizes = t_arg->argc > 2 ? t_arg->argc - 2 : ARRAY_SIZE(default_sizes);
+
+	if (!len || len > INT_MAX)
+		die("Invalid file size");
+
+	buf = malloc(len);
+	check = malloc(len);
+	if (!buf || !check)
+		die_perror("malloc");
+	for (i = 0; i < len; i++)
+		buf[i] = (char)(i * 31 + (i >> 12));
+
+	printf("FS Bench (%zu MiB file, wide format):\n", mib);
+	printf("%10s %12s %12s %10s %10s %12s\n", "block_size", "write_MiB/s",
+	       "read_MiB/s", "block_ios", "fat_hops", "fat_bytes");
+
+	for (i = 0; i < nsizes; i++) {
+		size_t bs = t_arg->argc > 2 ? get_argv(t_arg->argv[i + 2])
+			: default_sizes[i];
+		/* File blocks, plus the reserved FAT entry 0 */
+		size_t data_blocks = (len + bs - 1) / bs + 1;
+		size_t fat_blocks = (data_blocks + bs / 4 - 1) / (bs / 4);
+		struct fs_format_opts opts = { bs, 0, FS_FORMAT_WIDE };
+		double wtime, rtime;
+		struct timespec start;
+
+		if (fs_format(diskname, data_blocks, &opts))
+			die("Cannot format diskname with %zu byte blocks", bs);
+		fs_reset_stats();
+
+		/* Write includes the umount, which flushes the FAT */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (fs_mount(diskname) || fs_create("bench"))
+			die("Cannot create file");
+		fs_fd = fs_open("bench");
+		if (fs_fd < 0 || fs_write(fs_fd, buf, len) != (int)len)
+			die("Cannot write file");
+		fs_close(fs_fd);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		wtime = elapsed(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (fs_mount(diskname))
+			die("Cannot mount diskname");
+		fs_fd = fs_open("bench");
+		if (fs_fd < 0 || fs_read(fs_fd, check, len) != (int)len)
+			die("Cannot read file");
+		fs_close(fs_fd);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		rtime = elapsed(&start);
+
+		if (memcmp(buf, check, len))
+			die("Read back data differs with %zu byte blocks", bs);
+
+		fs_get_stats(&st);
+		printf("%10zu %12.1f %12.1f %10llu %10llu %12zu\n", bs,
+		       mib / wtime, mib / rtime,
+		       (unsigned long long)(st.block_reads + st.block_writes),
+		       (unsigned long long)st.fat_hops, fat_blocks * bs);
+	}
+
+	unlink(diskname);
+	free(buf);
+	free(check);
+}
+
+int run_command(const char *cmd, struct thread_arg *arg);
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg sub_arg;
+	struct fs_stats st;
+
+	if (t_arg->argc < 1)
+		die("Usage: <command> [<arg>]");
+
+	fs_reset_stats();
+
+	sub_arg.argc = t_arg->argc - 1;
+	sub_arg.argv = &t_arg->argv[1];
+	if (run_command(t_arg->argv[0], &sub_arg))
+		die("invalid command '%s'", t_arg->argv[0]);
+
+	fs_get_stats(&st);
+
+	printf("FS Stats:\n");
+	printf("block_reads=%llu\n", (unsigned long long)st.block_reads);
+	printf("block_writes=%llu\n", (unsigned long long)st.block_writes);
+	printf("bytes_read=%llu\n", (unsigned long long)st.bytes_read);
+	printf("bytes_written=%llu\n", (unsigned long long)st.bytes_written);
+	printf("fat_hops=%llu\n", (unsigned long long)st.fat_hops);
+	printf("alloc_scans=%llu\n", (unsigned long long)st.alloc_scans);
+	printf("alloc_entries_scanned=%llu\n",
+	       (unsigned long long)st.alloc_entries_scanned);
+	printf("umount_flushed=%llu\n", (unsigned long long)st.umount_flushed);
+	printf("syncs=%llu\n", (unsigned long long)st.syncs);
+	printf("sync_requests=%llu\n", (unsigned long long)st.sync_requests);
+	printf("journal_commits=%llu\n", (unsigned long long)st.journal_commits);
+	printf("journal_checkpoints=%llu\n",
+	       (unsigned long long)st.journal_checkpoints);
+	printf("journal_replayed=%llu\n", (unsigned long long)st.journal_replayed);
+	printf("cache_hits=%llu\n", (unsigned long long)st.cache_hits);
+	printf("cache_misses=%llu\n", (unsigned long long)st.cache_misses);
+	printf("dentry_hits=%llu\n", (unsigned long long)st.dentry_hits);
+	printf("dentry_misses=%llu\n", (unsigned long long)st.dentry_misses);
+	printf("blocks_discarded=%llu\n",
+	       (unsigned long long)st.blocks_discarded);
+	printf("bytes_spliced=%llu\n", (unsigned long long)st.bytes_spliced);
+}
+
+void thread_fs_lat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg sub_arg;
+
+	if (t_arg->argc < 1)
+		die("Usage: <command> [<arg>]");
+
+	fs_latency_reset();
+	fs_latency_enable(1);
+
+	sub_arg.argc = t_arg->argc - 1;
+	sub_arg.argv = &t_arg->argv[1];
+	if (run_command(t_arg->argv[0], &sub_arg))
+		die("invalid command '%s'", t_arg->argv[0]);
+
+	fs_latency_enable(0);
+	fs_latency_print();
+}
+
+void thread_fs_direct(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg sub_arg;
+	int flags = FS_IO_DIRECT, skip = 0;
+
+	if (t_arg->argc > 0 && !strcmp(t_arg->argv[0], "huge")) {
+		flags |= FS_IO_HUGEPAGE;
+		skip = 1;
+	}
+	if (t_arg->argc < skip + 1)
+		die("Usage: [huge] <command> [<arg>]");
+
+	if (fs_set_io_mode(flags))
+		die("Cannot set I/O mode");
+
+	sub_arg.argc = t_arg->argc - skip - 1;
+	sub_arg.argv = &t_arg->argv[skip + 1];
+	if (run_command(t_arg->argv[skip], &sub_arg))
+		die("invalid command '%s'", t_arg->argv[skip]);
+
+	fs_set_io_mode(0);
+}
+
+void thread_fs_sim(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg sub_arg;
+	struct block_sim_opts opts = { 0 };
+	int skip;
+
+	for (skip = 0; skip < t_arg->argc; skip++) {
+		char *opt = t_arg->argv[skip];
+
+		if (!strncmp(opt, "lat=", 4))
+			opts.latency_us = get_argv(opt + 4);
+		else if (!strncmp(opt, "jitter=", 7))
+			opts.jitter_us = get_argv(opt + 7);
+		else if (!strncmp(opt, "bw=", 3))
+			opts.bandwidth = get_argv(opt + 3);
+		else if (!strncmp(opt, "seed=", 5))
+			opts.seed = get_argv(opt + 5);
+		else if (!strcmp(opt, "virtual"))
+			opts.flags |= BLOCK_SIM_VIRTUAL;
+		else
+			break;
+	}
+	if (t_arg->argc < skip + 1)
+		die("Usage: [lat=<us>] [jitter=<us>] [bw=<bytes/s>] [seed=<n>] "
+		    "[virtual] <command> [<arg>]");
+
+	/* The sub-command's disks are simulated when named "sim:<diskname>" */
+	block_sim_config(&opts);
+
+	sub_arg.argc = t_arg->argc - skip - 1;
+	sub_arg.argv = &t_arg->argv[skip + 1];
+	if (run_command(t_arg->argv[skip], &sub_arg))
+		die("invalid command '%s'", t_arg->argv[skip]);
+
+	printf("sim_time_ms=%.3f\n", block_sim_time() / 1e6);
+	block_sim_config(NULL);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -266,6 +1072,79 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+#define AIOCAT_CHUNK (64 * 1024)
+
+void thread_fs_aiocat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	struct fs_aiocb *reqs, *done[16];
+	size_t stat, nreqs, i, read = 0;
+	unsigned int workers = 4;
+	int fs_fd, n, pending;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename> [<workers>]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		workers = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	stat = fs_stat(fs_fd);
+
+	/* One request per chunk, all in flight at once */
+	nreqs = (stat + AIOCAT_CHUNK - 1) / AIOCAT_CHUNK;
+	buf = calloc(1, stat + 1);
+	reqs = calloc(nreqs ? nreqs : 1, sizeof(*reqs));
+	if (!buf || !reqs)
+		die_perror("calloc");
+	if (fs_aio_start(workers))
+		die("Cannot start %u workers", workers);
+
+	for (i = 0; i < nreqs; i++) {
+		reqs[i].fd = fs_fd;
+		reqs[i].offset = i * AIOCAT_CHUNK;
+		reqs[i].buf = buf + reqs[i].offset;
+		reqs[i].count = stat - reqs[i].offset < AIOCAT_CHUNK ?
+			stat - reqs[i].offset : AIOCAT_CHUNK;
+		if (fs_read_async(&reqs[i]))
+			die("Cannot submit read");
+	}
+	for (pending = nreqs; pending > 0; pending -= n) {
+		n = fs_aio_poll(done, ARRAY_SIZE(done), -1);
+		for (i = 0; i < n; i++) {
+			if (done[i]->result != (int)done[i]->count)
+				die("Cannot read at offset %zu", done[i]->offset);
+			read += done[i]->result;
+		}
+	}
+	fs_aio_stop();
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Read file '%s' (%zu/%zu bytes, %zu requests)\n", filename,
+	       read, stat, nreqs);
+	printf("Content of the file:\n%s", buf);
+
+	free(reqs);
+	free(buf);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -275,9 +1154,43 @@ static struct {
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
+	{ "get",	thread_fs_get },
+	{ "aiocat",	thread_fs_aiocat },
 	{ "stat",	thread_fs_stat },
+	{ "stats",	thread_fs_stats },
+	{ "lat",	thread_fs_lat },
+	{ "direct",	thread_fs_direct },
+	{ "sim",	thread_fs_sim },
+	{ "journal",	thread_fs_journal },
+	{ "format",	thread_fs_format },
+	{ "fsck",	thread_fs_fsck },
+	{ "defrag",	thread_fs_defrag },
+	{ "trim",	thread_fs_trim },
+	{ "export",	thread_fs_export },
+	{ "import",	thread_fs_import },
+	{ "bench",	thread_fs_bench },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
+	{ "mv",		thread_fs_mv },
+	{ "cp",		thread_fs_cp },
+	{ "lsdir",	thread_fs_lsdir },
+	{ "du",		thread_fs_du },
+	{ "layout",	thread_fs_layout },
 };
 
+int run_command(const char *cmd, struct thread_arg *arg)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(arg);
+			return 0;
+		}
+	}
+	return -1;
+}
+
 void usage(void)
 {
 	int i;
@@ -290,7 +1203,6 @@ void usage(void)
 
 int main(int argc, char **argv)
 {
-	int i;
 	char *cmd;
 	struct thread_arg arg;
 
@@ -305,13 +1217,7 @@ int main(int argc, char **argv)
 	arg.argc = --argc;
 	arg.argv = &argv[1];
 
-	for (i = 0; i < ARRAY_SIZE(commands); i++) {
-		if (!strcmp(cmd, commands[i].name)) {
-			commands[i].func(&arg);
-			break;
-		}
-	}
-	if (i == ARRAY_SIZE(commands)) {
+	if (run_command(cmd, &arg)) {
 		test_fs_error("invalid command '%s'", cmd);
 		usage();
 	}